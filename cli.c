@@ -6,6 +6,10 @@
 #include "cli.h"
 #include "term.h"
 
+#if __ENABLE_SIMD__ && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 /****************************************************************************
  *
@@ -35,442 +39,3493 @@
  ****************************************************************************/
 
 
-#if __ENABLE_LOGIN__
-#define MAX_ID          (16)
+/*
+ * The layout of the arena, see CLI_ARENA_SIZE. The log slots go first for
+ * their alignment.
+ */
+#define OFS_LOGQ        (0)
+#define OFS_SESS        (OFS_LOGQ  + CLI_LOGQ_BYTES)
+#define OFS_EXEC        (OFS_SESS  + CLI_SESS_BYTES)
+#define OFS_WATCH       (OFS_EXEC  + CLI_EXEC_BYTES)
+
+#define ARENA(_ofs)     ((char *)cb->arena + (_ofs))
+
+
+/*
+ * With background jobs or shards the dispatcher runs in several threads at
+ * once, so its state is kept per thread.
+ */
+#if __ENABLE_JOBS__ || __ENABLE_SHARDS__
+#define CLI_TLS         __thread
+#define MOD_SLOTS       MOD_READER_SLOTS
+#else
+#define CLI_TLS
+#define MOD_SLOTS       (1)
+#endif
+
+#if __ENABLE_JOBS__
+#define IN_JOB          (job_cur != NULL)
+#else
+#define IN_JOB          (0)
+#endif
+
+
+/*
+ * Token offsets are kept in a byte, and the line of a session also holds the
+ * login id while the password is being typed.
+ */
+#if MAX_LINE >= 255
+#error "MAX_LINE must be below 255"
+#endif
+
+#if __ENABLE_LOGIN__ && MAX_LINE < MAX_ID * 2 + 1
+#error "MAX_LINE must hold both login id and password"
+#endif
+
+#define SESS_ID(_s)     ((_s)->line + CLI_LINE_BYTES - (MAX_ID + 1))
+
+
+#if __ENABLE_HISTORY__
+/*
+ * The history region, see cli_hist_t. An entry is a word of its length and
+ * its seal, then the line with its '\0', padded to 4 bytes. The word is 0
+ * past the tail, claimed with the length, and sealed once the line is in.
+ */
+#define HIST_MAGIC      (0x48495354)    // "HIST"
+#define HIST_CLAIM      (0xC1A1)
+#define HIST_SEAL       (0x5EA1)
+
+#define HIST_REC(_h, _ofs)  ((cli_hist_rec_t *)((char *)(_h)->hdr + (_ofs)))
+#define HIST_SIZE(_len)     ((sizeof(cli_hist_rec_t) + (_len) + 1 + 3) & ~3u)
+
+#define HIST_HEAD(_len, _seal)  ((uint32_t)(_seal) << 16 | (_len))
+#define HIST_LEN(_head)         ((_head) & 0xFFFF)
+#define HIST_SEALED(_head)      ((_head) >> 16 == HIST_SEAL)
+#endif
+
+
+#ifdef __ENABLE_HARDCODE_LOGIN__
+#define LOGIN_ID        "a"
+#define LOGIN_PASSWD    "a"
+#endif
+
+
+/****************************************************************************
+ *
+ * Types.
+ *
+ ****************************************************************************/
+
+
+/*
+ * What the line of a session is edited for, see cli_sess_t.mode.
+ */
+enum {
+    MODE_CMD,
+    MODE_ID,
+    MODE_PASS,
+    MODE_WAIT,      // for cli_t.knock_async
+    MODE_SEARCH     // ctrl-r, 'line' is the text searched for
+};
+
+
+/*
+ * The result of editing a line by one key.
+ */
+enum {
+    EDIT_MORE,
+    EDIT_DONE,
+    EDIT_CANCEL
+};
+
+
+#if __ENABLE_HISTORY__
+/*
+ * An entry of the history region.
+ */
+typedef struct {
+    uint32_t        head;       // HIST_HEAD()
+    char            line[];
+} cli_hist_rec_t;
+#endif
+
+
+#if __ENABLE_JOBS__
+/*
+ * The state of a cli_job_t.
+ */
+enum {
+    JOB_FREE,
+    JOB_FILL,       // being queued
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE
+};
+#endif
+
+
+/****************************************************************************
+ *
+ * Static variables.
+ *
+ ****************************************************************************/
+
+
+/**
+ * The CLI being served.
+ */
+static CLI_TLS cli_t        *cb;
+
+
+/**
+ * Where the output goes: cli_t.put of the session being served, or what
+ * cli_exec(), the cache or the mirror put in its place for this thread
+ * only, since the cli_t may serve other threads.
+ */
+static CLI_TLS putch_fptr   put;
+
+
+/**
+ * The output sink of cli_exec() and the number of bytes produced into it.
+ */
+static CLI_TLS cli_sink_t   *sink;
+static CLI_TLS size_t       sink_total;
+static CLI_TLS uint8_t      exec_depth;
+
+
+/**
+ * The tokens of the line being dispatched, as offsets into 'tok_line'.
+ */
+static CLI_TLS char         *tok_line;
+static CLI_TLS uint8_t      tok_cnt;
+static CLI_TLS uint8_t      tok[MAX_TOKENS];
+
+
+/**
+ * The arena of the cli_t which does not bring its own.
+ */
+static uint32_t     arena[(CLI_ARENA_SIZE + 3) / 4];
+
+
+#if __ENABLE_JOBS__
+/**
+ * The job run by this thread, and the buffers of cli_exec() for it.
+ */
+static CLI_TLS cli_job_t    *job_cur;
+static CLI_TLS char         job_exec[CLI_EXEC_BYTES];
+
+
+/**
+ * Whether cli_input() is dispatching for an event loop, which 'fg' must not
+ * block.
+ */
+static CLI_TLS bool         in_loop;
+#endif
+
+
+#if __ENABLE_CACHE__
+/**
+ * The cache entry being rendered and the putch_fptr it passes output on to.
+ */
+static CLI_TLS cli_cache_ent_t  *cache_fill;
+static CLI_TLS putch_fptr       cache_put;
+#endif
+
+
+#if __ENABLE_MIRROR__
+/**
+ * The mirror of the session being served and the putch_fptr it passes
+ * output on to.
+ */
+static CLI_TLS cli_mirror_t     *mirror_cur;
+static CLI_TLS putch_fptr       mirror_put;
+#endif
+
+
+#if __ENABLE_WATCH__
+/**
+ * The watch buffers are not nestable.
+ */
+static CLI_TLS bool watching;
+#endif
+
+
+#if __ENABLE_MODULES__
+/**
+ * The attached modules, shared by all cli_t and threads.
+ *
+ * Readers never lock. A dispatch counts itself in the counter of its thread
+ * selected by the low bit of 'mod_epoch'. cli_detach() unlinks, then flips
+ * the epoch and waits for the counters of that side to drain in every slot;
+ * afterwards no dispatch which could have seen the module is left.
+ *
+ * Each thread takes a slot of its own, a cache line, the first time it
+ * dispatches, so the shards do not bounce a shared counter between their
+ * cores. Threads beyond MOD_SLOTS share slots, which is only slower.
+ */
+typedef struct {
+    uint32_t        n[2];
+} __attribute__((aligned(64))) mod_rd_t;
+
+static cli_mod_t    *mod_head;
+static uint32_t     mod_gen;        // changes with the tree, see cli_alias_t
+static uint32_t     mod_epoch;
+static uint32_t     mod_slots;      // slots handed out so far
+static mod_rd_t     mod_readers[MOD_SLOTS];
+static uint8_t      mod_writer;
+
+/* the slot of this thread */
+static CLI_TLS mod_rd_t *mod_rd;
+
+/* the section of the line being dispatched, see _cli_mod_pause() */
+static CLI_TLS uint32_t mod_idx;
+#endif
+
+
+/****************************************************************************
+ *
+ * Local functions.
+ *
+ ****************************************************************************/
+
+
+/*
+ * The i-th token of the line being dispatched, NULL if there is none.
+ */
+static char *_cli_tok(int i)
+{
+    return i < tok_cnt ? tok_line + tok[i] : NULL;
+}
+
+
+#if __ENABLE_WATCH__ || __ENABLE_CACHE__ || __ENABLE_JOBS__ || __ENABLE_ALIAS__
+/*
+ * Join the tokens 'from' .. 'to' - 1 into 'buf', one space apart. As they
+ * come from one line, the result fits into CLI_LINE_BYTES.
+ */
+static uint8_t _cli_tok_join(char *buf, int from, int to)
+{
+    uint8_t     n = 0;
+    int         i;
+
+    buf[0] = '\0';
+    for (i = from; i < to; i++) {
+        if (i > from)
+            buf[n++] = ' ';
+        strcpy(buf + n, _cli_tok(i));
+        n += strlen(buf + n);
+    }
+
+    return n;
+}
+#endif
+
+
+#if __ENABLE_CACHE__
+/*
+ * Whether 'key' is what _cli_tok_join() would make of all the tokens.
+ */
+static bool _cli_tok_is(const char *key)
+{
+    const char  *t;
+    int         i;
+
+    for (i = 0; i < tok_cnt; i++) {
+        if (i && *key++ != ' ')
+            return false;
+        for (t = _cli_tok(i); *t; t++)
+            if (*key++ != *t)
+                return false;
+    }
+
+    return *key == '\0';
+}
+#endif
+
+
+#ifdef __ENABLE_HARDCODE_LOGIN__
+static uint8_t _cli_hardcode_login(char *id, char *pass)
+{
+    return (!strcmp(id, LOGIN_ID) && !strcmp(pass, LOGIN_PASSWD));
+}
+#endif
+
+
+/*
+ * The putch_fptr installed by cli_exec(), writes into the current sink.
+ */
+static void _cli_sink_put(char c)
+{
+    sink_total++;
+
+    if (sink->len + 1 < sink->size) {
+        sink->buf[sink->len++] = c;
+        sink->buf[sink->len]   = '\0';
+    }
+
+    if (sink->put)
+        sink->put(c);
+}
+
+
+/*
+ * Parse tokens
+ *
+ * A token starts at each non-space which follows a space, and at 0 even if
+ * the line starts with a space. Where SSE2 is available 16 bytes are
+ * compared at once and the starts are taken from the bit mask of spaces,
+ * the tail is done byte by byte.
+ *
+ * Note: the spaces in the line are modified to '\0'. Anything after
+ *       MAX_TOKENS tokens is ignored.
+ */
+static inline int _cli_tokens(char *line, bool simd)
+{
+    size_t      len   = strlen(line);
+    size_t      i     = 0;
+    uint32_t    carry = 1;  // the byte before was a space
+    int         toks  = 0;
+
+    tok_line = line;
+
+    if (line[0] == ' ')
+        tok[toks++] = 0;
+
+#if __ENABLE_SIMD__ && defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(' ');
+
+    for (; simd && i + 16 <= len; i += 16) {
+        __m128i     v  = _mm_loadu_si128((const __m128i *)(line + i));
+        __m128i     eq = _mm_cmpeq_epi8(v, space);
+        uint32_t    sp = _mm_movemask_epi8(eq);
+        uint32_t    st = ~sp & ((sp << 1) | carry) & 0xffff;
+
+        _mm_storeu_si128((__m128i *)(line + i), _mm_andnot_si128(eq, v));
+        carry = sp >> 15;
+
+        for (; st && toks < MAX_TOKENS; st &= st - 1)
+            tok[toks++] = i + __builtin_ctz(st);
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (line[i] == ' ') {
+            line[i] = '\0';
+            carry   = 1;
+        } else {
+            if (carry && toks < MAX_TOKENS)
+                tok[toks++] = i;
+            carry = 0;
+        }
+    }
+
+    tok_cnt = toks;
+
+    return toks;
+}
+
+
+static int _cli_line_to_tokens(char *line)
+{
+    return _cli_tokens(line, true);
+}
+
+
+#if __ENABLE_MODULES__
+/*
+ * Enter and exit a section which uses the modules, see 'mod_epoch'.
+ */
+static uint32_t _cli_mod_enter(void)
+{
+    uint32_t    idx;
+
+    if (!mod_rd)
+        mod_rd = &mod_readers[__atomic_fetch_add(&mod_slots, 1,
+                                                 __ATOMIC_RELAXED) % MOD_SLOTS];
+
+    idx = __atomic_load_n(&mod_epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&mod_rd->n[idx], 1, __ATOMIC_SEQ_CST);
+
+    return idx;
+}
+
+
+static void _cli_mod_exit(uint32_t idx)
+{
+    __atomic_fetch_sub(&mod_rd->n[idx], 1, __ATOMIC_RELEASE);
+}
+
+
+#if __ENABLE_WATCH__
+/*
+ * Leave the section of the line being dispatched while its handler waits
+ * for long, e.g. for a key, so that cli_detach() is not held up. Nothing
+ * found among the modules before may be used until _cli_mod_resume().
+ */
+static void _cli_mod_pause(void)
+{
+    _cli_mod_exit(mod_idx);
+}
+
+
+static void _cli_mod_resume(void)
+{
+    mod_idx = _cli_mod_enter();
+}
+#endif
+#endif
+
+
+/*
+ * Find the fully matched command.
+ *
+ * @note    Duplicated commands were not considered because of space and CPU
+ *          resource limit. Programmers MUST be careful when design command
+ *          table.
+ */
+static const cmd_t *_cli_find_one_match(const cmd_t *cmd_p, char *str)
+{
+    const cmd_t *match = NULL;
+#if __ENABLE_MODULES__
+    const cmd_t *level = cmd_p;
+    cli_mod_t   *mod   = __atomic_load_n(&mod_head, __ATOMIC_ACQUIRE);
+#endif
+#if __ENABLE_CMD_INDEX__
+    const cmd_t *p;
+    uint8_t     lo     = 0;
+    uint8_t     hi     = cmd_p->count;
+    uint8_t     mid;
+    int         d;
+
+    /* sorted by cli::make_table() */
+    while (lo < hi && !match) {
+        mid = (lo + hi) / 2;
+        p   = &cmd_p[cmd_p[mid].order];
+        d   = strcmp(p->cmd, str);
+        if (d == 0)
+            match = p;
+        else if (d < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (cmd_p->count)
+        cmd_p += cmd_p->count;
+#endif
+
+    while (cmd_p->cmd != NULL && !match) {
+        if (!strcmp(cmd_p->cmd, str))
+            match = cmd_p;
+        cmd_p++;
+    }
+
+#if __ENABLE_MODULES__
+    for (; mod && !match; mod = __atomic_load_n(&mod->next, __ATOMIC_ACQUIRE))
+        if (mod->level == level)
+            match = _cli_find_one_match(mod->cmd, str);
+#endif
+
+    return match;
+}
+
+
+/*
+ * A level of the command tree is named by the command owning it, NULL for
+ * the top level. Its commands are the static table, the attached modules
+ * and, for a lazy command, whatever its callback produces.
+ */
+#if __ENABLE_LAZY_CMD__
+#define HAS_SUB(_p)     ((_p)->sub || (_p)->lazy)
+#else
+#define HAS_SUB(_p)     ((_p)->sub)
+#endif
+
+#define LEVEL(_parent)  ((_parent) ? (_parent)->sub : cb->cmd)
+
+
+static const cmd_t *_cli_find(const cmd_t *parent, char *str)
+{
+    const cmd_t *match = NULL;
+
+    if (LEVEL(parent))
+        match = _cli_find_one_match(LEVEL(parent), str);
+
+#if __ENABLE_LAZY_CMD__
+    if (!match && parent && parent->lazy)
+        match = parent->lazy(str, NULL);
 #endif
 
+    return match;
+}
+
+
+typedef void (*visit_fptr)(const cmd_t *p, void *ctx);
+
+/*
+ * Call 'visit' for every visible command of the table 'p' and the modules
+ * attached to it whose name starts with the 'n' bytes of 'prefix'.
+ *
+ * If the first character of the help message is 0x01, this command is hidden
+ * and will not be visited.
+ */
+static void _cli_each_table(const cmd_t *p, const char *prefix, size_t n,
+                            visit_fptr visit, void *ctx)
+{
+#if __ENABLE_MODULES__
+    const cmd_t *level = p;
+    cli_mod_t   *mod   = __atomic_load_n(&mod_head, __ATOMIC_ACQUIRE);
+#endif
+
+    for (; p->cmd != NULL; p++)
+        if (!(p->help && p->help[0] == 0x01) && !strncmp(p->cmd, prefix, n))
+            visit(p, ctx);
+
+#if __ENABLE_MODULES__
+    /* the modules attached to it, as _cli_find_one_match() goes through them */
+    for (; mod; mod = __atomic_load_n(&mod->next, __ATOMIC_ACQUIRE))
+        if (mod->level == level)
+            _cli_each_table(mod->cmd, prefix, n, visit, ctx);
+#endif
+}
+
+
+/*
+ * Call 'visit' for every visible command of the level of 'parent' whose name
+ * starts with 'prefix'.
+ */
+static void _cli_each(const cmd_t *parent, const char *prefix, visit_fptr visit, void *ctx)
+{
+#if __ENABLE_LAZY_CMD__
+    lazy_fptr   lazy   = parent ? parent->lazy : NULL;
+    uint32_t    iter   = 0;
+    const cmd_t *p;
+#endif
+
+    if (LEVEL(parent))
+        _cli_each_table(LEVEL(parent), prefix, strlen(prefix), visit, ctx);
+
+#if __ENABLE_LAZY_CMD__
+    if (lazy)
+        while ((p = lazy(prefix, &iter)) != NULL)
+            if (!(p->help && p->help[0] == 0x01))
+                visit(p, ctx);
+#endif
+}
+
+
+/*
+ * Show the help message of one command.
+ *
+ * The help messages are aligned, and if the command length gets longer, the
+ * output will be shifted too.
+ */
+static void _cli_show_help_one(const cmd_t *p, void *ctx)
+{
+    int     *min = ctx;
+    int     len;
+
+    len = strlen(p->cmd);
+    if (len > *min)
+        *min = len;
+
+    cli_puts(p->cmd);
+
+    /* if there is no help message, skip display */
+    if (p->help) {
+        len = *min - len;
+        do {
+            put(' ');
+        } while (len-- > 0);
+
+        put('-');
+        put(' ');
+        cli_puts(p->help);
+    }
+
+    put('\n');
+}
+
+
+/*
+ * Show the help messages of every command at the level of 'parent'.
+ */
+static void _cli_do_show_help(const cmd_t *parent)
+{
+    int     min = 6;
+
+#if __ENABLE_CMD_INDEX__
+    /* aligned from the first line on, if known */
+    if (LEVEL(parent) && LEVEL(parent)->width > min)
+        min = LEVEL(parent)->width;
+#endif
+
+    _cli_each(parent, "", _cli_show_help_one, &min);
+}
+
+
+#if __ENABLE_CACHE__
+/*
+ * The putch_fptr installed while a cached command renders. Output beyond
+ * MAX_CACHE_OUT is only counted, which marks the entry as not cacheable.
+ */
+static void _cli_cache_put(char c)
+{
+    if (cache_fill->len < MAX_CACHE_OUT)
+        cache_fill->out[cache_fill->len] = c;
+    if (cache_fill->len <= MAX_CACHE_OUT)
+        cache_fill->len++;
+
+    cache_put(c);
+}
+
+
+/*
+ * The entry of the line being dispatched if there is one, else an unused
+ * entry, else the oldest.
+ */
+static cli_cache_ent_t *_cli_cache_find(cli_cache_t *cache, const cmd_t *cmd_p,
+                                        uint32_t now)
+{
+    cli_cache_ent_t *e;
+    cli_cache_ent_t *victim = cache->ent;
+    uint32_t        i;
+
+    for (i = 0; i < cache->n; i++) {
+        e = &cache->ent[i];
+
+        if (e->cmd == cmd_p && _cli_tok_is(e->key))
+            return e;
+
+        if (victim->cmd &&
+            (!e->cmd || now - e->stamp > now - victim->stamp))
+            victim = e;
+    }
+
+    return victim;
+}
+
+
+/*
+ * Replay the output of the command line being dispatched from the cache, or
+ * call the handler and keep its output.
+ */
+static void _cli_cache_call(const cmd_t *cmd_p, uint8_t len, uint8_t i)
+{
+    cli_cache_t     *cache = cb->cache;
+    cli_cache_ent_t *e;
+    uint32_t        now    = cache->now();
+    uint16_t        j;
+
+    /* the key is only made when stored, there is no room for it otherwise */
+    e = _cli_cache_find(cache, cmd_p, now);
+    if (e->cmd == cmd_p && _cli_tok_is(e->key) &&
+        now - e->stamp < cmd_p->ttl) {
+        cache->hits++;
+        for (j = 0; j < e->len; j++)
+            put(e->out[j]);
+        return;
+    }
+
+    cache->misses++;
+    e->cmd   = cmd_p;
+    e->stamp = now;
+    e->len   = 0;
+    _cli_tok_join(e->key, 0, tok_cnt);
+
+    cache_fill = e;
+    cache_put  = put;
+    put        = _cli_cache_put;
+
+    cmd_p->fptr(len, _cli_tok(i + 1));
+
+    put        = cache_put;
+    cache_fill = NULL;
+
+    if (e->len > MAX_CACHE_OUT)
+        e->cmd = NULL;
+}
+#endif
+
+
+#if __ENABLE_MIRROR__
+/*
+ * Take a reference of 'seg' unless it has none, i.e. it is free.
+ */
+static uint8_t _cli_mirror_hold(cli_mirror_seg_t *seg)
+{
+    uint32_t    refs = __atomic_load_n(&seg->refs, __ATOMIC_RELAXED);
+
+    do {
+        if (!refs)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&seg->refs, &refs, refs + 1, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    return 1;
+}
+
+
+static void _cli_mirror_drop(cli_mirror_seg_t *seg)
+{
+    __atomic_fetch_sub(&seg->refs, 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * A free segment of the pool for the session to fill. There is always one
+ * unless the pool is smaller than cli_mirror_init() asks for.
+ */
+static cli_mirror_seg_t *_cli_mirror_take(cli_mirror_t *m)
+{
+    cli_mirror_seg_t    *seg;
+    uint16_t            i;
+
+    /*
+     * Only the session takes a reference of a free segment, so it stays
+     * free until then. A reader which holds it next sees it is not the
+     * segment it was looking for.
+     */
+    for (i = 0; i < m->n; i++) {
+        seg = &m->seg[(m->head + i) % m->n];
+        if (!__atomic_load_n(&seg->refs, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&seg->seq, ~0u, __ATOMIC_RELAXED);
+            __atomic_store_n(&seg->refs, 1, __ATOMIC_RELEASE);
+            seg->len = 0;
+            m->since = m->now ? m->now() : 0;
+            return seg;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Publish the segment being filled. The ring passes the reference of the
+ * session on to the readers, and drops its own on the segment it replaces.
+ */
+static void _cli_mirror_publish(cli_mirror_t *m)
+{
+    cli_mirror_seg_t    *seg  = m->fill;
+    cli_mirror_seg_t    **slot = &m->ring[m->head % m->depth];
+    cli_mirror_seg_t    *old  = *slot;
+
+    __atomic_store_n(&seg->seq, m->head, __ATOMIC_RELEASE);
+    __atomic_store_n(slot, seg, __ATOMIC_RELEASE);
+    __atomic_store_n(&m->head, m->head + 1, __ATOMIC_RELEASE);
+    m->fill = NULL;
+
+    if (old)
+        _cli_mirror_drop(old);
+}
+
+
+/*
+ * The putch_fptr installed while a mirrored session is served. Output the
+ * pool has no room for is not mirrored.
+ */
+static void _cli_mirror_put(char c)
+{
+    cli_mirror_t    *m = mirror_cur;
+
+    if (!m->fill)
+        m->fill = _cli_mirror_take(m);
+
+    if (m->fill) {
+        m->fill->data[m->fill->len++] = c;
+        if (m->fill->len == MIRROR_SEG)
+            _cli_mirror_publish(m);
+    }
+
+    mirror_put(c);
+}
+
+
+/*
+ * Start, and end, copying the output of the session being served.
+ */
+static void _cli_mirror_begin(void)
+{
+    cli_mirror_t    *m = cb->sess->mirror;
+
+    if (!m || mirror_cur)
+        return;
+
+    mirror_cur = m;
+    mirror_put = put;
+    put        = _cli_mirror_put;
+}
+
+
+/*
+ * Publish 'all' the output so far, or only its whole lines unless the
+ * partial line after them has waited MIRROR_MS. The partial line moves to
+ * a segment of its own.
+ */
+static void _cli_mirror_end(bool all)
+{
+    cli_mirror_t        *m   = mirror_cur;
+    cli_mirror_seg_t    *seg;
+    uint16_t            n, len;
+
+    if (!m)
+        return;
+
+    put        = mirror_put;
+    mirror_cur = NULL;
+
+    seg = m->fill;
+    if (!seg || !seg->len)
+        return;
+
+    if (!all && !(m->now && m->now() - m->since >= MIRROR_MS)) {
+        for (n = seg->len; n && seg->data[n - 1] != '\n'; n--)
+            ;
+        if (!n)
+            return;
+
+        /* the ring holds 'seg' from now on, so the rest can be copied */
+        len      = seg->len;
+        seg->len = n;
+        _cli_mirror_publish(m);
+        if (n < len && (m->fill = _cli_mirror_take(m)) != NULL) {
+            memcpy(m->fill->data, seg->data + n, len - n);
+            m->fill->len = len - n;
+        }
+        return;
+    }
+
+    _cli_mirror_publish(m);
+}
+#endif
+
+
+/*
+ * Call the handler of 'cmd_p', which is the i-th token.
+ */
+static void _cli_call(const cmd_t *cmd_p, uint8_t len, uint8_t i)
+{
+#if __ENABLE_CACHE__
+    /*
+     * commands run by a command being cached are not cached themselves, and
+     * the cache is not shared with the threads running jobs
+     */
+    if (cmd_p->ttl && cb->cache && !cache_fill && !IN_JOB) {
+        _cli_cache_call(cmd_p, len, i);
+        return;
+    }
+#endif
+
+    cmd_p->fptr(len, _cli_tok(i + 1));
+}
+
+
+static void _cli_do_cmd_no_sub(uint8_t len, uint8_t i, const cmd_t *cmd_p)
+{
+    if (cmd_p->fptr) {
+        _cli_call(cmd_p, len - i, i);
+    } else {
+        cli_puts(_cli_tok(i));
+        cli_puts(" not handled\n");
+    }
+}
+
+
+static void _cli_do_cmd_no_token(uint8_t len, uint8_t i, const cmd_t *cmd_p)
+{
+    if (cmd_p->fptr) {
+        _cli_call(cmd_p, len - i, i);
+    } else if (HAS_SUB(cmd_p)) {
+        cli_puts("incomplete command, more options:\n");
+        _cli_do_show_help(cmd_p);
+    } else {
+        cli_puts(_cli_tok(i));
+        cli_puts(" not handled\n");
+    }
+}
+
+
+#if __ENABLE_JOBS__
+/*
+ * Queue the first 'toks' tokens, which were followed by "&", as a job of the
+ * session being served.
+ */
+static void _cli_job_start(int toks)
+{
+    cli_jobs_t  *jobs = cb->jobs;
+    cli_job_t   *j    = NULL;
+    uint8_t     st;
+    uint32_t    i;
+
+    for (i = 0; i < jobs->n && !j; i++) {
+        st = JOB_FREE;
+        if (__atomic_compare_exchange_n(&jobs->job[i].state, &st, JOB_FILL,
+                                        false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            j = &jobs->job[i];
+    }
+
+    if (!j) {
+        cli_puts("too many jobs\n");
+        return;
+    }
+
+    _cli_tok_join(j->line, 0, toks);
+    /* 0 stands for the last job, skip it when the ids wrap */
+    do {
+        j->id = __atomic_add_fetch(&jobs->last_id, 1, __ATOMIC_RELAXED);
+    } while (!j->id);
+    j->kill  = 0;
+    j->fg    = 0;
+    j->len   = 0;
+    j->total = 0;
+    j->sess  = cb->sess;
+    j->cli   = *cb;
+
+    /* the session thread goes on with the session, the job with its copy */
+    memcpy(j->copy, cb->sess, CLI_SESS_BYTES);
+    j->cli.sess = (cli_sess_t *)j->copy;
+
+    cli_putc('[');
+    cli_putd(j->id);
+    cli_puts("] ");
+    cli_puts(j->line);
+    cli_putln();
+
+    __atomic_store_n(&j->state, JOB_QUEUED, __ATOMIC_RELEASE);
+    if (jobs->wake)
+        jobs->wake();
+}
+
+
+/*
+ * The job 'id' of the session being served, its last job if 'id' is 0.
+ * Killed jobs are gone for the session even if they are still running.
+ */
+static cli_job_t *_cli_job_find(uint16_t id)
+{
+    cli_jobs_t  *jobs  = cb->jobs;
+    cli_job_t   *found = NULL;
+    cli_job_t   *j;
+    uint32_t    i;
+
+    for (i = 0; jobs && i < jobs->n; i++) {
+        j = &jobs->job[i];
+
+        if (__atomic_load_n(&j->state, __ATOMIC_ACQUIRE) < JOB_QUEUED ||
+            __atomic_load_n(&j->kill, __ATOMIC_RELAXED) ||
+            j->sess != cb->sess)
+            continue;
+
+        if (id ? j->id == id : !found || (int16_t)(j->id - found->id) > 0)
+            found = j;
+    }
+
+    return found;
+}
+
+
+/*
+ * Show the output of 'j' and forget it, if it is done.
+ *
+ * @retval  0   if it is still queued or running.
+ *              other values if it is gone.
+ */
+static uint8_t _cli_job_show(cli_job_t *j)
+{
+    uint8_t     st = __atomic_load_n(&j->state, __ATOMIC_ACQUIRE);
+    uint16_t    i;
+
+    if (st == JOB_QUEUED || st == JOB_RUNNING)
+        return 0;
+
+    /* killed meanwhile */
+    if (st != JOB_DONE)
+        return 1;
+
+    for (i = 0; i < j->len; i++)
+        put(j->out[i]);
+
+    if (j->total > j->len) {
+        cli_putd(j->total - j->len);
+        cli_puts(" bytes dropped\n");
+    }
+
+    __atomic_store_n(&j->state, JOB_FREE, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+
+/*
+ * Forget 'j'. A queued job never runs, a running one is forgotten when it
+ * returns.
+ */
+static void _cli_job_kill(cli_job_t *j)
+{
+    uint8_t     st = JOB_QUEUED;
+
+    if (!__atomic_compare_exchange_n(&j->state, &st, JOB_FREE, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&j->kill, 1, __ATOMIC_RELEASE);
+        st = JOB_DONE;
+        __atomic_compare_exchange_n(&j->state, &st, JOB_FREE, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * The job id given to 'fg' or 'kill', 0 if none.
+ */
+static uint16_t _cli_job_id(const char *param)
+{
+    uint16_t    id = 0;
+
+    while (param && *param >= '0' && *param <= '9')
+        id = id * 10 + *param++ - '0';
+
+    return id;
+}
+#endif
+
+
+/*
+ * Tokenize 'line' and dispatch it through the command tree.
+ *
+ * Note: Use interative instead of recursive to avoid stack overflow.
+ */
+static void _cli_do_line(char *line)
+{
+    int         toks;
+    int         i;
+    const cmd_t *cmd_p  = NULL;
+    const cmd_t *parent = NULL;
+
+    toks = _cli_line_to_tokens(line);
+
+#if __ENABLE_JOBS__
+    if (toks > 1 && cb->jobs && !IN_JOB && !strcmp(_cli_tok(toks - 1), "&")) {
+        _cli_job_start(toks - 1);
+        toks = 0;
+    }
+#endif
+
+    /* traverse command tree */
+    for (i = 0; i < toks; i++) {
+        /* help */
+        if (!strcmp(_cli_tok(i), "?")) {
+            _cli_do_show_help(parent);
+            break;
+        }
+
+        /* find match command */
+        cmd_p = _cli_find(parent, _cli_tok(i));
+        if (!cmd_p) {
+            cli_puts(_cli_tok(i));
+            cli_puts(" unknown command\n");
+            break;
+        }
+
+        /* out of tokens */
+        if (i == toks - 1) {
+            _cli_do_cmd_no_token(toks, i, cmd_p);
+            break;
+        }
+
+        /* there are remaining tokens but no sub commands */
+        if (!HAS_SUB(cmd_p)) {
+             _cli_do_cmd_no_sub(toks, i, cmd_p);
+             break;
+        }
+
+        /* descend to next level */
+        parent = cmd_p;
+    }
+}
+
+
+#if __ENABLE_ALIAS__
+/*
+ * The generation of the command tree, see cli_alias_t.
+ */
+static uint32_t _cli_alias_gen(void)
+{
+#if __ENABLE_MODULES__
+    return __atomic_load_n(&mod_gen, __ATOMIC_SEQ_CST);
+#else
+    return 0;
+#endif
+}
+
+
+/*
+ * The entry of the alias named by the 'len' bytes of 'name', whose FNV-1a
+ * hash is 'h'. Else NULL, or with 'take' the first entry it may use.
+ */
+static cli_alias_ent_t *_cli_alias_find(cli_alias_t *a, const char *name,
+                                        size_t len, uint32_t h, bool take)
+{
+    cli_alias_ent_t *e    = NULL;
+    cli_alias_ent_t *free = NULL;
+    uint32_t        i     = h & a->mask;
+    uint32_t        k;
+
+    /* undefined entries keep their name, the table may have no empty one */
+    for (k = 0; k <= a->mask; k++, i = (i + 1) & a->mask) {
+        e = &a->ent[i];
+        if (!e->name[0])
+            break;
+        if (!strncmp(e->name, name, len) && !e->name[len])
+            return e;
+        if (!e->n && !free)
+            free = e;
+    }
+
+    return !take ? NULL : free ? free : e->name[0] ? NULL : e;
+}
+
+
+static uint32_t _cli_alias_hash(const char *name, size_t len)
+{
+    uint32_t    h = 2166136261u;
+
+    while (len--)
+        h = (h ^ (uint8_t)*name++) * 16777619u;
+
+    return h;
+}
+
+
+/*
+ * Resolve the 'len' bytes of 'text' as _cli_do_line() would dispatch them.
+ * Lines which only the dispatch can tell, e.g. help, a job or a lazy level,
+ * keep 'cmd' NULL. Returns 0 if a command is unknown.
+ */
+static uint8_t _cli_alias_resolve(cli_alias_step_t *st, const char *text,
+                                  size_t len)
+{
+    const cmd_t *parent = NULL;
+    const cmd_t *cmd_p;
+    int         toks;
+    int         i;
+
+    memcpy(st->line, text, len);
+    st->line[len] = '\0';
+    st->len       = len;
+    st->cmd       = NULL;
+
+    toks     = _cli_line_to_tokens(st->line);
+    st->toks = toks;
+    memcpy(st->tok, tok, toks);
+
+    for (i = 0; i < toks; i++) {
+        if (!strcmp(_cli_tok(i), "?"))
+            return 1;
+#if __ENABLE_LAZY_CMD__
+        if (parent && parent->lazy)
+            return 1;
+#endif
+
+        cmd_p = _cli_find(parent, _cli_tok(i));
+        if (!cmd_p)
+            return 0;
+
+        if (i == toks - 1 || !HAS_SUB(cmd_p)) {
+            if (cmd_p->fptr && strcmp(_cli_tok(toks - 1), "&")) {
+                st->cmd   = cmd_p;
+                st->depth = i;
+            }
+            return 1;
+        }
+
+        parent = cmd_p;
+    }
+
+    return toks != 0;
+}
+
+
+/*
+ * Resolve 'text', lines separated by ';', into 'e'. The tokens of the line
+ * being dispatched are kept, as this may run in the 'alias' command.
+ */
+static uint8_t _cli_alias_set(cli_alias_ent_t *e, const char *text)
+{
+    char        *save_line = tok_line;
+    uint8_t     save_cnt   = tok_cnt;
+    uint8_t     save[MAX_TOKENS];
+    const char  *end;
+    size_t      len;
+    uint8_t     ok = 1;
+
+    memcpy(save, tok, sizeof(save));
+
+    e->n    = 0;
+    e->gen  = _cli_alias_gen();
+    e->root = cb->cmd;
+
+    for (; ok && *text; text = *end ? end + 1 : end) {
+        while (*text == ' ')
+            text++;
+        end = strchr(text, ';');
+        if (!end)
+            end = text + strlen(text);
+        for (len = end - text; len && text[len - 1] == ' '; len--)
+            ;
+
+        if (!len)
+            continue;
+        if (len > MAX_LINE || e->n == MAX_ALIAS_STEPS)
+            ok = 0;
+        else
+            ok = _cli_alias_resolve(&e->step[e->n++], text, len);
+    }
+
+    tok_line = save_line;
+    tok_cnt  = save_cnt;
+    memcpy(tok, save, sizeof(save));
+
+    if (!ok)
+        e->n = 0;
+
+    return e->n != 0;
+}
+
+
+/*
+ * Put the text of a step back into 'buf'.
+ */
+static void _cli_alias_text(char *buf, const cli_alias_step_t *st)
+{
+    uint8_t     i;
+
+    for (i = 0; i < st->len; i++)
+        buf[i] = st->line[i] ? st->line[i] : ' ';
+    buf[i] = '\0';
+}
+
+
+/*
+ * Run the alias 'line' starts with, if it does. The steps resolved against
+ * the tree as it is are handed to their handler with their tokens, the
+ * others are dispatched like any line.
+ */
+static uint8_t _cli_alias_run(char *line)
+{
+    cli_alias_ent_t     *e;
+    cli_alias_step_t    *st;
+    char                buf[CLI_LINE_BYTES];
+    char                *rest = line;
+    size_t              extra;
+    uint8_t             fresh;
+    uint8_t             n;
+    uint8_t             i;
+    uint8_t             k;
+
+    while (*rest && *rest != ' ')
+        rest++;
+    e = _cli_alias_find(cb->alias, line, rest - line,
+                        _cli_alias_hash(line, rest - line), false);
+    if (!e || !e->n)
+        return 0;
+
+    while (*rest == ' ')
+        rest++;
+    for (extra = strlen(rest); extra && rest[extra - 1] == ' '; extra--)
+        ;
+
+    for (k = 0; k < e->n && cb->sess->state; k++) {
+        st = &e->step[k];
+        n  = st->len;
+
+        /* a step before may have let a module go, e.g. while watching */
+        fresh = e->gen == _cli_alias_gen() && e->root == cb->cmd;
+
+        /* the rest of the line goes to the last step */
+        memcpy(buf, st->line, n);
+        if (k == e->n - 1 && extra) {
+            if (n + 1 + extra > MAX_LINE) {
+                cli_puts("line too long\n");
+                break;
+            }
+            buf[n++] = ' ';
+            memcpy(buf + n, rest, extra);
+            n += extra;
+        }
+        buf[n] = '\0';
+
+        /*
+         * Past the command, the normal dispatch would look the rest up in
+         * its sub commands, or start a job.
+         */
+        if (fresh && st->cmd && (n == st->len ||
+            (!HAS_SUB(st->cmd) && strcmp(buf + n - 2, " &")))) {
+            memcpy(tok, st->tok, st->toks);
+            tok_cnt  = st->toks;
+            tok_line = buf;
+            for (i = st->len; i < n; i++) {
+                if (buf[i] == ' ')
+                    buf[i] = '\0';
+                else if (!buf[i - 1] && tok_cnt < MAX_TOKENS)
+                    tok[tok_cnt++] = i;
+            }
+            _cli_call(st->cmd, tok_cnt - st->depth, st->depth);
+        } else {
+            for (i = 0; i < st->len; i++)
+                if (!buf[i])
+                    buf[i] = ' ';
+            _cli_do_line(buf);
+        }
+    }
+
+    return 1;
+}
+#endif
+
+
+/*
+ * Process the input 'line' and return when ended.
+ */
+static void _cli_do_cmd(char *line)
+{
+#if __ENABLE_MODULES__
+    uint32_t    save = mod_idx;
+
+    mod_idx = _cli_mod_enter();
+#endif
+
+#if __ENABLE_ALIAS__
+    if (!cb->alias || !_cli_alias_run(line))
+#endif
+        _cli_do_line(line);
+
+#if __ENABLE_MODULES__
+    _cli_mod_exit(mod_idx);
+    mod_idx = save;
+#endif
+}
+
+
+static void _cli_putx(uint32_t hex, uint8_t shift)
+{
+#define HEX_MAX         "FFFFFFFF" /* longest hex */
+#define HEX_BUF_MAX     sizeof(HEX_MAX)
+
+    char        buf[HEX_BUF_MAX + 1];
+    uint8_t     i;
+    uint8_t     h;
+
+    buf[HEX_BUF_MAX] = '\0';
+
+    for (i = HEX_BUF_MAX - 1; i > 0; i--) {
+        h = hex & 0xF;
+        if (h > 9)
+            h += shift - 48 - 10;
+
+        buf[i] = h + 48;
+        hex    = hex >> 4;
+
+        if (!hex)
+            break;
+    }
+
+    cli_puts(&buf[i]);
+}
+
+
+/*
+ * Show the prompt of the line being edited, and the line itself.
+ */
+static void _cli_prompt(void)
+{
+    static char * const prompt[] = { "$ ", "login: ", "password: ",
+                                     "password: " };
+    cli_sess_t          *s = cb->sess;
+    int                 i;
+
+#if __ENABLE_HISTORY__
+    if (s->mode == MODE_SEARCH) {
+        cli_puts("(reverse-i-search)'");
+        cli_puts(s->line);
+        cli_puts("': ");
+        if (s->hist < cli_hist_count(cb->hist))
+            cli_puts(cli_hist_get(cb->hist, s->hist));
+        return;
+    }
+#endif
+
+    cli_puts(prompt[s->mode]);
+
+    for (i = 0; s->line[i]; i++)
+        put(s->mode == MODE_PASS || s->mode == MODE_WAIT ?
+                '*' : s->line[i]);
+    while (i-- > s->pos)
+        cursor_move_left();
+}
+
+
+/*
+ * Start editing a new line for 'mode'.
+ */
+static void _cli_newline(uint8_t mode)
+{
+    cli_sess_t  *s = cb->sess;
+
+    s->mode    = mode;
+    s->pos     = 0;
+    s->esc     = 0;
+    s->line[0] = '\0';
+#if __ENABLE_HISTORY__
+    if (cb->hist)
+        s->hist = cli_hist_count(cb->hist);
+#endif
+
+    _cli_prompt();
+}
+
+
+#if __ENABLE_HISTORY__
+/*
+ * Add the entry at 'ofs' to the index, at its place in the region. Only an
+ * entry stepped over while being written goes before others; those after
+ * it move up a slot, so a reader meanwhile finds a neighbour of the entry.
+ */
+static void _cli_hist_index(cli_hist_t *h, uint32_t ofs)
+{
+    uint32_t    i = h->idx_n;
+
+    if (i == h->idx_max)
+        return;
+
+    for (; i && h->idx[i - 1] > ofs; i--)
+        __atomic_store_n(&h->idx[i], h->idx[i - 1], __ATOMIC_RELEASE);
+    __atomic_store_n(&h->idx[i], ofs, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->idx_n, h->idx_n + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Index the entries appended since the last time. Whoever comes first does
+ * it; the others go on with the index as it is.
+ */
+static void _cli_hist_sync(cli_hist_t *h)
+{
+    cli_hist_rec_t  *r;
+    uint32_t        ofs;
+    uint32_t        tail;
+    uint32_t        head;
+    uint8_t         i;
+
+    if (__atomic_test_and_set(&h->syncing, __ATOMIC_ACQUIRE))
+        return;
+
+    /* the entries stepped over before, oldest first, if done by now */
+    for (i = 0; i < h->holes; ) {
+        r = HIST_REC(h, h->hole[i]);
+        if (HIST_SEALED(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE))) {
+            _cli_hist_index(h, h->hole[i]);
+            memmove(&h->hole[i], &h->hole[i + 1],
+                    (--h->holes - i) * sizeof(h->hole[0]));
+        } else {
+            i++;
+        }
+    }
+
+    ofs  = h->scan;
+    tail = __atomic_load_n(&h->hdr->tail, __ATOMIC_ACQUIRE);
+
+    while (ofs < tail) {
+        r    = HIST_REC(h, ofs);
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+        /*
+         * An entry still being written, or whose writer died, has its length
+         * and is stepped over. With HIST_HOLES of them already, the oldest
+         * is taken for dead and no longer looked at. Without a length, as
+         * left by older versions, the scan waits here.
+         */
+        if (HIST_SEALED(head)) {
+            _cli_hist_index(h, ofs);
+        } else if (head) {
+            if (h->holes == HIST_HOLES)
+                memmove(&h->hole[0], &h->hole[1],
+                        --h->holes * sizeof(h->hole[0]));
+            h->hole[h->holes++] = ofs;
+        } else {
+            break;
+        }
+
+        ofs += HIST_SIZE(HIST_LEN(head));
+    }
+
+    h->scan = ofs;
+
+    __atomic_clear(&h->syncing, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Append a line to the history unless it repeats the newest entry.
+ */
+static void _cli_hist_note(const char *line)
+{
+    uint32_t    n = cli_hist_count(cb->hist);
+
+    if ((!n || strcmp(cli_hist_get(cb->hist, n - 1), line)) &&
+        cli_hist_add(cb->hist, line) == 1)
+        cli_puts("history full, new lines are not kept\n");
+}
+
+
+/*
+ * Redraw the line being edited from the start of the row.
+ */
+static void _cli_redraw(void)
+{
+    put('\r');
+    term_erase_eol();
+    _cli_prompt();
+}
+
+
+/*
+ * Replace the line being edited by the i-th history entry, or clear it.
+ */
+static void _cli_hist_load(uint32_t i)
+{
+    cli_sess_t  *s = cb->sess;
+    const char  *e = cli_hist_get(cb->hist, i);
+    uint8_t     n  = 0;
+
+    /* another process may have a longer MAX_LINE */
+    while (e && e[n] && n < MAX_LINE) {
+        s->line[n] = e[n];
+        n++;
+    }
+    s->line[n] = '\0';
+    s->pos     = n;
+    s->hist    = i;
+}
+
+
+/*
+ * Find the newest entry from 'from' back which contains the text searched
+ * for. Only a match moves the session to it.
+ */
+static void _cli_hist_find(uint32_t from)
+{
+    cli_sess_t  *s = cb->sess;
+    const char  *e;
+    uint32_t    i;
+
+    for (i = from + 1; i-- > 0;) {
+        e = cli_hist_get(cb->hist, i);
+        if (e && strstr(e, s->line)) {
+            s->hist = i;
+            return;
+        }
+    }
+}
+
+
+/*
+ * One key of a ctrl-r search.
+ *
+ * A key typed refines the search from the entry found so far instead of
+ * starting over, since an entry newer than it did not match a shorter text.
+ * Ctrl-r goes on to older entries. Enter runs the entry found, other control
+ * keys leave it on the line for editing and ctrl-c or ctrl-g give up.
+ */
+static uint8_t _cli_search_key(char c)
+{
+    cli_sess_t  *s     = cb->sess;
+    uint32_t    count  = cli_hist_count(cb->hist);
+    uint32_t    found  = s->hist;
+
+    if (c == 3 || c == 7) {
+        s->mode = MODE_CMD;
+        put('\n');
+        return EDIT_CANCEL;
+    }
+
+    if (c == 0x12) {
+        if (found < count && found > 0)
+            _cli_hist_find(found - 1);
+    } else if (c == KEY_DEL) {
+        if (s->pos)
+            s->line[--s->pos] = '\0';
+    } else if (c >= ' ' && c < KEY_DEL) {
+        if (s->pos < MAX_LINE) {
+            s->line[s->pos++] = c;
+            s->line[s->pos]   = '\0';
+            _cli_hist_find(found < count ? found : count - 1);
+            if (s->hist == found && found < count &&
+                !strstr(cli_hist_get(cb->hist, found), s->line))
+                s->line[--s->pos] = '\0';
+        }
+    } else {
+        /* take the entry found, if any, to the line */
+        s->mode = MODE_CMD;
+        if (found < count)
+            _cli_hist_load(found);
+        else
+            s->line[s->pos = 0] = '\0';
+        _cli_redraw();
+
+        if (c == '\n') {
+            put('\n');
+            return EDIT_DONE;
+        }
+
+        /* e.g. an arrow key, which then moves on the line */
+        if (c == KEY_ESC) {
+            s->key_seq = 0;
+            s->esc     = 1;
+        }
+        return EDIT_MORE;
+    }
+
+    _cli_redraw();
+
+    return EDIT_MORE;
+}
+#endif
+
+
+#if __ENABLE_LOG_QUEUE__
+/*
+ * Print the queued log messages above the line being edited.
+ *
+ * The line is erased once, all queued messages are written in one batch,
+ * then the prompt and the line are redrawn with the cursor where it was.
+ */
+static void _cli_log_flush(void)
+{
+    cli_logq_t      *q    = cb->logq;
+    cli_log_slot_t  *slot = &q->slot[q->tail & q->mask];
+    uint32_t        dropped;
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->tail + 1 &&
+        !__atomic_load_n(&q->dropped, __ATOMIC_RELAXED))
+        return;
+
+    put('\r');
+    term_erase_eol();
+
+    while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == q->tail + 1) {
+        cli_puts(slot->msg);
+        /* hand the slot back to producers for the next lap */
+        __atomic_store_n(&slot->seq, q->tail + q->mask + 1, __ATOMIC_RELEASE);
+        q->tail++;
+        slot = &q->slot[q->tail & q->mask];
+    }
+
+    dropped = __atomic_exchange_n(&q->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        cli_putd(dropped);
+        cli_puts(" log messages dropped\n");
+    }
+
+    _cli_prompt();
+}
+#endif
+
+
+#if __ENABLE_COMPLETION__
+/*
+ * The candidates of a completion so far.
+ */
+typedef struct {
+    char        *ext;       ///< where the common extension is collected
+    uint8_t     room;       ///< how long it can be
+    uint8_t     len;        ///< how long it is
+    uint8_t     skip;       ///< length of the word being completed
+    uint32_t    count;      ///< number of candidates
+} cpl_t;
+
+
+static void _cli_complete_one(const cmd_t *p, void *ctx)
+{
+    cpl_t       *cpl  = ctx;
+    const char  *name = p->cmd + cpl->skip;
+    uint8_t     i;
+
+    if (cpl->count++ == 0) {
+        for (i = 0; i < cpl->room && name[i]; i++)
+            cpl->ext[i] = name[i];
+        /* unique and complete so far, a space would follow */
+        if (!name[i] && i < cpl->room)
+            cpl->ext[i++] = ' ';
+    } else {
+        for (i = 0; i < cpl->len && cpl->ext[i] == name[i]; i++)
+            ;
+    }
+
+    cpl->len = i;
+}
+
+
+static void _cli_complete_list(const cmd_t *p, void *ctx)
+{
+    uint32_t    *n = ctx;
+
+    if ((*n)++ < MAX_COMPLETIONS) {
+        cli_puts(p->cmd);
+        cli_puts("  ");
+    }
+}
+
+
+/*
+ * Complete the last word of the line, if the cursor is at its end.
+ *
+ * The common part of all candidates is appended. If there is none, the
+ * candidates are listed and the line is shown again.
+ */
+static void _cli_complete(void)
+{
+    cli_sess_t  *s      = cb->sess;
+    char        *buf;
+    char        *word   = "";
+    const cmd_t *parent = NULL;
+    cpl_t       cpl     = { 0 };
+    uint32_t    n       = 0;
+    bool        ok      = true;
+    int         toks;
+    int         i;
+#if __ENABLE_MODULES__
+    uint32_t    idx;
+#endif
+
+    if (s->line[s->pos] || exec_depth == MAX_EXEC_DEPTH)
+        return;
+
+    /* tokenize a copy, the line is still being edited */
+    buf = ARENA(OFS_EXEC + CLI_LINE_BYTES * exec_depth);
+    memcpy(buf, s->line, s->pos + 1);
+    toks = _cli_line_to_tokens(buf);
+
+    if (s->pos && s->line[s->pos - 1] != ' ')
+        word = _cli_tok(--toks);
+
+#if __ENABLE_MODULES__
+    idx = _cli_mod_enter();
+#endif
+
+    for (i = 0; i < toks && ok; i++) {
+        parent = _cli_find(parent, _cli_tok(i));
+        ok     = parent && HAS_SUB(parent);
+    }
+
+    if (ok) {
+        /* collect behind the cursor, it is the end of the line */
+        cpl.ext  = &s->line[s->pos];
+        cpl.room = MAX_LINE - s->pos;
+        cpl.skip = strlen(word);
+        _cli_each(parent, word, _cli_complete_one, &cpl);
+        cpl.ext[cpl.len] = '\0';
+
+        if (cpl.len) {
+            cli_puts(cpl.ext);
+            s->pos += cpl.len;
+        } else if (cpl.count > 1) {
+            put('\n');
+            _cli_each(parent, word, _cli_complete_list, &n);
+            if (n > MAX_COMPLETIONS) {
+                cli_puts("... ");
+                cli_putd(n - MAX_COMPLETIONS);
+                cli_puts(" more");
+            }
+            put('\n');
+            _cli_prompt();
+        }
+    }
+
+    s->line[s->pos] = '\0';
+
+#if __ENABLE_MODULES__
+    _cli_mod_exit(idx);
+#endif
+}
+#endif
+
+
+/*
+ * Edit the line of the session being served by one key.
+ */
+static uint8_t _cli_edit(char c)
+{
+    cli_sess_t  *s    = cb->sess;
+    char        *buf  = s->line;
+    char        echo  = s->mode == MODE_PASS ? '*' : 0;
+    uint8_t     max   = s->mode == MODE_CMD ? MAX_LINE : MAX_ID;
+
+#if __ENABLE_HISTORY__
+    if (s->mode == MODE_SEARCH)
+        return _cli_search_key(c);
+
+    if (c == 0x12 && s->mode == MODE_CMD && cb->hist && !s->esc) {
+        s->mode    = MODE_SEARCH;
+        s->pos     = 0;
+        s->line[0] = '\0';
+        s->hist    = cli_hist_count(cb->hist);
+        _cli_redraw();
+        return EDIT_MORE;
+    }
+#endif
+
+    if (c == KEY_ESC) {
+        s->key_seq = 0;
+        s->esc     = 1;
+        return EDIT_MORE;
+    }
+
+    if (s->esc) {
+        s->key_seq = (s->key_seq << 8) | c;
+        if (c == '~' || (c >= 'A' && c <= 'D') ||
+            (c >= 'F' && c <= 'H') || (c >= 'P' && c <= 'S')) {
+            s->esc = 0;
+#ifdef DEBUG_KEY_SEQ
+            cli_puts("key: ");
+            for (int i = 0; i < 32; i += 8) {
+                cli_putx(s->key_seq >> i);
+                put(' ');
+            }
+            put('\n');
+#endif
+            // process key seq
+            switch (s->key_seq) {
+            case KEY_LEFT:
+                if (s->pos > 0) {
+                    cursor_move_left();
+                    s->pos--;
+                }
+                break;
+            case KEY_RIGHT:
+                if (buf[s->pos] != 0) {
+                    cursor_move_right();
+                    s->pos++;
+                }
+                break;
+            case KEY_HOME:
+                while (s->pos > 0) {
+                    cursor_move_left();
+                    s->pos--;
+                }
+                break;
+            case KEY_END:
+                while (buf[s->pos] != 0) {
+                    cursor_move_right();
+                    s->pos++;
+                }
+                break;
+            case KEY_DEL:
+                break;
+#if __ENABLE_HISTORY__
+            case KEY_UP:
+                if (s->mode == MODE_CMD && cb->hist && s->hist > 0) {
+                    _cli_hist_load(s->hist - 1);
+                    _cli_redraw();
+                }
+                break;
+            case KEY_DN:
+                if (s->mode == MODE_CMD && cb->hist &&
+                    s->hist < cli_hist_count(cb->hist)) {
+                    _cli_hist_load(s->hist + 1);
+                    _cli_redraw();
+                }
+                break;
+#endif
+            default:
+#ifdef DEBUG_KEY_SEQ
+                cli_puts("unknown key code: ");
+                for (int i = 24; i >= 0; i -= 8) {
+                    cli_putd((s->key_seq >> i) & 0xFF);
+                    put(' ');
+                }
+                put('\n');
+#endif
+                break;
+            }
+        }
+        return EDIT_MORE;
+    }
+
+    if (c == 3) {
+        put('\n');
+        return EDIT_CANCEL;
+    }
+
+#if __ENABLE_COMPLETION__
+    if (c == '\t') {
+        if (s->mode == MODE_CMD)
+            _cli_complete();
+        return EDIT_MORE;
+    }
+#endif
+
+    if (c == KEY_DEL) {
+        if (s->pos > 0) {
+            int j = s->pos - 1;
+            cursor_move_left();
+            while (buf[j]) {
+                buf[j] = buf[j + 1];
+                put(buf[j] ? (echo ? echo : buf[j]) : ' ');
+                j++;
+            }
+            s->pos--;
+
+            while ((j--) > s->pos)
+                cursor_move_left();
+        }
+        return EDIT_MORE;
+    }
+
+    if (c == '\n') {
+        put('\n');
+        return EDIT_DONE;
+    }
+
+    if (s->pos < max) {
+        if (buf[s->pos] == '\0')
+            buf[s->pos + 1] = 0;
+        buf[s->pos++] = c;
+        put(echo ? echo : c);
+    }
+
+    return EDIT_MORE;
+}
+
+
+/*
+ * Start the session being served: ask for login or show the prompt.
+ */
+static void _cli_start(void)
+{
+    cli_sess_t  *s = cb->sess;
+
+    s->state = cb->state;
+
+#if __ENABLE_LOGIN__
+    if (!s->state) {
+        _cli_newline(MODE_ID);
+        return;
+    }
+#endif
+
+    _cli_newline(MODE_CMD);
+}
+
+
+#if __ENABLE_LOGIN__
+#if __ENABLE_BACKOFF__
+/*
+ * The entry of 'peer', or NULL. If 'take', an entry is made for it.
+ */
+static cli_backoff_ent_t *_cli_backoff_find(cli_backoff_t *b, uint32_t peer,
+                                            bool take)
+{
+    cli_backoff_ent_t   *e;
+    cli_backoff_ent_t   *victim = NULL;
+    uint32_t            now     = b->now();
+    uint32_t            i       = (peer * 2654435761u) & b->mask;
+    int                 n;
+
+    for (n = 0; n < 4 && n <= b->mask; n++, i = (i + 1) & b->mask) {
+        e = &b->ent[i];
+
+        if (e->fails && e->peer == peer)
+            return e;
+
+        /* unused, or free the soonest */
+        if (!victim || (victim->fails &&
+                        (!e->fails || (int32_t)(e->until - victim->until) < 0)))
+            victim = e;
+    }
+
+    if (!take)
+        return NULL;
+
+    victim->peer  = peer;
+    victim->fails = 0;
+    victim->until = now;
+
+    return victim;
+}
+#endif
+
+
+/*
+ * Finish the login of the session being served. The id and password are
+ * wiped, the session may live on for long in a slot of a slab.
+ */
+static void _cli_login_done(uint8_t ok)
+{
+    cli_sess_t  *s = cb->sess;
+
+    memset(s->line, 0, CLI_LINE_BYTES);
+
+#if __ENABLE_BACKOFF__
+    if (cb->backoff)
+        cli_backoff_note(cb->backoff, cb->backoff->peer(), ok);
+#endif
+
+    if (ok) {
+        s->state = 1;
+        _cli_newline(MODE_CMD);
+    } else {
+        cli_puts("login failed\n");
+        _cli_newline(MODE_ID);
+    }
+}
+#endif
+
+
+/*
+ * Process one key of the session being served.
+ *
+ * The login is a state of the session rather than a loop, so that a
+ * session waiting for a key costs nothing but its cli_sess_t.
+ *
+ * @retval  0   if the user logged out.
+ */
+static uint8_t _cli_input(char c)
+{
+    cli_sess_t  *s = cb->sess;
+#if __ENABLE_LOGIN__
+    /* no typing ahead of a pending login */
+    if (s->mode == MODE_WAIT)
+        return 1;
+#endif
+
+    switch (_cli_edit(c)) {
+    case EDIT_MORE:
+        return 1;
+    case EDIT_CANCEL:
+        _cli_newline(s->mode == MODE_PASS ? MODE_ID : s->mode);
+        return 1;
+    }
+
+    switch (s->mode) {
+#if __ENABLE_LOGIN__
+    case MODE_ID:
+        strcpy(SESS_ID(s), s->line);
+        _cli_newline(MODE_PASS);
+        return 1;
+
+    case MODE_PASS:
+#if __ENABLE_BACKOFF__
+        /* a peer backing off is refused without asking knock */
+        if (cb->backoff &&
+            cli_backoff_left(cb->backoff, cb->backoff->peer())) {
+            memset(s->line, 0, CLI_LINE_BYTES);
+            cli_puts("login failed\n");
+            _cli_newline(MODE_ID);
+            return 1;
+        }
+#endif
+
+        /* validate, or wait for the result while other sessions go on */
+        if (cb->knock_async) {
+            s->mode = MODE_WAIT;
+            cb->knock_async(SESS_ID(s), s->line);
+        } else {
+            _cli_login_done(cb->knock(SESS_ID(s), s->line));
+        }
+        return 1;
+#endif
+
+    default:
+#if __ENABLE_HISTORY__
+        /* before the tokenizer cuts it */
+        if (cb->hist && s->line[0])
+            _cli_hist_note(s->line);
+#endif
+        _cli_do_cmd(s->line);
+        if (!s->state)
+            return 0;
+        _cli_newline(MODE_CMD);
+        return 1;
+    }
+}
+
+
+#if __ENABLE_WATCH__
+/*
+ * Bring one line of the watch screen from 'o' to 'n'.
+ *
+ * Only the changed cells are written. Small runs of unchanged cells between
+ * two changes are rewritten rather than jumped over, because a cursor
+ * addressing sequence costs more than a few characters.
+ */
+static void _cli_watch_line(uint16_t row, const char *o, uint16_t olen,
+                            const char *n, uint16_t nlen)
+{
+#define WATCH_GAP       (6) /* about the length of ESC [ r ; c H */
+
+    uint16_t    col  = 0;       /* where the cursor is if 'sync' */
+    bool        sync = false;
+    uint16_t    i;
+
+    for (i = 0; i < nlen; i++) {
+        if (i < olen && o[i] == n[i])
+            continue;
+
+        if (!sync || i - col > WATCH_GAP)
+            cursor_goto(row, i + 1);
+        else
+            while (col < i)
+                cli_putc(n[col++]);
+
+        cli_putc(n[i]);
+        col  = i + 1;
+        sync = true;
+    }
+
+    if (olen > nlen) {
+        if (!sync || col != nlen)
+            cursor_goto(row, nlen + 1);
+        term_erase_eol();
+    }
+}
+
+
+/*
+ * Draw the frame 'n' over the frame 'o' starting from 'row'.
+ *
+ * @return  The row after the last line of 'n'.
+ */
+static uint16_t _cli_watch_draw(uint16_t row, const char *o, const char *n)
+{
+    const char  *oe;
+    const char  *ne;
+    uint16_t    end = row;
+
+    /* past the end of 'n', the rows of 'o' left are erased */
+    for (; *o || *n; row++) {
+        for (oe = o; *oe && *oe != '\n'; oe++)
+            ;
+        for (ne = n; *ne && *ne != '\n'; ne++)
+            ;
+
+        _cli_watch_line(row, o, oe - o, n, ne - n);
+
+        if (*n)
+            end = row + 1;
+
+        o = *oe ? oe + 1 : oe;
+        n = *ne ? ne + 1 : ne;
+    }
+
+    return end;
+}
+#endif
+
+
+/****************************************************************************
+ *
+ * API functions.
+ *
+ ****************************************************************************/
+
+
+void cli_init(cli_t *cli)
+{
+    cb          = cli;
+#ifdef __ENABLE_HARDCODE_LOGIN__
+    if (!cb->knock)
+        cb->knock = _cli_hardcode_login;
+#endif
+
+    if (!cb->arena)
+        cb->arena = arena;
+
+    if (!cb->sess) {
+        cb->sess        = (cli_sess_t *)ARENA(OFS_SESS);
+        cb->sess->state = cb->state;
+#if __ENABLE_MIRROR__
+        cb->sess->mirror = NULL;
+#endif
+    }
+
+#if __ENABLE_LOG_QUEUE__
+    if (cb->logq && !cb->logq->slot)
+        cli_logq_init(cb->logq, (cli_log_slot_t *)ARENA(OFS_LOGQ), LOG_SLOTS);
+#endif
+}
+
+
+void cli_task(void)
+{
+    char c;
+
+    put = cb->put;
+#if __ENABLE_MIRROR__
+    _cli_mirror_begin();
+#endif
+    _cli_start();
+
+    do {
+#if __ENABLE_LOG_QUEUE__
+        if (cb->logq)
+            _cli_log_flush();
+#endif
+#if __ENABLE_MIRROR__
+        /* publish the output so far before waiting */
+        _cli_mirror_end(false);
+#endif
+#if __ENABLE_LOG_QUEUE__
+        if (cb->logq && cb->wait) {
+            while (!cb->wait(LOG_POLL_MS)) {
+#if __ENABLE_MIRROR__
+                _cli_mirror_begin();
+#endif
+                _cli_log_flush();
+#if __ENABLE_MIRROR__
+                _cli_mirror_end(false);
+#endif
+            }
+        }
+#endif
+        c = cb->get();
+#if __ENABLE_MIRROR__
+        _cli_mirror_begin();
+#endif
+    } while (_cli_input(c));
+
+#if __ENABLE_MIRROR__
+    _cli_mirror_end(true);
+#endif
+}
+
+
+void cli_sess_start(cli_t *cli, cli_sess_t *s)
+{
+    cb       = cli;
+    cb->sess = s;
+    put      = cli->put;
+    s->user  = NULL;
+
+#if __ENABLE_MIRROR__
+    _cli_mirror_begin();
+    _cli_start();
+    _cli_mirror_end(false);
+#else
+    _cli_start();
+#endif
+}
+
+
+uint8_t cli_input(cli_t *cli, cli_sess_t *s, const char *data, uint16_t len)
+{
+    uint16_t    i;
+
+    cb       = cli;
+    cb->sess = s;
+    put      = cli->put;
+
+#if __ENABLE_MIRROR__
+    _cli_mirror_begin();
+#endif
+#if __ENABLE_JOBS__
+    in_loop = true;
+#endif
+
+    for (i = 0; i < len; i++) {
+        if (!_cli_input(data[i])) {
+#if __ENABLE_JOBS__
+            in_loop = false;
+#endif
+#if __ENABLE_MIRROR__
+            _cli_mirror_end(true);
+#endif
+            return 0;
+        }
+    }
+
+#if __ENABLE_JOBS__
+    in_loop = false;
+#endif
+
+#if __ENABLE_LOG_QUEUE__
+    if (cb->logq)
+        _cli_log_flush();
+#endif
+
+#if __ENABLE_MIRROR__
+    _cli_mirror_end(false);
+#endif
+
+    return 1;
+}
+
+
+void *cli_user(void)
+{
+    return cb->sess->user;
+}
+
+
+cli_sess_t *cli_sess(void)
+{
+    return cb->sess;
+}
+
+
+#if __ENABLE_LOGIN__
+void cli_knock_done(cli_t *cli, cli_sess_t *s, uint8_t ok)
+{
+    cb       = cli;
+    cb->sess = s;
+    put      = cli->put;
+
+#if __ENABLE_MIRROR__
+    _cli_mirror_begin();
+#endif
+    if (s->mode == MODE_WAIT)
+        _cli_login_done(ok);
+#if __ENABLE_MIRROR__
+    _cli_mirror_end(false);
+#endif
+}
+#endif
+
+
+void cli_slab_init(cli_slab_t *slab, void *mem, size_t size)
+{
+    char        *p = mem;
+    cli_sess_t  *s;
+
+    slab->free  = NULL;
+    slab->used  = 0;
+    slab->total = size / CLI_SESS_BYTES;
+
+    /* the free list is threaded through 'user' */
+    for (p += (slab->total - 1) * CLI_SESS_BYTES; p >= (char *)mem; p -= CLI_SESS_BYTES) {
+        s           = (cli_sess_t *)p;
+        s->user     = slab->free;
+        slab->free  = s;
+    }
+}
+
+
+cli_sess_t *cli_sess_alloc(cli_slab_t *slab)
+{
+    cli_sess_t  *s = slab->free;
+
+    if (s) {
+        slab->free = s->user;
+        slab->used++;
+        s->user    = NULL;
+#if __ENABLE_MIRROR__
+        s->mirror  = NULL;
+#endif
+    }
+
+    return s;
+}
+
+
+void cli_sess_free(cli_slab_t *slab, cli_sess_t *s)
+{
+    s->user    = slab->free;
+    slab->free = s;
+    slab->used--;
+}
+
+
+size_t cli_exec(cli_t *cli, const char *line, size_t len, cli_sink_t *out)
+{
+    char        *buf;
+    cli_t       *cb_save    = cb;
+    putch_fptr  put_save    = put;
+    cli_sink_t  *sink_save  = sink;
+    size_t      total_save  = sink_total;
+    const char  *end;
+    size_t      total;
+    size_t      n;
+
+    out->len = 0;
+    if (out->size)
+        out->buf[0] = '\0';
+
+    /*
+     * cli_exec() may be called by a command handler, hence the nesting. The
+     * output is redirected for this thread only, 'cli' may serve others.
+     */
+    cb          = cli;
+    put         = _cli_sink_put;
+    sink        = out;
+    sink_total  = 0;
+
+    if (exec_depth == MAX_EXEC_DEPTH) {
+        cli_puts("nested too deep\n");
+    } else {
+        /* the tokenizer writes into the line, work on a copy */
+#if __ENABLE_JOBS__
+        if (IN_JOB)
+            buf = job_exec + CLI_LINE_BYTES * exec_depth;
+        else
+#endif
+        buf = ARENA(OFS_EXEC + CLI_LINE_BYTES * exec_depth);
+        n   = len < MAX_LINE ? len : MAX_LINE;
+        end = memchr(line, '\0', n);
+        if (end)
+            n = end - line;
+        memcpy(buf, line, n);
+        buf[n] = '\0';
+
+        if (n < len && line[n]) {
+            cli_puts("line too long\n");
+        } else {
+            exec_depth++;
+            _cli_do_cmd(buf);
+            exec_depth--;
+        }
+    }
+
+    total       = sink_total;
+    sink_total  = total_save;
+    sink        = sink_save;
+    put         = put_save;
+    cb          = cb_save;
+
+    return total;
+}
+
+
+/*
+ * The length of the line at 'buf', up to a '\n' or 'end' and without a '\r'
+ * before the '\n'. Where the next line starts goes to 'next'.
+ */
+static size_t _cli_next_line(const char *buf, const char *end,
+                             const char **next)
+{
+    const char  *nl = memchr(buf, '\n', end - buf);
+    size_t      n   = (nl ? nl : end) - buf;
+
+    *next = nl ? nl + 1 : end;
+
+    return n && buf[n - 1] == '\r' ? n - 1 : n;
+}
+
+
+size_t cli_exec_lines(cli_t *cli, const char *buf, size_t len, cli_sink_t *out)
+{
+    const char  *end   = buf + len;
+    const char  *next;
+    size_t      lines  = 0;
+    size_t      n;
+    cli_sink_t  one    = { .put = out->put };
+
+    out->len = 0;
+    if (out->size)
+        out->buf[0] = '\0';
+
+    while (buf < end) {
+        n = _cli_next_line(buf, end, &next);
+
+        if (n) {
+            /* append to what the lines before left in 'out' */
+            one.buf  = out->buf + out->len;
+            one.size = out->size - out->len;
+            cli_exec(cli, buf, n, &one);
+            out->len += one.len;
+            lines++;
+        }
+
+        buf = next;
+    }
+
+    return lines;
+}
+
+
+void cli_puts(const char *s)
+{
+    while (*s)
+        put(*s++);
+}
+
+
+uint8_t cli_logout(uint8_t len, char *param)
+{
+    cb->sess->state = 0;
+    cli_puts("logout\n");
+    return 0;
+}
+
+
+#if __ENABLE_MODULES__
+void cli_attach(cli_mod_t *mod)
+{
+    while (__atomic_test_and_set(&mod_writer, __ATOMIC_ACQUIRE))
+        ;
+
+    mod->next = mod_head;
+    __atomic_store_n(&mod_head, mod, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&mod_gen, 1, __ATOMIC_RELEASE);
+
+    __atomic_clear(&mod_writer, __ATOMIC_RELEASE);
+}
+
+
+void cli_detach(cli_mod_t *mod)
+{
+    cli_mod_t   **pp;
+    uint32_t    idx;
+    uint32_t    i;
+    int         n;
+
+    while (__atomic_test_and_set(&mod_writer, __ATOMIC_ACQUIRE))
+        ;
+
+    for (pp = &mod_head; *pp; pp = &(*pp)->next) {
+        if (*pp == mod) {
+            /* readers on 'mod' still find their way through 'mod->next' */
+            __atomic_store_n(pp, mod->next, __ATOMIC_SEQ_CST);
+            break;
+        }
+    }
+
+    /* before the grace period, for the aliases resolved to 'mod' */
+    __atomic_fetch_add(&mod_gen, 1, __ATOMIC_SEQ_CST);
+
+    /* the grace period, over the slots of all threads */
+    for (n = 0; n < 2; n++) {
+        idx = __atomic_fetch_add(&mod_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        for (i = 0; i < MOD_SLOTS; i++)
+            while (__atomic_load_n(&mod_readers[i].n[idx], __ATOMIC_ACQUIRE))
+                ;
+    }
+
+    __atomic_clear(&mod_writer, __ATOMIC_RELEASE);
+}
+#endif
+
+
+uint8_t cli_mem(uint8_t len, char *param)
+{
+    static const struct {
+        char        *name;
+        uint16_t    size;
+    } map[] = {
+        { "cli_t",   sizeof(cli_t) },
+        { "sess",    CLI_SESS_BYTES },
+        { "exec",    CLI_EXEC_BYTES },
+#if __ENABLE_WATCH__
+        { "watch",   CLI_WATCH_BYTES },
+#endif
+#if __ENABLE_LOG_QUEUE__
+        { "logq",    CLI_LOGQ_BYTES },
+#endif
+        { "total",   sizeof(cli_t) + CLI_ARENA_SIZE },
+    };
+    uint8_t     i;
+
+    for (i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+        cli_puts(map[i].name);
+        cli_putc('\t');
+        cli_putd(map[i].size);
+        cli_putln();
+    }
+
+    return 0;
+}
+
+
+#if __ENABLE_WATCH__
+uint8_t cli_watch(uint8_t len, char *param)
+{
+    char        *line    = ARENA(OFS_WATCH);
+    char        *frame[] = { line + CLI_LINE_BYTES,
+                             line + CLI_LINE_BYTES + MAX_WATCH };
+    cli_sink_t  out      = { .size = MAX_WATCH };
+    uint8_t     cur  = 0;
+    uint16_t    secs = 2;
+    uint16_t    row;
+    uint16_t    n    = 0;
+    int         i;
+    char        c;
+
+    if (!cb->wait || watching || IN_JOB) {
+        cli_puts("watch not supported\n");
+        return 0;
+    }
+
+    /* locate the arguments among the tokens */
+    for (i = 0; _cli_tok(i) != param; i++)
+        ;
+
+    if (param && !strcmp(param, "-n")) {
+        param = _cli_tok(++i);
+        secs  = 0;
+        while (param && *param >= '0' && *param <= '9')
+            secs = secs * 10 + *param++ - '0';
+        i++;
+    }
+
+    if (!_cli_tok(i) || secs < 1 || secs > 60) {
+        cli_puts("usage: watch [-n 1..60] <command>\n");
+        return 0;
+    }
+
+    /* the command runs many times, but tokenizing is destructive */
+    n = _cli_tok_join(line, i, tok_cnt);
+
+    term_clear();
+    cli_puts("Every ");
+    cli_putd(secs);
+    cli_puts("s: ");
+    cli_puts(line);
+
+    frame[cur][0] = '\0';
+    watching      = true;
+
+    while (1) {
+        out.buf = frame[!cur];
+        cli_exec(cb, line, n, &out);
+        row = _cli_watch_draw(3, frame[cur], frame[!cur]);
+        cursor_goto(row, 1);
+        cur = !cur;
+
+#if __ENABLE_MODULES__
+        _cli_mod_pause();
+        c = cb->wait(secs * 1000) ? cb->get() : 0;
+        _cli_mod_resume();
+#else
+        c = cb->wait(secs * 1000) ? cb->get() : 0;
+#endif
+        if (c == 3 || c == 'q')
+            break;
+    }
+
+    watching = false;
+    return 0;
+}
+#endif
+
+
+#if __ENABLE_HISTORY__
+void cli_hist_init(cli_hist_t *h, void *mem, uint32_t size, uint32_t *idx,
+                   uint32_t n)
+{
+    cli_hist_hdr_t  *hdr = mem;
+
+    h->hdr      = hdr;
+    h->size     = size & ~3u;
+    h->idx      = idx;
+    h->idx_max  = n;
+    h->idx_n    = 0;
+    h->scan     = sizeof(*hdr);
+    h->dropped  = 0;
+    h->holes    = 0;
+    h->syncing  = 0;
+
+    if (hdr->magic != HIST_MAGIC || hdr->tail < sizeof(*hdr) ||
+        hdr->tail > h->size) {
+        memset(mem, 0, h->size);
+        hdr->tail  = sizeof(*hdr);
+        hdr->magic = HIST_MAGIC;
+    }
+
+    _cli_hist_sync(h);
+}
+
+
+/*
+ * Claim an entry of 'len' at the tail and move the tail past it, NULL if the
+ * region is full. Whoever finds an entry claimed but the tail not moved yet
+ * moves it, so every entry below the tail has its length.
+ */
+static cli_hist_rec_t *_cli_hist_claim(cli_hist_t *h, uint16_t len)
+{
+    cli_hist_rec_t  *r;
+    uint32_t        need = HIST_SIZE(len);
+    uint32_t        ofs  = __atomic_load_n(&h->hdr->tail, __ATOMIC_ACQUIRE);
+    uint32_t        head;
+    uint32_t        next;
+
+    for (;;) {
+        if (ofs + need > h->size)
+            return NULL;
+
+        r    = HIST_REC(h, ofs);
+        head = 0;
+        if (__atomic_compare_exchange_n(&r->head, &head,
+                                        HIST_HEAD(len, HIST_CLAIM), false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+
+        /* help the one who claimed it, then try at the new tail */
+        next = ofs + HIST_SIZE(HIST_LEN(head));
+        if (__atomic_compare_exchange_n(&h->hdr->tail, &ofs, next, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            ofs = next;
+    }
+
+    __atomic_compare_exchange_n(&h->hdr->tail, &ofs, ofs + need, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+
+    return r;
+}
+
+
+uint32_t cli_hist_add(cli_hist_t *h, const char *line)
+{
+    uint16_t        len = strlen(line);
+    cli_hist_rec_t  *r  = _cli_hist_claim(h, len);
+
+    if (!r)
+        return __atomic_add_fetch(&h->dropped, 1, __ATOMIC_RELAXED);
+
+    memcpy(r->line, line, len + 1);
+    __atomic_store_n(&r->head, HIST_HEAD(len, HIST_SEAL), __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+
+uint32_t cli_hist_count(cli_hist_t *h)
+{
+    _cli_hist_sync(h);
+
+    return __atomic_load_n(&h->idx_n, __ATOMIC_ACQUIRE);
+}
+
+
+const char *cli_hist_get(cli_hist_t *h, uint32_t i)
+{
+    if (i >= __atomic_load_n(&h->idx_n, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return HIST_REC(h, __atomic_load_n(&h->idx[i], __ATOMIC_ACQUIRE))->line;
+}
+
+
+void cli_hist_rotate(cli_hist_t *h, uint32_t keep)
+{
+    cli_hist_rec_t  *r;
+    uint32_t        tail = h->hdr->tail;
+    uint32_t        to   = sizeof(cli_hist_hdr_t);
+    uint32_t        end;
+    uint32_t        ofs;
+    uint32_t        size;
+
+    /* the entries end at the first one which never got its length */
+    for (end = to; end < tail; end += HIST_SIZE(HIST_LEN(r->head))) {
+        r = HIST_REC(h, end);
+        if (!r->head)
+            break;
+    }
+
+    /* the oldest entry to keep */
+    for (ofs = to; end - ofs > keep; ofs += HIST_SIZE(HIST_LEN(r->head)))
+        r = HIST_REC(h, ofs);
+
+    /* move the finished ones down */
+    for (; ofs < end; ofs += size) {
+        r    = HIST_REC(h, ofs);
+        size = HIST_SIZE(HIST_LEN(r->head));
+        if (HIST_SEALED(r->head)) {
+            memmove(HIST_REC(h, to), r, size);
+            to += size;
+        }
+    }
+
+    memset(HIST_REC(h, to), 0, h->size - to);
+    h->hdr->tail = to;
+
+    h->idx_n   = 0;
+    h->holes   = 0;
+    h->scan    = sizeof(cli_hist_hdr_t);
+    h->dropped = 0;
+    _cli_hist_sync(h);
+}
+#endif
+
+
+#if __ENABLE_MIRROR__
+void cli_mirror_init(cli_mirror_t *m, cli_mirror_seg_t *seg, uint16_t n,
+                     cli_mirror_seg_t **ring, uint16_t depth,
+                     uint32_t (*now)(void))
+{
+    uint16_t    i;
+
+    for (i = 0; i < n; i++)
+        seg[i].refs = 0;
+    for (i = 0; i < depth; i++)
+        ring[i] = NULL;
+
+    m->seg         = seg;
+    m->ring        = ring;
+    m->fill        = NULL;
+    m->now         = now;
+    m->since       = 0;
+    m->n           = n;
+    m->depth       = depth;
+    m->readers     = 0;
+    m->max_readers = n > depth + 1 ? n - depth - 1 : 0;
+    m->head        = 0;
+}
+
+
+void cli_mirror_attach(cli_sess_t *s, cli_mirror_t *m)
+{
+    s->mirror = m;
+}
+
+
+uint8_t cli_mirror_open(cli_mirror_t *m, cli_mirror_reader_t *r)
+{
+    uint16_t    n = __atomic_load_n(&m->readers, __ATOMIC_RELAXED);
+    uint32_t    head;
+
+    do {
+        if (n >= m->max_readers)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&m->readers, &n, n + 1, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    head = __atomic_load_n(&m->head, __ATOMIC_ACQUIRE);
+
+    r->m       = m;
+    r->held    = NULL;
+    r->next    = head > m->depth ? head - m->depth : 0;
+    r->skipped = 0;
+
+    return 1;
+}
+
+
+void cli_mirror_close(cli_mirror_reader_t *r)
+{
+    if (r->held)
+        _cli_mirror_drop(r->held);
+    r->held = NULL;
+
+    __atomic_fetch_sub(&r->m->readers, 1, __ATOMIC_RELAXED);
+}
+
+
+const char *cli_mirror_read(cli_mirror_reader_t *r, uint16_t *len)
+{
+    cli_mirror_t        *m = r->m;
+    cli_mirror_seg_t    *seg;
+    uint32_t            head;
+
+    if (r->held)
+        _cli_mirror_drop(r->held);
+    r->held = NULL;
+
+    for (;;) {
+        head = __atomic_load_n(&m->head, __ATOMIC_ACQUIRE);
+        if (r->next == head)
+            return NULL;
+
+        /* too slow, the ring moved on */
+        if (head - r->next > m->depth) {
+            r->skipped += head - m->depth - r->next;
+            r->next     = head - m->depth;
+        }
+
+        /*
+         * The segment may be replaced, and even reused, before it is held,
+         * in which case its number tells and the ring is looked at again.
+         */
+        seg = __atomic_load_n(&m->ring[r->next % m->depth], __ATOMIC_ACQUIRE);
+        if (seg && _cli_mirror_hold(seg)) {
+            if (__atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE) == r->next) {
+                r->held = seg;
+                r->next++;
+                *len = seg->len;
+                return seg->data;
+            }
+            _cli_mirror_drop(seg);
+        }
+    }
+}
+#endif
+
+
+#if __ENABLE_BACKOFF__
+void cli_backoff_init(cli_backoff_t *b, cli_backoff_ent_t *ent, uint32_t n,
+                      uint32_t (*now)(void), uint32_t (*peer)(void))
+{
+    uint32_t    i;
+
+    for (i = 0; i < n; i++)
+        ent[i].fails = 0;
+
+    b->now  = now;
+    b->peer = peer;
+    b->mask = n - 1;
+    b->ent  = ent;
+}
+
+
+uint32_t cli_backoff_left(cli_backoff_t *b, uint32_t peer)
+{
+    cli_backoff_ent_t   *e    = _cli_backoff_find(b, peer, false);
+    int32_t             left;
+
+    if (!e)
+        return 0;
+
+    left = e->until - b->now();
+
+    return left > 0 ? left : 0;
+}
+
+
+void cli_backoff_note(cli_backoff_t *b, uint32_t peer, uint8_t ok)
+{
+    cli_backoff_ent_t   *e = _cli_backoff_find(b, peer, !ok);
+    uint32_t            ms = BACKOFF_MAX_MS;
+
+    if (!e)
+        return;
+
+    if (ok) {
+        e->fails = 0;
+        return;
+    }
+
+    if (e->fails < 16)
+        e->fails++;
+    if ((BACKOFF_MS << (e->fails - 1)) < BACKOFF_MAX_MS)
+        ms = BACKOFF_MS << (e->fails - 1);
+
+    e->until = b->now() + ms;
+}
+#endif
+
+
+#if __ENABLE_JOBS__
+void cli_jobs_init(cli_jobs_t *jobs, cli_job_t *job, uint32_t n)
+{
+    uint32_t    i;
+
+    for (i = 0; i < n; i++)
+        job[i].state = JOB_FREE;
+
+    jobs->n       = n;
+    jobs->last_id = 0;
+    jobs->job     = job;
+}
 
-#ifdef __ENABLE_HARDCODE_LOGIN__
-#define LOGIN_ID        "a"
-#define LOGIN_PASSWD    "a"
-#endif
 
+uint8_t cli_job_run(cli_jobs_t *jobs)
+{
+    cli_job_t   *j = NULL;
+    cli_sess_t  *s;
+    cli_sink_t  out;
+    uint8_t     st;
+    uint32_t    i;
+
+    for (i = 0; i < jobs->n && !j; i++) {
+        st = JOB_QUEUED;
+        if (__atomic_compare_exchange_n(&jobs->job[i].state, &st, JOB_RUNNING,
+                                        false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            j = &jobs->job[i];
+    }
 
-/****************************************************************************
- *
- * Types.
- *
- ****************************************************************************/
+    if (!j)
+        return 0;
 
+    out.buf  = j->out;
+    out.size = MAX_JOB_OUT;
+    out.put  = NULL;
 
-/****************************************************************************
- *
- * Static variables.
- *
- ****************************************************************************/
+    job_cur  = j;
+    j->total = cli_exec(&j->cli, j->line, strlen(j->line), &out);
+    j->len   = out.len;
+    job_cur  = NULL;
 
+    /* the entry may be taken again as soon as it is forgotten */
+    s = j->sess;
+    __atomic_store_n(&j->state, JOB_DONE, __ATOMIC_RELEASE);
 
-/**
- * The only static variable in the mini-CLI.
- */
-static cli_t        *cb;
+    /* a killed job is forgotten, unless 'kill' did so meanwhile */
+    st = JOB_DONE;
+    if (__atomic_load_n(&j->kill, __ATOMIC_ACQUIRE))
+        __atomic_compare_exchange_n(&j->state, &st, JOB_FREE, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
 
+    /* for 'fg' */
+    if (jobs->done)
+        jobs->done(jobs, s);
 
-/****************************************************************************
- *
- * Local functions.
- *
- ****************************************************************************/
+    return 1;
+}
 
 
-#ifdef __ENABLE_HARDCODE_LOGIN__
-static uint8_t _cli_hardcode_login(char *id, char *pass)
+uint8_t cli_job_killed(void)
 {
-    return (!strcmp(id, LOGIN_ID) && !strcmp(pass, LOGIN_PASSWD));
+    return IN_JOB && __atomic_load_n(&job_cur->kill, __ATOMIC_RELAXED);
 }
-#endif
 
 
-/*
- * Show the help messages of every command at this level.
- * 
- * If the first character of the help message is 0x01, this command is hidden
- * and will not be shown in help output. Otherwise, the help messages were
- * displayed and if the command length gets longer, the output will be shifted
- * too.
- */
-static void _cli_do_show_help(cmd_t *cmd_p)
+void cli_jobs_poll(cli_t *cli, cli_sess_t *s)
 {
-    cmd_t   *p  = cmd_p;
-    int     min = 6;
-    int     len;
-
-    while (p->cmd != NULL) {
-        /* hidden command */
-        if (p->help && p->help[0] == 0x01) {
-            p++;
-            continue;
-        }
+    cli_job_t   *j;
+    uint32_t    i;
+    bool        shown = false;
 
-        len = strlen(p->cmd);
-        if (len > min)
-            min = len;
+    cb       = cli;
+    cb->sess = s;
+    put      = cli->put;
 
-        cli_puts(p->cmd);
+#if __ENABLE_MIRROR__
+    _cli_mirror_begin();
+#endif
+    for (i = 0; i < cli->jobs->n; i++) {
+        j = &cli->jobs->job[i];
 
-        /* if there is no help message, skip display */
-        if (p->help) {
-            len = min - len;
-            do {
-                cb->put(' ');
-            } while (len-- > 0);
+        /* only 'state' comes from a worker, 'fg' is set by this thread */
+        if (__atomic_load_n(&j->state, __ATOMIC_ACQUIRE) != JOB_DONE ||
+            !j->fg || j->sess != s)
+            continue;
 
-            cb->put('-');
-            cb->put(' ');
-            cli_puts(p->help);
+        /* like a log message, above the line being edited */
+        if (!shown) {
+            put('\r');
+            term_erase_eol();
+            shown = true;
         }
-
-        cb->put('\n');
-        p++;
+        _cli_job_show(j);
     }
+    if (shown)
+        _cli_prompt();
+#if __ENABLE_MIRROR__
+    _cli_mirror_end(false);
+#endif
 }
 
 
-/*
- * Parse tokens
- *
- * Note: the spaces in the line are modified to '\0'.
- */
-static int _cli_line_to_tokens(char *line)
+uint32_t cli_jobs_end(cli_t *cli, cli_sess_t *s)
 {
-    char    *ptr; // current pointer to the line
-    int     toks = 0;
+    cli_job_t   *j;
+    uint32_t    left = 0;
+    uint32_t    i;
 
-    memset(cb->tok, 0, sizeof(cb->tok));
+    for (i = 0; cli->jobs && i < cli->jobs->n; i++) {
+        j = &cli->jobs->job[i];
 
-    ptr = line;
+        if (__atomic_load_n(&j->state, __ATOMIC_ACQUIRE) < JOB_QUEUED ||
+            j->sess != s)
+            continue;
 
-    while (*ptr != 0) {
-        cb->tok[toks++] = ptr;
-        while (*ptr != 0 && *ptr != ' ')
-            ptr++;
-        while (*ptr == ' ')
-            *ptr++ = '\0';
+        _cli_job_kill(j);
+        left += __atomic_load_n(&j->state, __ATOMIC_ACQUIRE) != JOB_FREE;
     }
 
-    return toks;
+    return left;
 }
 
 
-/*
- * Find the fully matched command.
- *
- * @note    Duplicated commands were not considered because of space and CPU
- *          resource limit. Programmers MUST be careful when design command
- *          table.
- */
-static cmd_t *_cli_find_one_match(cmd_t *cmd_p, char *str)
+uint8_t cli_jobs(uint8_t len, char *param)
 {
-    cmd_t *match = NULL;
+    static const char   *name[] = { "", "", "queued", "running", "done" };
+    cli_jobs_t          *jobs   = cb->jobs;
+    cli_job_t           *j;
+    uint8_t             st;
+    uint32_t            i;
+
+    for (i = 0; jobs && i < jobs->n; i++) {
+        j  = &jobs->job[i];
+        st = __atomic_load_n(&j->state, __ATOMIC_ACQUIRE);
+
+        if (st < JOB_QUEUED || __atomic_load_n(&j->kill, __ATOMIC_RELAXED) ||
+            j->sess != cb->sess)
+            continue;
 
-    while (cmd_p->cmd != NULL && !match) {
-        if (!strcmp(cmd_p->cmd, str))
-            match = cmd_p;
-        cmd_p++;
+        cli_putc('[');
+        cli_putd(j->id);
+        cli_puts("] ");
+        cli_puts(name[st]);
+        cli_putc('\t');
+        cli_puts(j->line);
+        cli_putln();
     }
 
-    return match;
+    return 0;
 }
 
 
-static void _cli_do_cmd_no_sub(uint8_t len, uint8_t i, cmd_t *cmd_p)
+uint8_t cli_fg(uint8_t len, char *param)
 {
-    if (cmd_p->fptr) {
-        cmd_p->fptr(len - i, cb->tok[i + 1]);
-    } else {
-        cli_puts(cb->tok[i]);
-        cli_puts(" not handled\n");
+    cli_job_t   *j = _cli_job_find(_cli_job_id(param));
+
+    if (!j) {
+        cli_puts("no such job\n");
+        return 0;
+    }
+
+    /* an event loop goes on, cli_jobs_poll() shows the output when done */
+    if (in_loop) {
+        __atomic_store_n(&j->fg, 1, __ATOMIC_SEQ_CST);
+        if (!_cli_job_show(j)) {
+            cli_putc('[');
+            cli_putd(j->id);
+            cli_puts("] ");
+            cli_puts(j->line);
+            cli_putln();
+        }
+        return 0;
     }
+
+    while (!_cli_job_show(j))
+        if (cb->jobs->wait)
+            cb->jobs->wait(JOB_POLL_MS);
+
+    return 0;
 }
 
 
-static void _cli_do_cmd_no_token(uint8_t len, uint8_t i, cmd_t *cmd_p)
+uint8_t cli_kill(uint8_t len, char *param)
 {
-    if (cmd_p->fptr) {
-        cmd_p->fptr(len - i, cb->tok[i + 1]);
-    } else if (cmd_p->sub) {
-        cli_puts("incomplete command, more options:\n");
-        _cli_do_show_help(cmd_p->sub);
-    } else {
-        cli_puts(cb->tok[i]);
-        cli_puts(" not handled\n");
+    uint16_t    id = _cli_job_id(param);
+    cli_job_t   *j = id ? _cli_job_find(id) : NULL;
+
+    if (!j) {
+        cli_puts("no such job\n");
+        return 0;
     }
+
+    _cli_job_kill(j);
+
+    cli_putc('[');
+    cli_putd(id);
+    cli_puts("] killed\n");
+
+    return 0;
 }
+#endif
 
 
-/*
- * Process the input 'line' and return when ended.
- *
- * Note: Use interative instead of recursive to avoid stack overflow.
- */
-static void _cli_do_cmd(char *line)
+#if __ENABLE_CACHE__
+void cli_cache_init(cli_cache_t *cache, cli_cache_ent_t *ent, uint32_t n,
+                    uint32_t (*now)(void))
 {
-    int    toks;
-    int    i;
-    cmd_t  *cmd_p = cb->cmd;
+    cache->now    = now;
+    cache->n      = n;
+    cache->hits   = 0;
+    cache->misses = 0;
+    cache->ent    = ent;
 
-    toks = _cli_line_to_tokens(line);
+    cli_cache_invalidate(cache, NULL);
+}
 
-    /* traverse command tree */
-    for (i = 0; i < toks; i++) {
-        /* help */
-        if (!strcmp(cb->tok[i], "?")) {
-            _cli_do_show_help(cmd_p);
-            break;
-        }
 
-        /* find match command */
-        cmd_p = _cli_find_one_match(cmd_p, cb->tok[i]);
-        if (!cmd_p) {
-            cli_puts(cb->tok[i]);
-            cli_puts(" unknown command\n");
-            break;
-        }
+void cli_cache_invalidate(cli_cache_t *cache, const cmd_t *cmd)
+{
+    uint32_t    i;
 
-        /* out of tokens */
-        if (i == toks - 1) {
-            _cli_do_cmd_no_token(toks, i, cmd_p);
-            break;
-        }
+    for (i = 0; i < cache->n; i++)
+        if (!cmd || cache->ent[i].cmd == cmd)
+            cache->ent[i].cmd = NULL;
+}
+#endif
 
-        /* there are remaining tokens but no sub commands */
-        if (!cmd_p->sub) {
-             _cli_do_cmd_no_sub(toks, i, cmd_p);
-             break;
-        }
 
-        /* descend to next level */
-        cmd_p = cmd_p->sub;
+#if __ENABLE_ALIAS__
+void cli_alias_init(cli_alias_t *alias, cli_alias_ent_t *ent, uint32_t n)
+{
+    uint32_t    i;
+
+    for (i = 0; i < n; i++) {
+        ent[i].name[0] = '\0';
+        ent[i].n       = 0;
     }
+
+    alias->mask = n - 1;
+    alias->ent  = ent;
 }
 
 
-static void _cli_putx(uint32_t hex, uint8_t shift)
+uint8_t cli_alias_define(cli_t *cli, const char *name, const char *text)
 {
-#define HEX_MAX         "FFFFFFFF" /* longest hex */
-#define HEX_BUF_MAX     sizeof(HEX_MAX)
+    cli_alias_t     *a   = cli->alias;
+    size_t          len  = strlen(name);
+    cli_alias_ent_t *e;
+    char            top[MAX_ALIAS_NAME + 1];
+    uint32_t        used = 0;
+    uint32_t        i;
+    uint8_t         ok   = 0;
+#if __ENABLE_MODULES__
+    uint32_t        idx  = _cli_mod_enter();
+#endif
 
-    char        buf[HEX_BUF_MAX + 1];
-    uint8_t     i;
-    uint8_t     h;
+    cb = cli;
 
-    buf[HEX_BUF_MAX] = '\0';
+    if (!len || len > MAX_ALIAS_NAME || strchr(name, ' ') ||
+        _cli_find(NULL, strcpy(top, name)))
+        goto out;
 
-    for (i = HEX_BUF_MAX - 1; i > 0; i--) {
-        h = hex & 0xF;
-        if (h > 9)
-            h += shift - 48 - 10;
+    /* at most half of the table is defined */
+    e = _cli_alias_find(a, name, len, _cli_alias_hash(name, len), true);
+    if (!e->n) {
+        for (i = 0; i <= a->mask; i++)
+            used += a->ent[i].n != 0;
+        if ((used + 1) * 2 > a->mask + 1)
+            goto out;
+        strcpy(e->name, name);
+    }
 
-        buf[i] = h + 48;
-        hex    = hex >> 4;
+    ok = _cli_alias_set(e, text);
 
-        if (!hex)
-            break;
-    }
+out:
+#if __ENABLE_MODULES__
+    _cli_mod_exit(idx);
+#endif
+    return ok;
+}
 
-    cli_puts(&buf[i]);
+
+void cli_alias_undef(cli_t *cli, const char *name)
+{
+    size_t          len = strlen(name);
+    cli_alias_ent_t *e;
+
+    e = _cli_alias_find(cli->alias, name, len, _cli_alias_hash(name, len),
+                        false);
+    if (e)
+        e->n = 0;
 }
 
 
-static uint8_t _cli_getline(cli_t *cb, char *prompt, char echo, char *buf, int16_t pos, uint16_t max)
+void cli_alias_refresh(cli_t *cli)
 {
-    int  i = 0;
-    bool esc = false;
-    uint8_t result = 0;
-    uint32_t key_seq;
-    char c;
+    cli_alias_t     *a = cli->alias;
+    cli_alias_ent_t *e;
+    char            buf[CLI_LINE_BYTES];
+    char            *save_line = tok_line;
+    uint8_t         save_cnt   = tok_cnt;
+    uint8_t         save[MAX_TOKENS];
+    uint32_t        i;
+    uint8_t         k;
+    uint8_t         ok;
+#if __ENABLE_MODULES__
+    uint32_t        idx = _cli_mod_enter();
+#endif
 
-    cli_puts(prompt);
+    cb = cli;
+    memcpy(save, tok, sizeof(save));
 
-    while (1) {
-        c = cb->get();
+    for (i = 0; i <= a->mask; i++) {
+        e       = &a->ent[i];
+        e->gen  = _cli_alias_gen();
+        e->root = cb->cmd;
 
-        if (c == KEY_ESC) {
-            key_seq = 0;
-            esc = true;
-            continue;
+        for (k = 0, ok = 1; ok && k < e->n; k++) {
+            _cli_alias_text(buf, &e->step[k]);
+            ok = _cli_alias_resolve(&e->step[k], buf, e->step[k].len);
         }
+        if (!ok)
+            e->n = 0;
+    }
 
-        if (esc) {
-            key_seq = (key_seq << 8) | c;
-            if (c == '~' || (c >= 'A' && c <= 'D') ||
-                (c >= 'F' && c <= 'H') || (c >= 'P' && c <= 'S')) {
-                esc = false;
-#ifdef DEBUG_KEY_SEQ
-                cli_puts("key: ");
-                for (int i = 0; i < 32; i += 8) {
-                    cli_putx(key_seq >> i);
-                    cb->put(' ');
-                }
-                cb->put('\n');
-#endif
-                // process key seq
-                switch (key_seq) {
-                case KEY_LEFT:
-                    if (i > 0) {
-                        cursor_move_left();
-                        i--;
-                    }
-                    break;
-                case KEY_RIGHT:
-                    if (buf[i] != 0) {
-                        cursor_move_right();
-                        i++;
-                    }
-                    break;
-                case KEY_HOME:
-                    while (i > 0) {
-                        cursor_move_left();
-                        i--;
-                    }
-                    break;
-                case KEY_END:
-                    while (buf[i] != 0) {
-                        cursor_move_right();
-                        i++;
-                    }
-                    break;
-                case KEY_DEL:
-                    break;
-                default:
-#ifdef DEBUG_KEY_SEQ
-                    cli_puts("unknown key code: ");
-                    for (int i = 24; i >= 0; i -= 8) {
-                        cli_putd((key_seq >> i) & 0xFF);
-                        cb->put(' ');
-                    }
-                    cb->put('\n');
-#endif
-                    break;
-                }
-            }
-            continue;
-        }
+    tok_line = save_line;
+    tok_cnt  = save_cnt;
+    memcpy(tok, save, sizeof(save));
 
-        if (c == 3)
-            break;
+#if __ENABLE_MODULES__
+    _cli_mod_exit(idx);
+#endif
+}
 
-        if (c == KEY_DEL) {
-            if (i > 0) {
-                int j = i - 1;
-                cursor_move_left();
-                while (buf[j]) {
-                    buf[j] = buf[j + 1];
-                    cb->put(buf[j] ? buf[j] : ' ');
-                    j++;
-                }
-                i--;
 
-                while ((j--) > i)
-                    cursor_move_left();
+uint8_t cli_alias(uint8_t len, char *param)
+{
+    cli_alias_t     *a = cb->alias;
+    cli_alias_ent_t *e;
+    char            buf[CLI_LINE_BYTES];
+    uint32_t        i;
+    uint8_t         k;
+#if !__ENABLE_JOBS__ && !__ENABLE_SHARDS__
+    int             from = 0;
+#endif
+
+    if (!a)
+        return 0;
+
+    if (len == 1) {
+        for (i = 0; i <= a->mask; i++) {
+            e = &a->ent[i];
+            if (!e->n)
+                continue;
+            cli_puts(e->name);
+            for (k = 0; k < e->n; k++) {
+                _cli_alias_text(buf, &e->step[k]);
+                cli_puts(k ? "; " : " ");
+                cli_puts(buf);
             }
-            continue;
+            cli_putln();
         }
+        return 0;
+    }
 
-        if (c == '\n') {
-            cb->put('\n');
-            result = 1;
-            break;
-        }
+#if __ENABLE_JOBS__ || __ENABLE_SHARDS__
+    /* another thread may be running the alias, see cli_alias_t */
+    cli_puts("aliases are fixed\n");
+#else
+    /* the name is a token of the line, the text is the rest of it */
+    while (_cli_tok(from) != param)
+        from++;
+    _cli_tok_join(buf, from + 1, tok_cnt);
+
+    if (!buf[0] || !cli_alias_define(cb, param, buf))
+        cli_puts("alias not defined\n");
+#endif
 
-        if (i < max) {
-            if (buf[i] == '\0')
-                buf[i + 1] = 0;
-            buf[i++] = c;
-            cb->put(echo ? echo : c);
-        }
-    }
+    return 0;
+}
+
+
+#if !__ENABLE_JOBS__ && !__ENABLE_SHARDS__
+uint8_t cli_unalias(uint8_t len, char *param)
+{
+    if (cb->alias && len > 1)
+        cli_alias_undef(cb, param);
 
-    return result;
+    return 0;
 }
+#endif
+#endif
 
 
-#if  __ENABLE_LOGIN__
-/**
- * The login function.
- *
- * The login function returns only if the login has succeed. Otherwise, the
- * user is stucked in login loop.
- */
-static void _cli_login(void)
+#if __ENABLE_LOG_QUEUE__
+void cli_logq_init(cli_logq_t *q, cli_log_slot_t *slot, uint32_t n)
 {
-    char    id   [MAX_ID + 1];
-    char    pass [MAX_ID + 1];
+    uint32_t    i;
 
-    /* already logged in */
-    if (cb->state) return;
+    for (i = 0; i < n; i++)
+        slot[i].seq = i;
 
-    while (1) {
-        id[0] = '\0';
-        if (!_cli_getline(cb, "login: ", 0, id, 0, MAX_ID))
-            continue;
+    q->head     = 0;
+    q->tail     = 0;
+    q->mask     = n - 1;
+    q->dropped  = 0;
+    q->slot     = slot;
+}
 
-        pass[0] = '\0';
-        if (!_cli_getline(cb, "password: ", '*', pass, 0, MAX_ID))
-            continue;
 
-        /* validate */
-        if (cb->knock(id, pass)) {
-            cb->state = 1;
-        }
+/*
+ * Each slot carries a sequence number telling whose turn it is: 'pos' when
+ * free for the producer claiming position 'pos', 'pos + 1' when filled for
+ * the CLI. Producers claim positions by CAS on 'head' and never wait.
+ */
+uint8_t cli_log(cli_logq_t *q, const char *msg)
+{
+    uint32_t        pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    cli_log_slot_t  *slot;
+    int32_t         dif;
+    uint16_t        i;
 
-        cli_puts("login failed\n");
+    while (1) {
+        slot = &q->slot[pos & q->mask];
+        dif  = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            /* full, the CLI has not yet printed the previous lap */
+            __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
     }
-}
-#endif
 
+    for (i = 0; i < MAX_LOG_MSG - 2 && msg[i]; i++)
+        slot->msg[i] = msg[i];
+    if (i == 0 || slot->msg[i - 1] != '\n')
+        slot->msg[i++] = '\n';
+    slot->msg[i] = '\0';
 
-/****************************************************************************
- *
- * API functions.
- *
- ****************************************************************************/
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+#endif
 
 
-void cli_init(cli_t *cli)
+#if __ENABLE_RX_RING__
+void cli_rx_init(cli_rx_t *rx, char *buf, uint16_t n)
 {
-    cb          = cli;
-#ifdef __ENABLE_HARDCODE_LOGIN__
-    cb->knock   = _cli_hardcode_login;
-#endif
+    rx->head    = 0;
+    rx->tail    = 0;
+    rx->mask    = n - 1;
+    rx->dropped = 0;
+    rx->buf     = buf;
 }
 
 
-void cli_task(void)
+/*
+ * 'head' and 'tail' run freely and are only masked to index 'buf'. The
+ * release on 'head' publishes the bytes, the release on 'tail' returns the
+ * space.
+ */
+uint16_t cli_rx_push(cli_rx_t *rx, const char *data, uint16_t len)
 {
-    char line[65];
+    uint16_t    head = rx->head;
+    uint16_t    tail = __atomic_load_n(&rx->tail, __ATOMIC_ACQUIRE);
+    uint16_t    room = rx->mask + 1 - (uint16_t)(head - tail);
+    uint16_t    i;
+
+    if (len > room) {
+        rx->dropped += len - room;
+        len          = room;
+    }
 
-#if  __ENABLE_LOGIN__
-    _cli_login();
-#endif
+    for (i = 0; i < len; i++)
+        rx->buf[(uint16_t)(head + i) & rx->mask] = data[i];
 
-    do {
-        line[0] = '\0';
-        if (_cli_getline(cb, "$ ", 0, line, 0, 64))
-            _cli_do_cmd(line);
-    } while (cb->state);
+    __atomic_store_n(&rx->head, head + len, __ATOMIC_RELEASE);
+
+    if (len && rx->wake)
+        rx->wake();
+
+    return len;
 }
 
 
-void cli_puts(char *s)
+char cli_rx_getch(void)
 {
-    do {
-        cb->put(*s);
-    } while (*s++);
+    cli_rx_t    *rx  = cb->rx;
+    uint16_t    tail = rx->tail;
+    char        c;
+
+    while (__atomic_load_n(&rx->head, __ATOMIC_ACQUIRE) == tail)
+        if (rx->sleep)
+            rx->sleep(0xFFFF);
+
+    c = rx->buf[tail & rx->mask];
+    __atomic_store_n(&rx->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return c;
 }
 
 
-uint8_t cli_logout(uint8_t len, char *param)
+uint8_t cli_rx_wait(uint16_t ms)
 {
-    cb->state = 0;
-    cli_puts("logout\n");
-    return 0;
+    cli_rx_t    *rx = cb->rx;
+
+    if (__atomic_load_n(&rx->head, __ATOMIC_ACQUIRE) == rx->tail && rx->sleep)
+        rx->sleep(ms);
+
+    return __atomic_load_n(&rx->head, __ATOMIC_ACQUIRE) != rx->tail;
 }
+#endif
 
 
 void cli_putc(char c)
 {
-    cb->put(c);
+    put(c);
 }
 
 
@@ -538,3 +3593,61 @@ void cli_put0X(uint32_t hex)
     _cli_putx(hex, 65);
 }
 
+
+#ifdef __UT_CLI__
+/****************************************************************************
+ *
+ * Internals used by the unit test, see its 'batch', 'history' and 'alias'
+ * cases.
+ *
+ ****************************************************************************/
+
+
+int ut_cli_tokens(char *line, bool simd)
+{
+    return _cli_tokens(line, simd);
+}
+
+
+size_t ut_cli_lines(const char *buf, size_t len)
+{
+    const char  *end  = buf + len;
+    size_t      lines = 0;
+
+    while (buf < end)
+        lines += _cli_next_line(buf, end, &buf) != 0;
+
+    return lines;
+}
+
+
+char *ut_cli_tok(int i)
+{
+    return _cli_tok(i);
+}
+
+
+#if __ENABLE_HISTORY__
+/* an append whose writer stops before sealing it, the offset of the entry */
+uint32_t ut_cli_hist_claim(cli_hist_t *h, const char *line)
+{
+    cli_hist_rec_t  *r = _cli_hist_claim(h, strlen(line));
+
+    if (!r)
+        return 0;
+
+    strcpy(r->line, line);
+    return (char *)r - (char *)h->hdr;
+}
+
+
+/* and goes on later */
+void ut_cli_hist_seal(cli_hist_t *h, uint32_t ofs)
+{
+    cli_hist_rec_t  *r = HIST_REC(h, ofs);
+
+    __atomic_store_n(&r->head, HIST_HEAD(HIST_LEN(r->head), HIST_SEAL),
+                     __ATOMIC_RELEASE);
+}
+#endif
+#endif
@@ -2,6 +2,7 @@
 #ifndef __CLI_H__
 #define __CLI_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -15,13 +16,256 @@ extern "C" {
  ****************************************************************************/
 
 
+/*
+ * Features. All of them allow external overwrite.
+ */
+
+
 #ifndef __ENABLE_LOGIN__
-/* allows external overwrite */
 #define __ENABLE_LOGIN__        (1)
 #endif
 
 
+#ifndef __ENABLE_WATCH__
+#define __ENABLE_WATCH__        (1)
+#endif
+
+
+#ifndef __ENABLE_COMPLETION__
+/* complete commands with the tab key */
+#define __ENABLE_COMPLETION__   (1)
+#endif
+
+
+#ifndef __ENABLE_LAZY_CMD__
+/* sub commands produced by a callback, adds cmd_t.lazy */
+#define __ENABLE_LAZY_CMD__     (0)
+#endif
+
+
+#ifndef __ENABLE_LOG_QUEUE__
+/* asynchronous log messages, needs the __atomic builtins of GCC or clang */
+#define __ENABLE_LOG_QUEUE__    (0)
+#endif
+
+
+#ifndef __ENABLE_RX_RING__
+/* interrupt driven input, needs the __atomic builtins of GCC or clang */
+#define __ENABLE_RX_RING__      (0)
+#endif
+
+
+#ifndef __ENABLE_MODULES__
+/* commands attached at runtime, needs the __atomic builtins of GCC or clang */
+#define __ENABLE_MODULES__      (0)
+#endif
+
+
+#ifndef __ENABLE_CACHE__
+/* serve the output of cmd_t.ttl commands from cli_t.cache, adds cmd_t.ttl */
+#define __ENABLE_CACHE__        (0)
+#endif
+
+
+#ifndef __ENABLE_JOBS__
+/* commands run in the background with '&', needs __atomic and __thread */
+#define __ENABLE_JOBS__         (0)
+#endif
+
+
+#ifndef __ENABLE_SHARDS__
+/* several threads each serve their own cli_t, as net.c does, needs __thread */
+#define __ENABLE_SHARDS__       (0)
+#endif
+
+
+#ifndef __ENABLE_BACKOFF__
+/* refuse logins from a peer for a while after it failed, adds cli_t.backoff */
+#define __ENABLE_BACKOFF__      (0)
+#endif
+
+
+#ifndef __ENABLE_HISTORY__
+/* shared history with up, down and ctrl-r, needs the __atomic builtins */
+#define __ENABLE_HISTORY__      (0)
+#endif
+
+
+#ifndef __ENABLE_MIRROR__
+/* the output of a session shared with watchers, needs the __atomic builtins */
+#define __ENABLE_MIRROR__       (0)
+#endif
+
+
+#ifndef __ENABLE_ALIAS__
+/* names standing for command lines resolved in advance, adds cli_t.alias */
+#define __ENABLE_ALIAS__        (0)
+#endif
+
+
+#ifndef __ENABLE_CMD_INDEX__
+/* binary search and help width of tables made by cli.hpp, adds cmd_t fields */
+#define __ENABLE_CMD_INDEX__    (0)
+#endif
+
+
+#ifndef __ENABLE_SIMD__
+/* scan lines 16 bytes at a time where the target has SSE2 */
+#define __ENABLE_SIMD__         (1)
+#endif
+
+
+/*
+ * Buffer sizes. All of them allow external overwrite.
+ *
+ * Except for the few bytes of number formatting, every buffer of mini-CLI is
+ * carved out of cli_t.arena, which needs CLI_ARENA_SIZE bytes, or is part of
+ * a session, which needs CLI_SESS_BYTES.
+ */
+
+
+#ifndef MAX_TOKENS
 #define MAX_TOKENS              (20)
+#endif
+
+
+#ifndef MAX_LINE
+/* longest command line, not including the terminating '\0', below 255 */
+#define MAX_LINE                (64)
+#endif
+
+
+#ifndef MAX_EXEC_DEPTH
+/* how deep cli_exec() can be nested, e.g. by watch */
+#define MAX_EXEC_DEPTH          (2)
+#endif
+
+
+#ifndef MAX_ID
+/* longest login id and password */
+#define MAX_ID                  (16)
+#endif
+
+
+#ifndef MAX_WATCH
+/* largest output of a command run by watch, in bytes */
+#define MAX_WATCH               (512)
+#endif
+
+
+#ifndef MAX_LOG_MSG
+/* longest log message, including the terminating '\0' */
+#define MAX_LOG_MSG             (80)
+#endif
+
+
+#ifndef LOG_SLOTS
+/* number of messages the log queue holds, a power of 2 */
+#define LOG_SLOTS               (8)
+#endif
+
+
+#ifndef MAX_CACHE_OUT
+/* longest output kept by a cache entry, longer output is not cached */
+#define MAX_CACHE_OUT           (256)
+#endif
+
+
+#ifndef MAX_JOB_OUT
+/* output kept of a background job, the rest is dropped */
+#define MAX_JOB_OUT             (512)
+#endif
+
+
+#ifndef JOB_POLL_MS
+/* how often a blocking 'fg' checks whether the job is done */
+#define JOB_POLL_MS             (10)
+#endif
+
+
+#ifndef MOD_READER_SLOTS
+/* cache lines of module reader counters, one per thread up to this many */
+#define MOD_READER_SLOTS        (16)
+#endif
+
+
+#ifndef HIST_HOLES
+/* history entries still being written which the index watches for a seal */
+#define HIST_HOLES              (4)
+#endif
+
+
+#ifndef BACKOFF_MS
+/* how long a peer waits after its first failed login, doubled for each */
+#define BACKOFF_MS              (250)
+#endif
+
+
+#ifndef BACKOFF_MAX_MS
+/* the longest a peer waits */
+#define BACKOFF_MAX_MS          (60000)
+#endif
+
+
+#ifndef MIRROR_SEG
+/* bytes of output per segment of a mirror */
+#define MIRROR_SEG              (256)
+#endif
+
+
+#ifndef MIRROR_MS
+/* how long a partial line waits for its segment to fill, see cli_mirror_t */
+#define MIRROR_MS               (50)
+#endif
+
+
+#ifndef MAX_ALIAS_NAME
+/* longest alias name */
+#define MAX_ALIAS_NAME          (15)
+#endif
+
+
+#ifndef MAX_ALIAS_STEPS
+/* most command lines an alias runs, separated by ';' when defined */
+#define MAX_ALIAS_STEPS         (4)
+#endif
+
+
+#ifndef MAX_COMPLETIONS
+/* how many candidates the tab key lists at most */
+#define MAX_COMPLETIONS         (32)
+#endif
+
+
+#ifndef LOG_POLL_MS
+/* how often the log queue is checked while waiting for a key */
+#define LOG_POLL_MS             (50)
+#endif
+
+
+#define CLI_LINE_BYTES          (MAX_LINE + 1)
+#define CLI_EXEC_BYTES          (CLI_LINE_BYTES * MAX_EXEC_DEPTH)
+
+/* a session and its line, rounded up for the next one in a slab */
+#define CLI_SESS_BYTES          ((sizeof(cli_sess_t) + CLI_LINE_BYTES + \
+                                  sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+#if __ENABLE_WATCH__
+#define CLI_WATCH_BYTES         (CLI_LINE_BYTES + MAX_WATCH * 2)
+#else
+#define CLI_WATCH_BYTES         (0)
+#endif
+
+#if __ENABLE_LOG_QUEUE__
+#define CLI_LOGQ_BYTES          (sizeof(cli_log_slot_t) * LOG_SLOTS)
+#else
+#define CLI_LOGQ_BYTES          (0)
+#endif
+
+#define CLI_ARENA_SIZE          (CLI_LOGQ_BYTES  + \
+                                 CLI_SESS_BYTES  + \
+                                 CLI_EXEC_BYTES  + \
+                                 CLI_WATCH_BYTES)
 
 
 /****************************************************************************
@@ -62,15 +306,73 @@ typedef char    (*getch_fptr)(void);
 typedef void    (*putch_fptr)(char);
 
 
+/**
+ * The function pointer prototype to wait for input.
+ *
+ * Wait at most 'ms' milliseconds for a character to become available from
+ * the input source. Optional, but commands which run until interrupted by
+ * the user, such as cli_watch(), are not available without it.
+ *
+ * @retval  0   if no character arrived in time.
+ *              other values if getch_fptr can be called without blocking.
+ */
+typedef uint8_t (*wait_fptr)(uint16_t ms);
+
+
 #if __ENABLE_LOGIN__
 /**
  * If login is enabled and hardcode is not used. This is the callback function
- * that mini-CLI will call to authenicate the user.
+ * that mini-CLI will call to authenicate the user. If cli_t.knock is NULL, the
+ * hardcoded login is used unless __ENABLE_REAL_KNOCK__ is defined. See cred.h
+ * for a store of many accounts.
  *
  * @retval  0   if validation of the combination of 'id' and 'pass' failed.
  *              other values if succeeded.
  */
 typedef uint8_t (*knock_fptr)(char *id, char *pass);
+
+
+/**
+ * A backend which takes a while, in place of knock_fptr when cli_t.knock_async
+ * is set. It starts the validation and returns; the result is reported later
+ * with cli_knock_done() for the session, see cli_sess(). Meanwhile 'id' and
+ * 'pass' stay valid, the session ignores its input and other sessions are
+ * served as usual.
+ */
+typedef void    (*knock_async_fptr)(char *id, char *pass);
+#endif
+
+
+#if __ENABLE_BACKOFF__
+/**
+ * An entry of the backoff table. Only to be allocated by users, see
+ * cli_backoff_init().
+ */
+typedef struct cli_backoff_ent_s {
+    uint32_t        peer;
+    uint32_t        until;      ///< cli_backoff_t.now when it may retry
+    uint16_t        fails;      ///< 0 if unused
+} cli_backoff_ent_t;
+
+
+/**
+ * The peers which failed to log in recently.
+ *
+ * After each failed login a peer is refused for BACKOFF_MS, doubled with
+ * every further failure up to BACKOFF_MAX_MS; a successful login forgets it.
+ * A refused attempt is answered like a wrong password without calling
+ * cli_t.knock, so guessing costs a table lookup. What a peer is, typically
+ * the address of the client, is up to 'peer'. The table is bounded: a peer
+ * is found among a few entries, and a new one replaces the entry which is
+ * free the soonest. Not thread-safe: net_start() refuses a template with
+ * one, its 'setup' may give each shard a table of its own.
+ */
+typedef struct cli_backoff_s {
+    uint32_t        (*now)(void);   ///< a clock in ms, may wrap
+    uint32_t        (*peer)(void);  ///< the peer of the session being served
+    uint32_t        mask;           ///< number of entries - 1
+    cli_backoff_ent_t *ent;
+} cli_backoff_t;
 #endif
 
 
@@ -86,6 +388,60 @@ typedef uint8_t (*knock_fptr)(char *id, char *pass);
 typedef uint8_t (*fp_t)(uint8_t len, char *param);
 
 
+#if __ENABLE_LOG_QUEUE__
+/**
+ * A slot of the log queue. Only to be allocated by users, see cli_logq_init().
+ */
+typedef struct cli_log_slot_s {
+    uint32_t        seq;
+    char            msg[MAX_LOG_MSG];
+} cli_log_slot_t;
+
+
+/**
+ * A bounded multi-producer, single-consumer queue of log messages.
+ *
+ * Any number of threads or interrupt handlers may call cli_log() without
+ * locking, while the CLI prints the queued messages between key strokes
+ * without disturbing the line being edited. The CLI of one thread at a time
+ * may print them: net_start() refuses a template with a queue, its 'setup'
+ * may give each shard a queue of its own.
+ */
+typedef struct cli_logq_s {
+    uint32_t        head;       ///< next slot to fill, shared by producers
+    uint32_t        tail;       ///< next slot to print, owned by the CLI
+    uint32_t        mask;       ///< number of slots - 1
+    uint32_t        dropped;    ///< messages lost because the queue was full
+    cli_log_slot_t  *slot;
+} cli_logq_t;
+#endif
+
+
+#if __ENABLE_RX_RING__
+/**
+ * A single-producer, single-consumer receive ring.
+ *
+ * The producer, typically the UART receive interrupt handler, calls
+ * cli_rx_push(). The CLI consumes it with cli_rx_getch() and cli_rx_wait(),
+ * which can be used as cli_t.get and cli_t.wait.
+ *
+ * While the ring is empty, the CLI calls 'sleep' instead of polling. 'sleep'
+ * returns when 'wake' is called or after 'ms' milliseconds. A 'wake' that
+ * happens before 'sleep' must not be lost, i.e. they behave like giving and
+ * taking a binary semaphore. If 'sleep' is NULL, the CLI busy-waits.
+ */
+typedef struct cli_rx_s {
+    uint16_t        head;       ///< written by the producer only
+    uint16_t        tail;       ///< written by the CLI only
+    uint16_t        mask;       ///< size of 'buf' - 1
+    uint32_t        dropped;    ///< bytes lost because the ring was full
+    char            *buf;
+    void            (*sleep)(uint16_t ms);
+    void            (*wake)(void);
+} cli_rx_t;
+#endif
+
+
 /**
  * Forward declare the type of cmd_t such that ancient compilers won't
  * complain.
@@ -93,26 +449,397 @@ typedef uint8_t (*fp_t)(uint8_t len, char *param);
 typedef struct cmd_s cmd_t;
 
 
+#if __ENABLE_LAZY_CMD__
+/**
+ * Function pointer type of lazy sub commands.
+ *
+ * Instead of, or in addition to, a 'sub' table a command may produce its sub
+ * commands on demand, e.g. one per network interface. It is called:
+ *
+ * - with 'iter' NULL to look up the sub command named 'key', or
+ * - with 'iter' not NULL to enumerate the sub commands whose name starts
+ *   with 'key', which is "" for all. '*iter' is 0 for the first call and is
+ *   free for the callback to use. NULL ends the enumeration.
+ *
+ * The cmd_t returned may be overwritten by the next call of the callback,
+ * but must stay valid while its handler runs.
+ */
+typedef const cmd_t *(*lazy_fptr)(const char *key, uint32_t *iter);
+#endif
+
+
 struct cmd_s {
-    char    *cmd;
-    char    *help;
-    fp_t    fptr;
-    cmd_t   *sub;   ///< sub commands
+    const char      *cmd;
+    const char      *help;
+    fp_t            fptr;
+    const cmd_t     *sub;   ///< sub commands
+#if __ENABLE_LAZY_CMD__
+    lazy_fptr       lazy;   ///< sub commands made on demand
+#endif
+#if __ENABLE_CACHE__
+    uint16_t        ttl;    ///< ms the output may be reused, 0 for never
+#endif
+#if __ENABLE_CMD_INDEX__
+    /*
+     * Filled in by cli::make_table(), left 0 in C tables which are then
+     * searched linearly.
+     */
+    uint8_t         count;  ///< commands of the table, in its first entry
+    uint8_t         width;  ///< longest name shown by help, in the first entry
+    uint8_t         order;  ///< the i-th entry has the i-th name in order
+#endif
+};
+
+
+#if __ENABLE_MODULES__
+/**
+ * A table of commands attached to the command tree at runtime.
+ *
+ * The commands in 'cmd' appear at the level of 'level', which is a table of
+ * the tree: cli_t.cmd, a 'sub' of a command, or the 'cmd' of another module.
+ */
+typedef struct cli_mod_s cli_mod_t;
+
+struct cli_mod_s {
+    const cmd_t     *level;
+    const cmd_t     *cmd;       ///< terminated by { NULL }
+    cli_mod_t       *next;      ///< used by mini-CLI
 };
+#endif
+
+
+/**
+ * The mutable state of a session, i.e. of one user.
+ *
+ * Kept small because a server may hold many idle sessions; everything which
+ * can be shared lives in cli_t. Sessions are allocated with CLI_SESS_BYTES
+ * each, e.g. by cli_slab_t, since 'line' follows the structure.
+ */
+typedef struct cli_sess_s {
+    /* touched by every key */
+    uint8_t         state;      ///< 0 if not logged in
+    uint8_t         mode;       ///< what 'line' is edited for
+    uint8_t         pos;        ///< cursor position in 'line'
+    uint8_t         esc;        ///< non-zero in an escape sequence
+    uint32_t        key_seq;    ///< escape sequence so far
+#if __ENABLE_HISTORY__
+    uint32_t        hist;       ///< the history entry shown, or found
+#endif
+
+    /* touched by callbacks only */
+    void            *user;      ///< not used by mini-CLI, see cli_user()
+#if __ENABLE_MIRROR__
+    struct cli_mirror_s *mirror;    ///< see cli_mirror_attach()
+#endif
+
+    char            line[];     ///< CLI_LINE_BYTES
+} cli_sess_t;
+
+
+#if __ENABLE_CACHE__
+/**
+ * An entry of the output cache. Only to be allocated by users, see
+ * cli_cache_init().
+ */
+typedef struct cli_cache_ent_s {
+    const cmd_t     *cmd;               ///< NULL if unused
+    uint32_t        stamp;              ///< cli_cache_t.now when rendered
+    uint16_t        len;                ///< bytes in 'out'
+    char            key[MAX_LINE + 1];  ///< the tokens, one space apart
+    char            out[MAX_CACHE_OUT];
+} cli_cache_ent_t;
+
+
+/**
+ * The rendered output of commands with a cmd_t.ttl.
+ *
+ * A command line is keyed by its tokens, so "show  x" and "show x" share an
+ * entry. While the entry is younger than the ttl, the dispatcher replays its
+ * output instead of calling the handler, for every session of every cli_t
+ * which points to this cache. Not thread-safe: the cli_t of one thread at a
+ * time may use it, net_start() gives each shard a cache of its own, and
+ * background jobs do not use it.
+ */
+typedef struct cli_cache_s {
+    uint32_t        (*now)(void);       ///< a clock in ms, may wrap
+    uint32_t        n;                  ///< number of entries
+    uint32_t        hits;
+    uint32_t        misses;
+    cli_cache_ent_t *ent;
+} cli_cache_t;
+#endif
+
+
+#if __ENABLE_HISTORY__
+/**
+ * The start of a history region, see cli_hist_t.
+ */
+typedef struct cli_hist_hdr_s {
+    uint32_t        magic;
+    uint32_t        tail;       ///< bytes used, including this header
+} cli_hist_hdr_t;
+
+
+/**
+ * A command history shared by sessions, threads and processes.
+ *
+ * The entries are appended to a region of memory, usually a file mapped
+ * with MAP_SHARED so that the history survives restarts, see hist.h. An
+ * append claims the entry at the tail together with its length by a
+ * compare-and-swap, moves the tail past it and seals it once written, so
+ * appends never lock. The region is not reused when full; new entries are
+ * dropped, and counted in 'dropped', until it is rotated, see hist_open().
+ *
+ * The offsets of the sealed entries are indexed in 'idx', private to the
+ * process. The index is extended from 'scan' as new entries appear, so the
+ * region is read once rather than at each login. An entry still being
+ * written is stepped over and indexed at its place once sealed. Up to
+ * HIST_HOLES of them are watched, past that the oldest is taken for dead;
+ * one whose writer died is dropped by the next rotation.
+ */
+typedef struct cli_hist_s {
+    cli_hist_hdr_t  *hdr;       ///< the region
+    uint32_t        size;       ///< bytes of the region
+    uint32_t        *idx;       ///< offsets of the entries, oldest first
+    uint32_t        idx_max;
+    uint32_t        idx_n;
+    uint32_t        scan;       ///< offset of the first entry not indexed
+    uint32_t        dropped;    ///< entries lost because the region is full
+    uint32_t        hole[HIST_HOLES];   ///< entries stepped over by 'scan'
+    uint8_t         holes;
+    uint8_t         syncing;
+} cli_hist_t;
+#endif
+
+
+#if __ENABLE_MIRROR__
+/**
+ * A segment of mirrored output. Only to be allocated by users, see
+ * cli_mirror_init().
+ */
+typedef struct cli_mirror_seg_s {
+    uint32_t        refs;       ///< 0 if free
+    uint32_t        seq;        ///< the number it was published as
+    uint16_t        len;
+    char            data[MIRROR_SEG];
+} cli_mirror_seg_t;
 
 
+/**
+ * The output of a session, shared with any number of readers.
+ *
+ * The session's output is copied once into segments. The last 'depth'
+ * segments published stay in 'ring'. Readers get pointers into the
+ * segments, not copies. A segment counts its holders: the ring, the
+ * session filling it and each reader using it. It returns to the pool
+ * when the count drops to zero.
+ *
+ * A segment is published when it is full, and at the end of each call
+ * serving the session, such as cli_input(), up to its last newline, so
+ * that typing does not publish a segment per key. The partial line after
+ * it, e.g. the prompt, waits for more output, for the session to end, or,
+ * with the clock 'now', for the first call MIRROR_MS after it was started.
+ *
+ * The session never waits for a reader. A reader falling more than
+ * 'depth' segments behind skips ahead to the oldest segment still in the
+ * ring, and counts what it missed. Each holder has at most one segment,
+ * so the pool never runs dry when it has 'depth' + 1 segments plus one
+ * per reader.
+ */
+typedef struct cli_mirror_s {
+    cli_mirror_seg_t    *seg;       ///< the pool
+    cli_mirror_seg_t    **ring;     ///< the segments published, by seq
+    cli_mirror_seg_t    *fill;      ///< being filled by the session
+    uint32_t            (*now)(void);   ///< a clock in ms, may wrap, or NULL
+    uint32_t            since;      ///< 'now' when 'fill' was taken
+    uint16_t            n;          ///< segments in the pool
+    uint16_t            depth;      ///< entries of 'ring'
+    uint16_t            readers;    ///< opened
+    uint16_t            max_readers;
+    uint32_t            head;       ///< number of segments published
+} cli_mirror_t;
+
+
+/**
+ * A reader of a mirror, e.g. a watcher's connection or a log file. Only to
+ * be allocated by users, see cli_mirror_open().
+ */
+typedef struct cli_mirror_reader_s {
+    cli_mirror_t        *m;
+    cli_mirror_seg_t    *held;      ///< returned by the last cli_mirror_read()
+    uint32_t            next;       ///< seq of the next segment to read
+    uint32_t            skipped;    ///< segments missed for being slow
+} cli_mirror_reader_t;
+#endif
+
+
+#if __ENABLE_ALIAS__
+/**
+ * A command line of an alias, resolved when the alias was defined.
+ */
+typedef struct cli_alias_step_s {
+    const cmd_t     *cmd;               ///< NULL if dispatched as text
+    uint8_t         depth;              ///< the token of 'cmd'
+    uint8_t         toks;
+    uint8_t         len;                ///< bytes of 'line'
+    uint8_t         tok[MAX_TOKENS];    ///< offsets of the tokens in 'line'
+    char            line[MAX_LINE + 1]; ///< the tokens, '\0' apart
+} cli_alias_step_t;
+
+
+/**
+ * An alias. Only to be allocated by users, see cli_alias_init().
+ */
+typedef struct cli_alias_ent_s {
+    char            name[MAX_ALIAS_NAME + 1];   ///< "" if never used
+    uint8_t         n;                  ///< steps, 0 once undefined
+    uint32_t        gen;                ///< of the tree resolved against
+    const cmd_t     *root;
+    cli_alias_step_t step[MAX_ALIAS_STEPS];
+} cli_alias_ent_t;
+
+
+/**
+ * The aliases of a cli_t.
+ *
+ * A command line starting with the name of an alias runs its steps, with the
+ * rest of the line appended to the last step. Each step is resolved when
+ * the alias is defined to the cmd_t of its handler and the tokens passed
+ * to it, so running one costs a hash lookup and the handler call, whatever
+ * the depth of the command.
+ *
+ * Attaching or detaching a module changes the tree. The steps resolved
+ * before are then dispatched as text, like any line, until
+ * cli_alias_refresh(). So are steps which go through lazy sub commands,
+ * which are only known when dispatched.
+ *
+ * The table is open-addressed and must not be more than half full. Aliases
+ * are defined and refreshed while no line of the cli_t is being dispatched,
+ * or, without jobs or shards, by the built-in 'alias' command.
+ */
+typedef struct cli_alias_s {
+    uint32_t        mask;               ///< entries - 1
+    cli_alias_ent_t *ent;
+} cli_alias_t;
+#endif
+
+
+/**
+ * The configuration shared by all sessions.
+ */
 typedef struct cli_s {
-    uint8_t         state; ///< 0 if not logged in
-    cmd_t           *cmd;
+    uint8_t         state;  ///< state of new sessions, 1 to skip login
+    const cmd_t     *cmd;
     getch_fptr      get;
     putch_fptr      put;
+    wait_fptr       wait;
 #if __ENABLE_LOGIN__
     knock_fptr      knock;
+    knock_async_fptr knock_async;   ///< used instead of 'knock' if set
+#endif
+#if __ENABLE_BACKOFF__
+    cli_backoff_t   *backoff;
+#endif
+#if __ENABLE_LOG_QUEUE__
+    cli_logq_t      *logq;
+#endif
+#if __ENABLE_RX_RING__
+    cli_rx_t        *rx;
+#endif
+#if __ENABLE_CACHE__
+    cli_cache_t     *cache;
+#endif
+#if __ENABLE_JOBS__
+    struct cli_jobs_s *jobs;
+#endif
+#if __ENABLE_HISTORY__
+    cli_hist_t      *hist;
+#endif
+#if __ENABLE_ALIAS__
+    cli_alias_t     *alias;
 #endif
-    char            *tok[MAX_TOKENS];
+    void            *arena; ///< CLI_ARENA_SIZE bytes, 4-byte aligned
+    cli_sess_t      *sess;  ///< the session being served
 } cli_t;
 
 
+#if __ENABLE_JOBS__
+/**
+ * A background job. Only to be allocated by users, see cli_jobs_init().
+ */
+typedef struct cli_job_s {
+    uint8_t         state;              ///< free, queued, running or done
+    uint8_t         kill;               ///< see cli_job_killed()
+    uint16_t        id;                 ///< as shown by 'jobs'
+    uint16_t        len;                ///< bytes in 'out'
+    uint8_t         fg;                 ///< see cli_jobs_poll()
+    uint32_t        total;              ///< bytes produced
+    cli_sess_t      *sess;              ///< the session which started it
+    cli_t           cli;                ///< as started, with 'copy' as session
+    char            line[MAX_LINE + 1]; ///< the command line without '&'
+    char            out[MAX_JOB_OUT];
+    void            *copy[CLI_SESS_BYTES / sizeof(void *)]; ///< of 'sess'
+} cli_job_t;
+
+
+/**
+ * The background jobs of one or more cli_t.
+ *
+ * A command line ending with the token "&" is queued as a job and the prompt
+ * returns at once. Any number of worker threads take the jobs by calling
+ * cli_job_run(), e.g.:
+ *
+ *     for (;;)
+ *         if (!cli_job_run(&jobs))
+ *             jobs.sleep(1000);
+ *
+ * 'sleep' returns when 'wake' is called or after 'ms' milliseconds, like
+ * cli_rx_t.sleep; 'wake' is called when a job is queued. 'wait' and 'done'
+ * are the same for the other side: 'done' is called when a job is done, and
+ * 'wait' by 'fg' under cli_task() or cli_exec() while waiting for one. An
+ * event loop serving sessions by cli_input() uses 'done', which is given the
+ * session which started the job, to call cli_jobs_poll() for it instead,
+ * 'fg' does not block there.
+ */
+typedef struct cli_jobs_s {
+    uint32_t        n;                  ///< number of entries in 'job'
+    uint16_t        last_id;
+    cli_job_t       *job;
+    void            (*sleep)(uint16_t ms);
+    void            (*wake)(void);
+    void            (*wait)(uint16_t ms);
+    void            (*done)(struct cli_jobs_s *jobs, cli_sess_t *s);
+    void            *user;              ///< for the callbacks
+} cli_jobs_t;
+#endif
+
+
+/**
+ * A pool of sessions of CLI_SESS_BYTES each, see cli_slab_init().
+ */
+typedef struct cli_slab_s {
+    cli_sess_t      *free;
+    uint32_t        used;
+    uint32_t        total;
+} cli_slab_t;
+
+
+/**
+ * The output sink of cli_exec().
+ *
+ * The output of the command is stored in 'buf', which is always terminated
+ * by '\0' if 'size' is not 0. Output that does not fit is dropped. 'len' is
+ * the number of bytes stored and is maintained by mini-CLI. If 'put' is not
+ * NULL, every output character is passed to it as well.
+ */
+typedef struct cli_sink_s {
+    char            *buf;
+    uint16_t        size;
+    uint16_t        len;
+    putch_fptr      put;
+} cli_sink_t;
+
+
 /**************************************************************************** 
  *
  * Function prototypes.
@@ -122,6 +849,11 @@ typedef struct cli_s {
 
 /**
  * Initialization.
+ *
+ * The buffers are carved out of 'cli->arena'. If it is NULL, a static arena
+ * shared by all cli_t is used. If 'cli->logq' is set but not initialized,
+ * LOG_SLOTS slots of the arena are used for it. If 'cli->sess' is NULL, a
+ * session is carved out of the arena too.
  */
 void cli_init(cli_t *cli);
 
@@ -129,15 +861,109 @@ void cli_init(cli_t *cli);
 /**
  * The top-level function of the actual CLI.
  *
- * This function will never exit unless the user logged out.
+ * Serves 'sess' of the last cli_init() by reading cli_t.get. This function
+ * will never exit unless the user logged out.
  */
 void cli_task(void);
 
 
+/**
+ * Start a session: reset 's' and show the first prompt.
+ *
+ * Together with cli_input(), this allows to serve any number of sessions
+ * without a task or a blocking cli_t.get for each of them.
+ */
+void cli_sess_start(cli_t *cli, cli_sess_t *s);
+
+
+/**
+ * Feed received characters to a session.
+ *
+ * The characters are edited, echoed and dispatched as by cli_task(); all the
+ * output goes to 'cli->put' while 'cli->sess' is 's'.
+ *
+ * @retval  0   if the user logged out, the rest of 'data' is ignored.
+ *              other values otherwise.
+ */
+uint8_t cli_input(cli_t *cli, cli_sess_t *s, const char *data, uint16_t len);
+
+
+/**
+ * The 'user' of the session being served, for cli_t callbacks.
+ */
+void *cli_user(void);
+
+
+/**
+ * The session being served, for cli_t callbacks.
+ */
+cli_sess_t *cli_sess(void);
+
+
+#if __ENABLE_LOGIN__
+/**
+ * Report the result of the cli_t.knock_async started for 's'.
+ * To be called from the thread serving the sessions of 'cli'.
+ *
+ * @param   ok      0 if the login failed, other values if succeeded.
+ */
+void cli_knock_done(cli_t *cli, cli_sess_t *s, uint8_t ok);
+#endif
+
+
+/**
+ * Turn 'size' bytes at 'mem', aligned to a pointer, into a pool of sessions.
+ */
+void cli_slab_init(cli_slab_t *slab, void *mem, size_t size);
+
+
+/**
+ * Take a session out of, or return it to, a slab. cli_sess_alloc() returns
+ * NULL if the slab is empty. Not thread-safe.
+ */
+cli_sess_t *cli_sess_alloc(cli_slab_t *slab);
+void cli_sess_free(cli_slab_t *slab, cli_sess_t *s);
+
+
+/**
+ * Execute one command line without terminal handling.
+ *
+ * The 'line' is dispatched against the command tree of 'cli' exactly as if
+ * it was typed in, but no prompt is shown, no echo is done and no login is
+ * required. The output is written into 'sink' instead of 'cli->put'.
+ *
+ * @param   cli     the CLI whose command tree is used.
+ * @param   line    the command line, need not be terminated by '\0'.
+ * @param   len     the length of 'line', at most MAX_LINE.
+ * @param   sink    where the output goes.
+ *
+ * @return  The number of bytes produced by the command, which could be larger
+ *          than 'sink->size' if the output has been truncated.
+ */
+size_t cli_exec(cli_t *cli, const char *line, size_t len, cli_sink_t *sink);
+
+
+/**
+ * Execute a batch of command lines, e.g. a configuration file.
+ *
+ * The 'buf' is split at '\n', a '\r' before it is dropped and empty lines
+ * are skipped. Each line is run by cli_exec() and the output of all of them
+ * is collected in 'sink'.
+ *
+ * @param   cli     the CLI whose command tree is used.
+ * @param   buf     the lines, need not be terminated by '\0' or '\n'.
+ * @param   len     the length of 'buf'.
+ * @param   sink    where the output goes.
+ *
+ * @return  The number of lines executed.
+ */
+size_t cli_exec_lines(cli_t *cli, const char *buf, size_t len, cli_sink_t *sink);
+
+
 /**
  * Print a text string.
  */
-void cli_puts(char *s);
+void cli_puts(const char *s);
 
 
 /**
@@ -149,6 +975,323 @@ void cli_puts(char *s);
 uint8_t cli_logout(uint8_t len, char *param);
 
 
+#if __ENABLE_MODULES__
+/**
+ * Attach a module to the command tree.
+ *
+ * Sessions dispatching at the same time are neither blocked nor disturbed;
+ * they see the new commands from their next command line on. 'mod' must stay
+ * valid until detached. Thread-safe.
+ */
+void cli_attach(cli_mod_t *mod);
+
+
+/**
+ * Detach a module from the command tree.
+ *
+ * Returns once no session can be using 'mod' or its handlers any more, so
+ * both may be released right after. It waits for command lines which are
+ * being dispatched, so it must not be called from a command handler.
+ * Thread-safe.
+ */
+void cli_detach(cli_mod_t *mod);
+#endif
+
+
+/**
+ * The function that reports the memory used by a CLI.
+ *
+ * Prints the size of every buffer in the arena, of cli_t, and the total.
+ */
+uint8_t cli_mem(uint8_t len, char *param);
+
+
+#if __ENABLE_WATCH__
+/**
+ * The function that implements 'watch [-n secs] <command>'.
+ *
+ * Runs the command every 'secs' seconds (2 if not given) until Ctrl-C or 'q'
+ * is pressed. Only the characters which changed since the previous run are
+ * sent to the terminal, using cursor addressing.
+ *
+ * @note    Requires cli_t.wait. The output of the command is truncated to
+ *          MAX_WATCH bytes.
+ */
+uint8_t cli_watch(uint8_t len, char *param);
+#endif
+
+
+#if __ENABLE_LOG_QUEUE__
+/**
+ * Initialize a log queue with 'n' slots, which must be a power of 2.
+ */
+void cli_logq_init(cli_logq_t *q, cli_log_slot_t *slot, uint32_t n);
+
+
+/**
+ * Queue a log message. Never blocks, safe to call from any thread.
+ *
+ * Messages longer than MAX_LOG_MSG - 1 are truncated. A new line is appended
+ * if the message does not end with one.
+ *
+ * @retval  0   if the queue was full and the message has been dropped.
+ *              other values if queued.
+ */
+uint8_t cli_log(cli_logq_t *q, const char *msg);
+#endif
+
+
+#if __ENABLE_RX_RING__
+/**
+ * Initialize a receive ring of 'n' bytes, which must be a power of 2 and
+ * not larger than 32768. 'sleep' and 'wake' are left to the caller.
+ */
+void cli_rx_init(cli_rx_t *rx, char *buf, uint16_t n);
+
+
+/**
+ * Put received bytes into the ring and wake up the CLI. Callable from an
+ * interrupt handler or another thread, but only by one producer at a time.
+ *
+ * @return  The number of bytes accepted. The rest is dropped if the ring is
+ *          full and counted in 'dropped'.
+ */
+uint16_t cli_rx_push(cli_rx_t *rx, const char *data, uint16_t len);
+
+
+/**
+ * The getch_fptr and wait_fptr consuming cli_t.rx.
+ */
+char cli_rx_getch(void);
+uint8_t cli_rx_wait(uint16_t ms);
+#endif
+
+
+#if __ENABLE_CACHE__
+/**
+ * Initialize an output cache of 'n' entries with the clock 'now'.
+ */
+void cli_cache_init(cli_cache_t *cache, cli_cache_ent_t *ent, uint32_t n,
+                    uint32_t (*now)(void));
+
+
+/**
+ * Drop the cached output of 'cmd', or of all commands if 'cmd' is NULL.
+ *
+ * To be called when the data shown by 'cmd' changes before its ttl ends, and
+ * for every command of a module before the module is detached.
+ */
+void cli_cache_invalidate(cli_cache_t *cache, const cmd_t *cmd);
+#endif
+
+
+#if __ENABLE_HISTORY__
+/**
+ * Attach a history region of 'size' bytes, with an index of 'n' entries.
+ *
+ * A region which does not start with a valid header is formatted. Entries
+ * take at least 8 bytes, so 'size' / 8 index entries always suffice.
+ */
+void cli_hist_init(cli_hist_t *h, void *mem, uint32_t size, uint32_t *idx,
+                   uint32_t n);
+
+
+/**
+ * Append a line to the history, as mini-CLI does for the lines of its
+ * sessions. Thread-safe.
+ *
+ * @retval  0   if the line was added.
+ *              otherwise the region is full and this is the number of lines
+ *              dropped so far, 1 for the first. mini-CLI tells the session
+ *              which drops the first.
+ */
+uint32_t cli_hist_add(cli_hist_t *h, const char *line);
+
+
+/**
+ * The number of entries and the i-th entry, oldest first. The entries of
+ * other threads and processes are seen after the next cli_hist_count().
+ */
+uint32_t cli_hist_count(cli_hist_t *h);
+const char *cli_hist_get(cli_hist_t *h, uint32_t i);
+
+
+/**
+ * Drop the entries but the newest 'keep' bytes of them, and entries which
+ * were never finished, e.g. by a process which crashed. The count of lines
+ * dropped starts again. Must not be called while anyone else uses the
+ * region, see hist_open().
+ */
+void cli_hist_rotate(cli_hist_t *h, uint32_t keep);
+#endif
+
+
+#if __ENABLE_MIRROR__
+/**
+ * Set up a mirror over a pool of 'n' segments, keeping the last 'depth'
+ * published in 'ring'. It admits n - depth - 1 readers. 'now', if not
+ * NULL, bounds how long a partial line is held back, see cli_mirror_t.
+ */
+void cli_mirror_init(cli_mirror_t *m, cli_mirror_seg_t *seg, uint16_t n,
+                     cli_mirror_seg_t **ring, uint16_t depth,
+                     uint32_t (*now)(void));
+
+
+/**
+ * Copy the output of session 's' to 'm' from now on, or stop with NULL.
+ * Whole lines are published when each cli_input() call returns.
+ */
+void cli_mirror_attach(cli_sess_t *s, cli_mirror_t *m);
+
+
+/**
+ * Start reading 'm' from the oldest segment kept. Returns 0 if 'm' has as
+ * many readers as it admits.
+ */
+uint8_t cli_mirror_open(cli_mirror_t *m, cli_mirror_reader_t *r);
+void cli_mirror_close(cli_mirror_reader_t *r);
+
+
+/**
+ * The next segment for the reader, NULL if none was published yet. It
+ * stays valid until the next call, when it is released. Any thread may
+ * read, but one reader must be used by one thread at a time.
+ */
+const char *cli_mirror_read(cli_mirror_reader_t *r, uint16_t *len);
+#endif
+
+
+#if __ENABLE_BACKOFF__
+/**
+ * Initialize a backoff table of 'n' entries, which must be a power of 2.
+ */
+void cli_backoff_init(cli_backoff_t *b, cli_backoff_ent_t *ent, uint32_t n,
+                      uint32_t (*now)(void), uint32_t (*peer)(void));
+
+
+/**
+ * How many ms 'peer' is refused for, 0 if it may log in. Servers may use it
+ * to hold back reading from or accepting the peer too.
+ */
+uint32_t cli_backoff_left(cli_backoff_t *b, uint32_t peer);
+
+
+/**
+ * Note a login of 'peer', failed if 'ok' is 0. Done by mini-CLI for the
+ * logins of its sessions.
+ */
+void cli_backoff_note(cli_backoff_t *b, uint32_t peer, uint8_t ok);
+#endif
+
+
+#if __ENABLE_JOBS__
+/**
+ * Initialize the background jobs with 'n' entries, the callbacks are left to
+ * the caller.
+ */
+void cli_jobs_init(cli_jobs_t *jobs, cli_job_t *job, uint32_t n);
+
+
+/**
+ * Run a queued job in the calling thread, see cli_jobs_t.
+ *
+ * A job runs like cli_exec() with a copy of the session which started it,
+ * taken when it was queued; its output is kept for 'fg'. cli_sess() in its
+ * handlers is the copy, so what they change of the session, e.g. 'logout',
+ * has no effect on it, and they see no jobs. cli_user() is the same as for
+ * the session. Jobs are not served from cli_t.cache, cannot 'watch' and
+ * cannot start jobs. The session must stay allocated until its jobs are
+ * done, see cli_jobs_end().
+ *
+ * @retval  0   if no job was queued.
+ *              other values if one has been run.
+ */
+uint8_t cli_job_run(cli_jobs_t *jobs);
+
+
+/**
+ * Whether the job calling it has been killed. Long running handlers should
+ * check it and return early; other handlers never see it.
+ */
+uint8_t cli_job_killed(void);
+
+
+/**
+ * Show the output of the jobs of 's' which are done and which 'fg' waits for
+ * in an event loop, see cli_jobs_t.done. To be called from the thread
+ * serving the sessions of 'cli', like cli_input().
+ */
+void cli_jobs_poll(cli_t *cli, cli_sess_t *s);
+
+
+/**
+ * Kill the jobs of 's', e.g. when its connection closed, like 'kill' does.
+ *
+ * @retval  the number of its jobs still running. 's' must not be freed
+ *          before they are done, cli_jobs_t.done tells when.
+ */
+uint32_t cli_jobs_end(cli_t *cli, cli_sess_t *s);
+
+
+/**
+ * The built-in commands to manage the jobs of a session:
+ *
+ * - jobs:          list them.
+ * - fg [id]:       wait for a job, the last one by default, show its output
+ *                  and forget it. Under cli_input() the prompt returns at
+ *                  once and the output follows when the job is done.
+ * - kill <id>:     forget a job. A queued job never runs, a running one is
+ *                  asked to stop, see cli_job_killed().
+ */
+uint8_t cli_jobs(uint8_t len, char *param);
+uint8_t cli_fg(uint8_t len, char *param);
+uint8_t cli_kill(uint8_t len, char *param);
+#endif
+
+
+#if __ENABLE_ALIAS__
+/**
+ * Initialize an alias table of 'n' entries, a power of 2.
+ */
+void cli_alias_init(cli_alias_t *alias, cli_alias_ent_t *ent, uint32_t n);
+
+
+/**
+ * Define, or redefine, the alias 'name' of cli->alias to run 'text', one or
+ * more command lines separated by ';'.
+ *
+ * @retval  0   if a command of 'text' is unknown, 'name' is too long, has a
+ *              space or is a command of the top level, 'text' has too many
+ *              lines or the table is half full.
+ */
+uint8_t cli_alias_define(cli_t *cli, const char *name, const char *text);
+void cli_alias_undef(cli_t *cli, const char *name);
+
+
+/**
+ * Resolve the aliases again after the command tree changed. Aliases whose
+ * commands are gone are undefined.
+ */
+void cli_alias_refresh(cli_t *cli);
+
+
+/**
+ * The built-in commands to manage the aliases of the cli_t:
+ *
+ * - alias:                 list them.
+ * - alias <name> <text>:   define one, e.g. "alias up show ports; show vlans".
+ * - unalias <name>:        undefine one.
+ *
+ * With jobs or shards another thread may be running an alias, so 'alias'
+ * only lists them and there is no 'unalias'.
+ */
+uint8_t cli_alias(uint8_t len, char *param);
+#if !__ENABLE_JOBS__ && !__ENABLE_SHARDS__
+uint8_t cli_unalias(uint8_t len, char *param);
+#endif
+#endif
+
+
 void cli_putc(char c);
 void cli_putd(int dec);
 void cli_putln(void);
@@ -0,0 +1,252 @@
+#ifndef __CLI_HPP__
+#define __CLI_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cli.h"
+
+/****************************************************************************
+ *
+ * A compile-time command table layer for C++17.
+ *
+ * A table is declared with cli::make_table() as a constexpr variable:
+ *
+ *     constexpr auto ls_opts = cli::make_table(
+ *         cli::cmd("-a", "all",       ls_all),
+ *         cli::cmd("-l", "long",      ls_long));
+ *
+ *     constexpr auto root = cli::make_table(
+ *         cli::cmd("ls", "list",      ls, ls_opts),
+ *         cli::cmd("lo", "logout",    cli_logout));
+ *
+ *     cli.cmd = root;
+ *
+ * Mistakes that mini-CLI could only notice at runtime, or never, such as two
+ * commands of the same name at one level, stop the compilation. The table
+ * holds plain cmd_t, in declaration order and terminated by { NULL }, so it
+ * is placed in read-only data and needs no initialization at runtime. The
+ * longest name of the table and an index sorted by name are computed too,
+ * for C++ code which looks commands up with find(). With __ENABLE_CMD_INDEX__
+ * they are also stored in the cmd_t, for mini-CLI's own lookup and help.
+ *
+ ****************************************************************************/
+
+namespace cli {
+
+namespace detail {
+
+constexpr std::size_t length(const char *s)
+{
+    std::size_t n = 0;
+
+    while (s[n])
+        n++;
+
+    return n;
+}
+
+constexpr int compare(const char *a, const char *b)
+{
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+constexpr bool hidden(const cmd_t &c)
+{
+    return c.help && c.help[0] == 0x01;
+}
+
+} // namespace detail
+
+
+/**
+ * A table of N commands, see make_table().
+ */
+template <std::size_t N>
+struct table {
+    cmd_t           cmd[N + 1];     ///< as seen by mini-CLI
+    uint16_t        order[N];       ///< indices of 'cmd' sorted by name
+    std::size_t     width;          ///< longest name shown by help
+
+    constexpr operator const cmd_t *() const
+    {
+        return cmd;
+    }
+
+    /**
+     * Binary search of a command of this table by name, NULL if none.
+     */
+    constexpr const cmd_t *find(const char *name) const
+    {
+        std::size_t lo = 0;
+        std::size_t hi = N;
+
+        while (lo < hi) {
+            std::size_t mid = (lo + hi) / 2;
+            int         d   = detail::compare(cmd[order[mid]].cmd, name);
+
+            if (d == 0)
+                return &cmd[order[mid]];
+            if (d < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        return nullptr;
+    }
+};
+
+
+/**
+ * One command, the arguments are the fields of cmd_t.
+ */
+constexpr cmd_t cmd(const char *name, const char *help,
+                    fp_t fptr = nullptr, const cmd_t *sub = nullptr)
+{
+    cmd_t c{};
+
+    c.cmd  = name;
+    c.help = help;
+    c.fptr = fptr;
+    c.sub  = sub;
+
+    return c;
+}
+
+
+#if __ENABLE_LAZY_CMD__
+/**
+ * One command with lazy sub commands.
+ */
+constexpr cmd_t cmd(const char *name, const char *help, fp_t fptr,
+                    const cmd_t *sub, lazy_fptr lazy)
+{
+    cmd_t c = cmd(name, help, fptr, sub);
+
+    c.lazy = lazy;
+
+    return c;
+}
+#endif
+
+
+#if __ENABLE_CACHE__
+/**
+ * A command whose output is reused for 'ttl' ms, see cli_cache_t.
+ */
+constexpr cmd_t cached(cmd_t c, uint16_t ttl)
+{
+    c.ttl = ttl;
+
+    return c;
+}
+#endif
+
+
+/**
+ * Build a table from cli::cmd() entries.
+ *
+ * A failing check throws, which is a compilation error when the table is
+ * constexpr. The compiler points at the 'throw' with the reason next to it.
+ */
+template <typename... C>
+constexpr table<sizeof...(C)> make_table(C... c)
+{
+    constexpr std::size_t   N = sizeof...(C);
+    table<N>                t{};
+    const cmd_t             in[] = { c... };
+
+    static_assert(N > 0, "empty command table");
+
+    for (std::size_t i = 0; i < N; i++) {
+        const char *name = in[i].cmd;
+
+        if (!name || !name[0])
+            throw "command without a name";
+
+        for (std::size_t j = 0; name[j]; j++)
+            if (name[j] == ' ')
+                throw "command name with a space can never match";
+
+        if (!detail::compare(name, "?"))
+            throw "'?' is reserved for help";
+
+        if (!in[i].fptr && !in[i].sub
+#if __ENABLE_LAZY_CMD__
+            && !in[i].lazy
+#endif
+            )
+            throw "command with neither handler nor sub commands";
+
+        t.cmd[i]   = in[i];
+        t.order[i] = i;
+#if __ENABLE_CMD_INDEX__
+        t.cmd[i].count = 0;
+        t.cmd[i].width = 0;
+#endif
+
+        if (!detail::hidden(in[i]) && detail::length(name) > t.width)
+            t.width = detail::length(name);
+    }
+
+    /* insertion sort, the tables are short */
+    for (std::size_t i = 1; i < N; i++) {
+        uint16_t    k = t.order[i];
+        std::size_t j = i;
+
+        while (j > 0 && detail::compare(t.cmd[t.order[j - 1]].cmd, t.cmd[k].cmd) > 0) {
+            t.order[j] = t.order[j - 1];
+            j--;
+        }
+        t.order[j] = k;
+    }
+
+    for (std::size_t i = 1; i < N; i++)
+        if (!detail::compare(t.cmd[t.order[i - 1]].cmd, t.cmd[t.order[i]].cmd))
+            throw "duplicate command name";
+
+#if __ENABLE_CMD_INDEX__
+    if (N > 255 || t.width > 255)
+        throw "too many commands or too long a name for cmd_t.order";
+
+    for (std::size_t i = 0; i < N; i++)
+        t.cmd[i].order = t.order[i];
+    t.cmd[0].count = N;
+    t.cmd[0].width = t.width;
+#endif
+
+    return t;
+}
+
+
+/**
+ * Follow a path of names through nested tables at compile time, e.g.
+ * cli::find(root, "ls", "-a"). Only static 'sub' tables are searched,
+ * linearly, as mini-CLI does.
+ */
+constexpr const cmd_t *find(const cmd_t *level, const char *name)
+{
+    for (; level && level->cmd; level++)
+        if (!detail::compare(level->cmd, name))
+            return level;
+
+    return nullptr;
+}
+
+template <typename... S>
+constexpr const cmd_t *find(const cmd_t *level, const char *name, S... rest)
+{
+    const cmd_t *p = find(level, name);
+
+    return p ? find(p->sub, rest...) : nullptr;
+}
+
+} // namespace cli
+
+#endif /* __CLI_HPP__ */
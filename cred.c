@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cli.h"
+#include "cred.h"
+
+/*
+ * A credential store for cli_t.knock.
+ *
+ * The accounts are loaded from a file with one account per line:
+ *
+ *     <id>:<rounds>:<salt>:<hash>
+ *
+ * where 'hash' is PBKDF2-HMAC-SHA256(password, salt, rounds) of CRED_HASH
+ * bytes, 'salt' is CRED_SALT bytes, both in hex, and 'rounds' is decimal.
+ * Empty lines and lines starting with '#' are skipped, comments may be of
+ * any length.
+ *
+ * The store is an open-addressed hash table keyed by id, at most half full,
+ * so a login costs 'rounds' HMACs and a probe or two. The rounds are what
+ * makes a leaked file expensive to attack, and also what a login costs the
+ * thread calling cred_knock(); a server which cannot spend that much in its
+ * event loop runs the check elsewhere, see cli_t.knock_async. cred_use() replaces the
+ * store while logins go on: cred_knock() never locks, and the old store is
+ * released once no cred_knock() can be using it.
+ */
+
+#define CRED_HASH       (32)
+
+/* more rounds than this refuse the line, a login would take seconds */
+#define CRED_ROUNDS_MAX (10000000)
+
+typedef struct {
+    char        id[MAX_ID + 1];     // "" if unused
+    uint32_t    rounds;
+    uint8_t     salt[CRED_SALT];
+    uint8_t     hash[CRED_HASH];
+} cred_ent_t;
+
+struct cred_s {
+    uint32_t    mask;               // number of entries - 1
+    uint32_t    count;
+    cred_ent_t  ent[];
+};
+
+typedef struct {
+    uint32_t    h[8];
+    uint8_t     buf[64];
+    uint64_t    len;
+} sha256_t;
+
+typedef struct {
+    sha256_t    in;                 // after the key ^ ipad block
+    sha256_t    out;                // after the key ^ opad block
+} hmac_t;
+
+
+static cred_t   *cred_cur;
+static uint32_t cred_epoch;
+static uint32_t cred_readers[2];
+static uint8_t  cred_writer;
+
+
+/*
+ * SHA-256, FIPS 180-4.
+ */
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(_x, _n)     (((_x) >> (_n)) | ((_x) << (32 - (_n))))
+
+static void sha256_block(sha256_t *c, const uint8_t *p)
+{
+    uint32_t    w[64];
+    uint32_t    v[8];
+    uint32_t    t1, t2;
+    int         i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+               (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    for (; i < 64; i++)
+        w[i] = w[i - 16] + w[i - 7] +
+               (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+    memcpy(v, c->h, sizeof(v));
+
+    for (i = 0; i < 64; i++) {
+        t1 = v[7] + (ROR(v[4], 6) ^ ROR(v[4], 11) ^ ROR(v[4], 25)) +
+             ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+        t2 = (ROR(v[0], 2) ^ ROR(v[0], 13) ^ ROR(v[0], 22)) +
+             ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(&v[1], &v[0], sizeof(v[0]) * 7);
+        v[4] += t1;
+        v[0]  = t1 + t2;
+    }
+
+    for (i = 0; i < 8; i++)
+        c->h[i] += v[i];
+}
+
+static void sha256_init(sha256_t *c)
+{
+    static const uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(c->h, h, sizeof(h));
+    c->len = 0;
+}
+
+static void sha256_update(sha256_t *c, const void *data, size_t n)
+{
+    const uint8_t   *p = data;
+    size_t          used;
+
+    while (n) {
+        used = c->len % 64;
+        if (!used && n >= 64) {
+            sha256_block(c, p);
+            used = 64;
+        } else {
+            used = 64 - used < n ? 64 - used : n;
+            memcpy(c->buf + c->len % 64, p, used);
+            if ((c->len + used) % 64 == 0)
+                sha256_block(c, c->buf);
+        }
+        c->len += used;
+        p      += used;
+        n      -= used;
+    }
+}
+
+static void sha256_final(sha256_t *c, uint8_t out[CRED_HASH])
+{
+    uint64_t    bits = c->len * 8;
+    size_t      used = c->len % 64;
+    int         i;
+
+    c->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(c->buf + used, 0, 64 - used);
+        sha256_block(c, c->buf);
+        used = 0;
+    }
+    memset(c->buf + used, 0, 56 - used);
+    for (i = 0; i < 8; i++)
+        c->buf[56 + i] = bits >> (56 - i * 8);
+    sha256_block(c, c->buf);
+
+    for (i = 0; i < CRED_HASH; i++)
+        out[i] = c->h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+
+/*
+ * HMAC-SHA256, RFC 2104. The padded key blocks are hashed once by
+ * hmac_init(), each hmac() then costs two blocks for a short message.
+ */
+static void hmac_init(hmac_t *m, const char *key, size_t n)
+{
+    uint8_t     pad[64] = { 0 };
+    int         i;
+
+    if (n > sizeof(pad)) {
+        sha256_init(&m->in);
+        sha256_update(&m->in, key, n);
+        sha256_final(&m->in, pad);
+    } else {
+        memcpy(pad, key, n);
+    }
+
+    for (i = 0; i < 64; i++)
+        pad[i] ^= 0x36;
+    sha256_init(&m->in);
+    sha256_update(&m->in, pad, sizeof(pad));
+
+    for (i = 0; i < 64; i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    sha256_init(&m->out);
+    sha256_update(&m->out, pad, sizeof(pad));
+}
+
+static void hmac(const hmac_t *m, const uint8_t *msg, size_t n,
+                 uint8_t out[CRED_HASH])
+{
+    sha256_t    c = m->in;
+
+    sha256_update(&c, msg, n);
+    sha256_final(&c, out);
+
+    c = m->out;
+    sha256_update(&c, out, CRED_HASH);
+    sha256_final(&c, out);
+}
+
+
+/* PBKDF2-HMAC-SHA256, RFC 8018, of one block as CRED_HASH is its size */
+static void cred_digest(const uint8_t *salt, const char *pass, uint32_t rounds,
+                        uint8_t out[CRED_HASH])
+{
+    hmac_t      m;
+    uint8_t     msg[CRED_SALT + 4] = { 0 };
+    uint8_t     u[CRED_HASH];
+    int         i;
+
+    hmac_init(&m, pass, strlen(pass));
+
+    /* U1 = HMAC(password, salt | INT(1)) */
+    memcpy(msg, salt, CRED_SALT);
+    msg[CRED_SALT + 3] = 1;
+    hmac(&m, msg, sizeof(msg), u);
+    memcpy(out, u, CRED_HASH);
+
+    while (--rounds) {
+        hmac(&m, u, CRED_HASH, u);
+        for (i = 0; i < CRED_HASH; i++)
+            out[i] ^= u[i];
+    }
+}
+
+
+/* FNV-1a */
+static uint32_t cred_slot(const char *id)
+{
+    uint32_t    h = 2166136261u;
+
+    while (*id)
+        h = (h ^ (uint8_t)*id++) * 16777619u;
+
+    return h;
+}
+
+static cred_ent_t *cred_find(cred_t *c, const char *id)
+{
+    uint32_t    i = cred_slot(id) & c->mask;
+
+    while (c->ent[i].id[0]) {
+        if (!strcmp(c->ent[i].id, id))
+            return &c->ent[i];
+        i = (i + 1) & c->mask;
+    }
+
+    return NULL;
+}
+
+static int cred_hex(const char *s, uint8_t *out, int n)
+{
+    int         i;
+    int         d;
+    char        x;
+
+    for (i = 0; i < n * 2; i++) {
+        x = s[i];
+        if (x >= '0' && x <= '9')
+            d = x - '0';
+        else if (x >= 'a' && x <= 'f')
+            d = x - 'a' + 10;
+        else if (x >= 'A' && x <= 'F')
+            d = x - 'A' + 10;
+        else
+            return 0;
+        out[i / 2] = (out[i / 2] << 4) | d;
+    }
+
+    return 1;
+}
+
+static int cred_parse(cred_t *c, char *line)
+{
+    char        *rounds = strchr(line, ':');
+    char        *salt   = rounds ? strchr(rounds + 1, ':') : NULL;
+    char        *hash   = salt ? strchr(salt + 1, ':') : NULL;
+    char        *end;
+    cred_ent_t  *e;
+    uint32_t    n;
+    uint32_t    i;
+
+    if (!hash || rounds - line > MAX_ID || rounds == line ||
+        hash - salt - 1 != CRED_SALT * 2 || strlen(hash + 1) != CRED_HASH * 2)
+        return 0;
+    *rounds = '\0';
+
+    n = strtoul(rounds + 1, &end, 10);
+    if (end != salt || rounds[1] < '1' || rounds[1] > '9' ||
+        salt - rounds > 9 || n > CRED_ROUNDS_MAX)
+        return 0;
+
+    if (cred_find(c, line))
+        return 0;
+
+    for (i = cred_slot(line) & c->mask; c->ent[i].id[0]; i = (i + 1) & c->mask)
+        ;
+    e = &c->ent[i];
+
+    if (!cred_hex(salt + 1, e->salt, CRED_SALT) ||
+        !cred_hex(hash + 1, e->hash, CRED_HASH))
+        return 0;
+
+    strcpy(e->id, line);
+    e->rounds = n;
+    c->count++;
+
+    return 1;
+}
+
+
+cred_t *cred_load(const char *path)
+{
+    FILE        *f = fopen(path, "r");
+    char        line[MAX_ID + CRED_SALT * 2 + CRED_HASH * 2 + 16];
+    cred_t      *c = NULL;
+    uint32_t    n  = 0;
+    uint32_t    size;
+    size_t      len;
+    int         ok = 1;
+    int         ch;
+
+    if (!f)
+        return NULL;
+
+    /* count, then size the table to be at most half full */
+    while (fgets(line, sizeof(line), f))
+        n++;
+
+    for (size = 2; size < n * 2; size *= 2)
+        ;
+
+    c = calloc(1, sizeof(*c) + size * sizeof(cred_ent_t));
+    if (!c) {
+        fclose(f);
+        return NULL;
+    }
+    c->mask = size - 1;
+
+    rewind(f);
+    while (ok && fgets(line, sizeof(line), f)) {
+        len = strlen(line);
+        if (len && line[len - 1] == '\n')
+            line[--len] = '\0';
+        else if (!feof(f) && line[0] == '#')
+            /* a comment may be longer than any account, skip the rest */
+            while ((ch = fgetc(f)) != EOF && ch != '\n')
+                ;
+        else if (!feof(f))
+            ok = 0;
+        if (len && line[len - 1] == '\r')
+            line[--len] = '\0';
+
+        if (ok && len && line[0] != '#')
+            ok = cred_parse(c, line);
+    }
+    fclose(f);
+
+    if (!ok) {
+        free(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+
+uint32_t cred_count(const cred_t *c)
+{
+    return c->count;
+}
+
+
+void cred_use(cred_t *c)
+{
+    cred_t      *old;
+    uint32_t    idx;
+    int         n;
+
+    while (__atomic_test_and_set(&cred_writer, __ATOMIC_ACQUIRE))
+        ;
+
+    old = __atomic_exchange_n(&cred_cur, c, __ATOMIC_SEQ_CST);
+
+    /* the grace period, as for cli_detach() */
+    for (n = 0; n < 2; n++) {
+        idx = __atomic_fetch_add(&cred_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&cred_readers[idx], __ATOMIC_ACQUIRE))
+            ;
+    }
+
+    __atomic_clear(&cred_writer, __ATOMIC_RELEASE);
+
+    free(old);
+}
+
+
+uint8_t cred_knock(char *id, char *pass)
+{
+    static const cred_ent_t nobody = { "", CRED_ROUNDS, { 0 }, { 0 } };
+    const cred_ent_t        *e;
+    cred_t                  *c;
+    uint8_t                 hash[CRED_HASH];
+    uint8_t                 diff = 0;
+    uint32_t                idx;
+    int                     i;
+
+    idx = __atomic_load_n(&cred_epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&cred_readers[idx], 1, __ATOMIC_SEQ_CST);
+
+    c = __atomic_load_n(&cred_cur, __ATOMIC_SEQ_CST);
+    e = c ? cred_find(c, id) : NULL;
+
+    /* an unknown id costs as much as a wrong password, for new accounts */
+    if (!e) {
+        e    = &nobody;
+        diff = 1;
+    }
+
+    cred_digest(e->salt, pass, e->rounds, hash);
+    for (i = 0; i < CRED_HASH; i++)
+        diff |= hash[i] ^ e->hash[i];
+
+    __atomic_fetch_sub(&cred_readers[idx], 1, __ATOMIC_RELEASE);
+
+    return !diff;
+}
+
+
+int cred_line(char *buf, size_t size, const char *id, const char *pass,
+              const uint8_t salt[CRED_SALT], uint32_t rounds)
+{
+    uint8_t     hash[CRED_HASH];
+    int         n;
+    int         i;
+
+    /* what cred_load() refuses, and 0 would run the digest for ever */
+    if (!rounds || rounds > CRED_ROUNDS_MAX)
+        return -1;
+
+    cred_digest(salt, pass, rounds, hash);
+
+    n = snprintf(buf, size, "%s:%u:", id, (unsigned)rounds);
+    for (i = 0; i < CRED_SALT; i++)
+        n += snprintf(buf + n, size > n ? size - n : 0, "%02x", salt[i]);
+    n += snprintf(buf + n, size > n ? size - n : 0, ":");
+    for (i = 0; i < CRED_HASH; i++)
+        n += snprintf(buf + n, size > n ? size - n : 0, "%02x", hash[i]);
+    n += snprintf(buf + n, size > n ? size - n : 0, "\n");
+
+    return n;
+}
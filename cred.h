@@ -0,0 +1,30 @@
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* bytes of salt per account */
+#define CRED_SALT       (16)
+
+#ifndef CRED_ROUNDS
+/* PBKDF2 rounds for new accounts, and what an unknown id costs */
+#define CRED_ROUNDS     (10000)
+#endif
+
+typedef struct cred_s cred_t;
+
+/* load a store, NULL if the file can not be read or has a bad line */
+cred_t *cred_load(const char *path);
+uint32_t cred_count(const cred_t *c);
+
+/* make 'c' the store of cred_knock() and release the previous one */
+void cred_use(cred_t *c);
+
+/* a knock_fptr checking the store in use */
+uint8_t cred_knock(char *id, char *pass);
+
+/*
+ * format the line of an account, returns its length like snprintf(), or -1
+ * if a store would refuse 'rounds'
+ */
+int cred_line(char *buf, size_t size, const char *id, const char *pass,
+              const uint8_t salt[CRED_SALT], uint32_t rounds);
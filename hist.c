@@ -0,0 +1,84 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cli.h"
+#include "hist.h"
+
+/*
+ * A history file shared by the processes running mini-CLI.
+ *
+ * Every process maps the file with MAP_SHARED and holds a shared flock() on
+ * it while it is open. The process which gets an exclusive lock first is
+ * the only user, so it is safe for it to rotate the file.
+ */
+
+typedef struct {
+    cli_hist_t  h;
+    int         fd;
+} hist_file_t;
+
+
+cli_hist_t *hist_open(const char *path, uint32_t size)
+{
+    hist_file_t *f;
+    struct stat st;
+    void        *mem;
+    uint32_t    *idx;
+    int         alone;
+
+    f   = malloc(sizeof(*f));
+    idx = malloc(size / 8 * sizeof(uint32_t));
+    if (!f || !idx)
+        goto err;
+
+    f->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (f->fd < 0)
+        goto err;
+
+    /*
+     * Only a process alone with the file may format or rotate it, the others
+     * wait for it to be done. The file is never shrunk under another process.
+     */
+    alone = !flock(f->fd, LOCK_EX | LOCK_NB);
+    if (!alone && flock(f->fd, LOCK_SH))
+        goto err_fd;
+
+    if (fstat(f->fd, &st) || (st.st_size < size && ftruncate(f->fd, size)))
+        goto err_fd;
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+    if (mem == MAP_FAILED)
+        goto err_fd;
+
+    cli_hist_init(&f->h, mem, size, idx, size / 8);
+
+    if (alone) {
+        if (f->h.hdr->tail > size / 4 * 3)
+            cli_hist_rotate(&f->h, size / 2);
+        flock(f->fd, LOCK_SH);
+    }
+
+    return &f->h;
+
+err_fd:
+    close(f->fd);
+err:
+    free(idx);
+    free(f);
+    return NULL;
+}
+
+
+void hist_close(cli_hist_t *h)
+{
+    hist_file_t *f = (hist_file_t *)h;
+
+    munmap(h->hdr, h->size);
+    free(h->idx);
+    close(f->fd);
+    free(f);
+}
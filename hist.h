@@ -0,0 +1,11 @@
+#include <stdint.h>
+
+#include "cli.h"
+
+/*
+ * open, or create, a history file of 'size' bytes and map it, NULL on error.
+ * The first process to open it compacts it when it is more than 3/4 full.
+ * All the processes sharing a file must open it with the same size.
+ */
+cli_hist_t *hist_open(const char *path, uint32_t size);
+void hist_close(cli_hist_t *h);
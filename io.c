@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <termios.h>
+#include <sys/select.h>
 
 #include "io.h"
 
@@ -31,3 +32,25 @@ void putch(char c)
     fflush(stdout);
 }
 
+
+uint8_t waitch(uint16_t ms)
+{
+    struct termios old = {0};
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+    fd_set fds;
+    int ret;
+    if (tcgetattr(0, &old) < 0)
+        perror("tcsetattr()");
+    old.c_lflag &= ~ICANON;
+    old.c_lflag &= ~ECHO;
+    if (tcsetattr(0, TCSANOW, &old) < 0)
+        perror("tcsetattr ICANON");
+    FD_ZERO(&fds);
+    FD_SET(0, &fds);
+    ret = select(1, &fds, NULL, NULL, &tv);
+    old.c_lflag |= ICANON;
+    old.c_lflag |= ECHO;
+    if (tcsetattr(0, TCSADRAIN, &old) < 0)
+        perror ("tcsetattr ~ICANON");
+    return (ret > 0);
+}
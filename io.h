@@ -3,4 +3,5 @@
 
 char getch(void);
 void putch(char c);
+uint8_t waitch(uint16_t ms);
 
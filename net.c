@@ -0,0 +1,694 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "cli.h"
+#include "net.h"
+
+/*
+ * A TCP front end for mini-CLI, sharded by core.
+ *
+ * Each shard is a thread pinned to a core, with a listening socket of its
+ * own bound with SO_REUSEPORT, so the kernel spreads the connections over
+ * the shards and a connection is served by the shard which accepted it
+ * until it closes. A shard has its own cli_t, arena, session slab,
+ * connections, counters and output cache; the shards share nothing but the
+ * command tree, which is only read.
+ *
+ * Whatever comes from other threads, such as the result of a login checked
+ * by cli_t.knock_async or the end of a background job, goes through a pipe
+ * of the shard and is handled by its thread like the input of a connection.
+ * A connection closing while such a result is due, or while a job of its
+ * session runs, leaves its session parked, so that the slot is not handed
+ * to the next connection until nothing refers to it any more.
+ */
+
+#define NET_EVENTS      (64)
+#define NET_POLL_MS     (100)
+#define NET_LISTEN      (0xFFFFFFFF)
+#define NET_PIPE        (0xFFFFFFFE)
+
+/* what comes through the pipe of a shard */
+#define NET_MSG         (__ENABLE_LOGIN__ || __ENABLE_JOBS__)
+#define NET_MSG_KNOCK   (0)
+#define NET_MSG_JOB     (1)
+
+typedef struct {
+    uint32_t    peer;           // IPv4 address, what cli_user() points at
+    uint32_t    gen;            // of the connections the entry has served
+    int         fd;
+    cli_sess_t  *sess;
+    uint16_t    out_len;
+    uint8_t     want_out;       // EPOLLOUT is set
+    char        out[NET_OUT];
+} net_conn_t;
+
+/* a session of the shard, by its index in 'sess_mem' */
+typedef struct {
+    uint32_t    gen;            // of the connection whose knock is due
+    uint16_t    conn;           // index in 'conn'
+    uint8_t     knocking;       // the result of a knock_async is due
+    uint8_t     parked;         // its connection closed, see net_release()
+} net_slot_t;
+
+typedef struct {
+    net_stats_t stats;
+    cli_t       cli;
+    cli_slab_t  slab;
+    net_t       *net;
+    pthread_t   tid;
+    int         id;
+    int         lfd;
+    int         efd;
+    net_conn_t  *conn;
+    uint16_t    *free;          // indices of the unused 'conn'
+    uint16_t    n_free;
+    void        *sess_mem;
+    net_slot_t  *slot;
+    uint32_t    *arena;
+#if NET_MSG
+    int         pfd[2];         // net_msg_t from other threads
+#endif
+#if __ENABLE_LOGIN__
+    knock_async_fptr knock_async;   // of the template, see net_knock_async()
+#endif
+#if __ENABLE_CACHE__
+    cli_cache_t     cache;      // in place of the template's, not thread-safe
+    cli_cache_ent_t *cache_ent;
+#endif
+} __attribute__((aligned(64))) net_shard_t;
+
+#if NET_MSG
+/* small enough for a pipe to pass it whole, see PIPE_BUF */
+typedef struct {
+    uint32_t    gen;            // of the connection which knocked
+    uint16_t    slot;
+    uint8_t     type;           // NET_MSG_KNOCK or NET_MSG_JOB
+    uint8_t     ok;
+} net_msg_t;
+#endif
+
+struct net_s {
+    const cli_t *tmpl;
+    void        (*setup)(cli_t *cli, int shard);
+    uint16_t    port;
+    uint16_t    max_sess;
+    uint8_t     stop;
+    int         n;
+    net_shard_t shard[];
+};
+
+
+/*
+ * Add to a counter of the shard. Only the shard writes its counters, so a
+ * plain add published atomically is enough for net_stats().
+ */
+#define NET_COUNT(_sh, _field, _n) \
+    __atomic_store_n(&(_sh)->stats._field, (_sh)->stats._field + (_n), \
+                     __ATOMIC_RELAXED)
+
+
+/* the index of session '_s' in the slab of shard '_sh' */
+#define NET_SLOT(_sh, _s) \
+    (((char *)(_s) - (char *)(_sh)->sess_mem) / CLI_SESS_BYTES)
+
+#define NET_SESS(_sh, _i) \
+    ((cli_sess_t *)((char *)(_sh)->sess_mem + (_i) * CLI_SESS_BYTES))
+
+
+/* the shard and connection being served by this thread */
+static __thread net_shard_t *net_sh;
+static __thread net_conn_t  *net_cur;
+
+
+static void net_flush(net_conn_t *c)
+{
+    ssize_t     n = 0;
+
+    while (c->out_len) {
+        n = write(c->fd, c->out, c->out_len);
+        if (n <= 0)
+            break;
+        NET_COUNT(net_sh, bytes_out, n);
+        c->out_len -= n;
+        memmove(c->out, c->out + n, c->out_len);
+    }
+}
+
+
+/* the putch_fptr of the shards */
+static void net_put(char c)
+{
+    net_conn_t  *conn = net_cur;
+
+    if (conn->out_len == NET_OUT)
+        net_flush(conn);
+
+    if (conn->out_len < NET_OUT)
+        conn->out[conn->out_len++] = c;
+    else
+        NET_COUNT(net_sh, dropped, 1);
+}
+
+
+static void net_watch(net_shard_t *sh, net_conn_t *c)
+{
+    struct epoll_event  ev;
+    uint8_t             want = c->out_len != 0;
+
+    if (want == c->want_out)
+        return;
+
+    ev.events   = want ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.u32 = c - sh->conn;
+    epoll_ctl(sh->efd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_out = want;
+}
+
+
+/* free a parked session once nothing is due for it */
+static void net_release(net_shard_t *sh, cli_sess_t *s)
+{
+    net_slot_t  *slot = &sh->slot[NET_SLOT(sh, s)];
+
+    if (!slot->parked || slot->knocking)
+        return;
+#if __ENABLE_JOBS__
+    /* the end of each job still running is reported, see net_job_done() */
+    if (cli_jobs_end(&sh->cli, s))
+        return;
+#endif
+
+    /* e.g. the password of a login the peer did not wait for */
+    memset(s->line, 0, CLI_LINE_BYTES);
+    slot->parked = 0;
+    cli_sess_free(&sh->slab, s);
+}
+
+
+static void net_close(net_shard_t *sh, net_conn_t *c)
+{
+    close(c->fd);
+    c->fd                   = -1;
+    sh->free[sh->n_free++]  = c - sh->conn;
+    NET_COUNT(sh, closed, 1);
+
+    sh->slot[NET_SLOT(sh, c->sess)].parked = 1;
+    net_release(sh, c->sess);
+}
+
+
+static void net_accept(net_shard_t *sh)
+{
+    struct sockaddr_in  addr;
+    socklen_t           len = sizeof(addr);
+    struct epoll_event  ev;
+    net_conn_t          *c;
+    cli_sess_t          *s;
+    int                 one = 1;
+    int                 fd;
+
+    while ((fd = accept4(sh->lfd, (struct sockaddr *)&addr, &len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        s = sh->n_free ? cli_sess_alloc(&sh->slab) : NULL;
+        if (!s) {
+            close(fd);
+            NET_COUNT(sh, refused, 1);
+            continue;
+        }
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        c           = &sh->conn[sh->free[--sh->n_free]];
+        c->fd       = fd;
+        c->sess     = s;
+        c->gen++;
+        sh->slot[NET_SLOT(sh, s)].conn = c - sh->conn;
+        c->peer     = ntohl(addr.sin_addr.s_addr);
+        c->out_len  = 0;
+        c->want_out = 0;
+
+        ev.events   = EPOLLIN;
+        ev.data.u32 = c - sh->conn;
+        epoll_ctl(sh->efd, EPOLL_CTL_ADD, fd, &ev);
+        NET_COUNT(sh, accepted, 1);
+
+        net_cur = c;
+        cli_sess_start(&sh->cli, s);
+        s->user = &c->peer;
+        net_flush(c);
+        net_watch(sh, c);
+
+        len = sizeof(addr);
+    }
+}
+
+
+static void net_read(net_shard_t *sh, net_conn_t *c)
+{
+    char        buf[1024];
+    const char  *p;
+    ssize_t     n;
+    uint32_t    lines = 0;
+
+    n = read(c->fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        net_close(sh, c);
+        return;
+    }
+
+    for (p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++)
+        lines++;
+    NET_COUNT(sh, bytes_in, n);
+    NET_COUNT(sh, lines, lines);
+
+    net_cur = c;
+    if (!cli_input(&sh->cli, c->sess, buf, n)) {
+        net_flush(c);
+        net_close(sh, c);
+        return;
+    }
+
+    net_flush(c);
+    net_watch(sh, c);
+}
+
+
+#if __ENABLE_LOGIN__
+/* the cli_t.knock_async of the shards, noting whose result is due */
+static void net_knock_async(char *id, char *pass)
+{
+    net_slot_t  *slot = &net_sh->slot[NET_SLOT(net_sh, net_cur->sess)];
+
+    __atomic_store_n(&slot->gen, net_cur->gen, __ATOMIC_RELAXED);
+    slot->knocking = 1;
+    net_sh->knock_async(id, pass);
+}
+#endif
+
+
+#if NET_MSG
+/* handle what came through the pipe */
+static void net_drain(net_shard_t *sh)
+{
+    net_msg_t   m;
+    net_slot_t  *slot;
+    cli_sess_t  *s;
+    net_conn_t  *c;
+
+    while (read(sh->pfd[0], &m, sizeof(m)) == sizeof(m)) {
+        slot = &sh->slot[m.slot];
+        s    = NET_SESS(sh, m.slot);
+        c    = &sh->conn[slot->conn];
+
+        /* the connection closed meanwhile, its session waited for this */
+        if (slot->parked) {
+            if (m.type == NET_MSG_KNOCK)
+                slot->knocking = 0;
+            net_release(sh, s);
+            continue;
+        }
+
+        net_cur = c;
+#if __ENABLE_LOGIN__
+        if (m.type == NET_MSG_KNOCK) {
+            if (!slot->knocking)
+                continue;
+            slot->knocking = 0;
+            if (c->gen != m.gen)
+                continue;
+            cli_knock_done(&sh->cli, s, m.ok);
+        }
+#endif
+#if __ENABLE_JOBS__
+        /* a job of a session gone from the slot shows nowhere */
+        if (m.type == NET_MSG_JOB) {
+            if (c->fd < 0 || c->sess != s)
+                continue;
+            cli_jobs_poll(&sh->cli, s);
+        }
+#endif
+        net_flush(c);
+        net_watch(sh, c);
+    }
+}
+
+
+/* the shard whose slab holds 's', NULL if none */
+static net_shard_t *net_shard_of(net_t *net, cli_sess_t *s)
+{
+    size_t      sz = net->max_sess * CLI_SESS_BYTES;
+    int         i;
+
+    for (i = 0; i < net->n; i++)
+        if ((char *)s >= (char *)net->shard[i].sess_mem &&
+            (char *)s < (char *)net->shard[i].sess_mem + sz)
+            return &net->shard[i];
+
+    return NULL;
+}
+
+
+/* pass 'm' to the shard, whole as it is below PIPE_BUF */
+static void net_send(net_shard_t *sh, const net_msg_t *m)
+{
+    while (write(sh->pfd[1], m, sizeof(*m)) < 0 && errno == EINTR)
+        ;
+}
+#endif
+
+
+#if __ENABLE_JOBS__
+/* the cli_jobs_t.done of the shards, from the thread which ran the job */
+static void net_job_done(cli_jobs_t *jobs, cli_sess_t *s)
+{
+    net_shard_t *sh = net_shard_of(jobs->user, s);
+    net_msg_t   m   = { .type = NET_MSG_JOB };
+
+    if (!sh)
+        return;
+
+    m.slot = NET_SLOT(sh, s);
+    net_send(sh, &m);
+}
+#endif
+
+
+/* pin the calling thread to the id-th core it may run on */
+static void net_pin(int id)
+{
+    cpu_set_t   set;
+    int         cpu;
+    int         n = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set))
+        return;
+
+    id %= CPU_COUNT(&set);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && n++ == id) {
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+
+static void *net_loop(void *arg)
+{
+    net_shard_t         *sh  = arg;
+    net_t               *net = sh->net;
+    struct epoll_event  ev[NET_EVENTS];
+    net_conn_t          *c;
+    int                 n;
+    int                 i;
+
+    net_sh = sh;
+    net_pin(sh->id);
+
+    sh->cli       = *net->tmpl;
+    sh->cli.put   = net_put;
+    sh->cli.arena = sh->arena;
+    sh->cli.sess  = NULL;
+#if __ENABLE_CACHE__
+    if (sh->cache_ent) {
+        cli_cache_init(&sh->cache, sh->cache_ent, net->tmpl->cache->n,
+                       net->tmpl->cache->now);
+        sh->cli.cache = &sh->cache;
+    }
+#endif
+    if (net->setup)
+        net->setup(&sh->cli, sh->id);
+#if __ENABLE_LOGIN__
+    sh->knock_async = sh->cli.knock_async;
+    if (sh->knock_async)
+        sh->cli.knock_async = net_knock_async;
+#endif
+    cli_init(&sh->cli);
+
+    while (!__atomic_load_n(&net->stop, __ATOMIC_ACQUIRE)) {
+        n = epoll_wait(sh->efd, ev, NET_EVENTS, NET_POLL_MS);
+
+        for (i = 0; i < n; i++) {
+            if (ev[i].data.u32 == NET_LISTEN) {
+                net_accept(sh);
+                continue;
+            }
+#if NET_MSG
+            if (ev[i].data.u32 == NET_PIPE) {
+                net_drain(sh);
+                continue;
+            }
+#endif
+
+            c = &sh->conn[ev[i].data.u32];
+            if (c->fd < 0)
+                continue;
+            if (ev[i].events & EPOLLOUT) {
+                net_flush(c);
+                net_watch(sh, c);
+            }
+            if (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                net_read(sh, c);
+        }
+    }
+
+    for (i = 0; i < net->max_sess; i++)
+        if (sh->conn[i].fd >= 0)
+            net_close(sh, &sh->conn[i]);
+
+    return NULL;
+}
+
+
+static int net_listen(uint16_t port)
+{
+    struct sockaddr_in  addr = { 0 };
+    int                 one  = 1;
+    int                 fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+static void net_free(net_t *net)
+{
+    net_shard_t *sh;
+    int         i;
+
+    for (i = 0; i < net->n; i++) {
+        sh = &net->shard[i];
+        if (sh->lfd >= 0)
+            close(sh->lfd);
+        if (sh->efd >= 0)
+            close(sh->efd);
+#if NET_MSG
+        if (sh->pfd[0] >= 0)
+            close(sh->pfd[0]);
+        if (sh->pfd[1] >= 0)
+            close(sh->pfd[1]);
+#endif
+        free(sh->conn);
+        free(sh->free);
+        free(sh->sess_mem);
+        free(sh->slot);
+        free(sh->arena);
+#if __ENABLE_CACHE__
+        free(sh->cache_ent);
+#endif
+    }
+    free(net);
+}
+
+
+net_t *net_start(const cli_t *tmpl, uint16_t port, int n, uint16_t max_sess,
+                 void (*setup)(cli_t *cli, int shard))
+{
+    struct sockaddr_in  addr;
+    socklen_t           len = sizeof(addr);
+    struct epoll_event  ev  = { .events = EPOLLIN, .data.u32 = NET_LISTEN };
+#if NET_MSG
+    struct epoll_event  pev = { .events = EPOLLIN, .data.u32 = NET_PIPE };
+#endif
+    net_shard_t         *sh;
+    net_t               *net;
+    int                 i;
+    int                 j;
+
+#if __ENABLE_LOG_QUEUE__
+    /* a queue has one reader, 'setup' may give each shard one */
+    if (tmpl->logq)
+        return NULL;
+#endif
+#if __ENABLE_BACKOFF__
+    /* not thread-safe, 'setup' may give each shard one */
+    if (tmpl->backoff)
+        return NULL;
+#endif
+
+    if (posix_memalign((void **)&net, 64, sizeof(*net) + n * sizeof(*sh)))
+        return NULL;
+    memset(net, 0, sizeof(*net) + n * sizeof(*sh));
+    net->tmpl     = tmpl;
+    net->setup    = setup;
+    net->port     = port;
+    net->max_sess = max_sess;
+
+    for (i = 0; i < n; i++) {
+        sh       = &net->shard[i];
+        sh->net  = net;
+        sh->id   = i;
+        sh->efd  = -1;
+        sh->lfd  = net_listen(net->port);
+#if NET_MSG
+        sh->pfd[0] = -1;
+        sh->pfd[1] = -1;
+#endif
+        net->n++;
+
+        /* the shards after the first take the port it was given */
+        if (sh->lfd >= 0 && !net->port &&
+            !getsockname(sh->lfd, (struct sockaddr *)&addr, &len))
+            net->port = ntohs(addr.sin_port);
+
+        sh->efd      = epoll_create1(EPOLL_CLOEXEC);
+        sh->conn     = malloc(max_sess * sizeof(net_conn_t));
+        sh->free     = malloc(max_sess * sizeof(uint16_t));
+        sh->sess_mem = malloc(max_sess * CLI_SESS_BYTES);
+        sh->slot     = calloc(max_sess, sizeof(net_slot_t));
+        sh->arena    = malloc(CLI_ARENA_SIZE);
+#if __ENABLE_CACHE__
+        if (tmpl->cache && !(sh->cache_ent = malloc(tmpl->cache->n *
+                                                   sizeof(cli_cache_ent_t)))) {
+            net_free(net);
+            return NULL;
+        }
+#endif
+#if NET_MSG
+        /* only the shard's end does not block */
+        if (pipe2(sh->pfd, O_CLOEXEC) ||
+            fcntl(sh->pfd[0], F_SETFL, O_NONBLOCK) ||
+            epoll_ctl(sh->efd, EPOLL_CTL_ADD, sh->pfd[0], &pev)) {
+            net_free(net);
+            return NULL;
+        }
+#endif
+        if (sh->lfd < 0 || sh->efd < 0 || !sh->conn || !sh->free ||
+            !sh->sess_mem || !sh->slot || !sh->arena ||
+            epoll_ctl(sh->efd, EPOLL_CTL_ADD, sh->lfd, &ev)) {
+            net_free(net);
+            return NULL;
+        }
+
+        cli_slab_init(&sh->slab, sh->sess_mem, max_sess * CLI_SESS_BYTES);
+        for (j = 0; j < max_sess; j++) {
+            sh->conn[j].fd  = -1;
+            sh->conn[j].gen = 0;
+            sh->free[j]     = max_sess - 1 - j;
+        }
+        sh->n_free = max_sess;
+    }
+
+#if __ENABLE_JOBS__
+    if (tmpl->jobs) {
+        tmpl->jobs->user = net;
+        tmpl->jobs->done = net_job_done;
+    }
+#endif
+
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&net->shard[i].tid, NULL, net_loop,
+                           &net->shard[i])) {
+            __atomic_store_n(&net->stop, 1, __ATOMIC_RELEASE);
+            while (i--)
+                pthread_join(net->shard[i].tid, NULL);
+            net_free(net);
+            return NULL;
+        }
+    }
+
+    return net;
+}
+
+
+uint16_t net_port(const net_t *net)
+{
+    return net->port;
+}
+
+
+void net_stats(const net_t *net, int shard, net_stats_t *st)
+{
+    const net_stats_t   *src = &net->shard[shard].stats;
+
+    st->accepted  = __atomic_load_n(&src->accepted,  __ATOMIC_RELAXED);
+    st->refused   = __atomic_load_n(&src->refused,   __ATOMIC_RELAXED);
+    st->closed    = __atomic_load_n(&src->closed,    __ATOMIC_RELAXED);
+    st->lines     = __atomic_load_n(&src->lines,     __ATOMIC_RELAXED);
+    st->bytes_in  = __atomic_load_n(&src->bytes_in,  __ATOMIC_RELAXED);
+    st->bytes_out = __atomic_load_n(&src->bytes_out, __ATOMIC_RELAXED);
+    st->dropped   = __atomic_load_n(&src->dropped,   __ATOMIC_RELAXED);
+}
+
+
+#if __ENABLE_LOGIN__
+void net_knock_done(net_t *net, cli_sess_t *s, uint8_t ok)
+{
+    net_shard_t *sh = net_shard_of(net, s);
+    net_msg_t   m   = { .type = NET_MSG_KNOCK, .ok = ok };
+
+    if (!sh)
+        return;
+
+    m.slot = NET_SLOT(sh, s);
+    m.gen  = __atomic_load_n(&sh->slot[m.slot].gen, __ATOMIC_RELAXED);
+    net_send(sh, &m);
+}
+#endif
+
+
+void net_stop(net_t *net)
+{
+    int         i;
+
+    __atomic_store_n(&net->stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < net->n; i++)
+        pthread_join(net->shard[i].tid, NULL);
+
+#if __ENABLE_JOBS__
+    if (net->tmpl->jobs) {
+        net->tmpl->jobs->done = NULL;
+        net->tmpl->jobs->user = NULL;
+    }
+#endif
+    net_free(net);
+}
@@ -0,0 +1,49 @@
+#include <stdint.h>
+
+#include "cli.h"
+
+/* bytes of output a connection holds while the peer is not reading */
+#define NET_OUT         (4096)
+
+typedef struct net_s net_t;
+
+/* counters of a shard, written by it alone */
+typedef struct {
+    uint64_t    accepted;
+    uint64_t    refused;        // no session left in the shard
+    uint64_t    closed;
+    uint64_t    lines;
+    uint64_t    bytes_in;
+    uint64_t    bytes_out;
+    uint64_t    dropped;        // output lost to a peer not reading
+} net_stats_t;
+
+/*
+ * serve 'tmpl' on TCP 'port', 0 for any, with 'n' shards of 'max_sess'
+ * sessions each, NULL on error. Each shard runs on its own core with its own
+ * listening socket. A cache of 'tmpl' is replaced by one of the same size in
+ * each shard. 'tmpl' must have no backoff nor log queue, which a single
+ * thread may use; 'setup', if any, is called in the shard before it serves,
+ * e.g. to give its cli_t a backoff of its own.
+ *
+ * The jobs of 'tmpl', if any, are shared by the shards, which take their
+ * 'done' and 'user' to show the output of 'fg'. The jobs of a connection
+ * closing are killed, its session is kept until they are done. Their
+ * workers must be stopped before net_stop().
+ */
+net_t *net_start(const cli_t *tmpl, uint16_t port, int n, uint16_t max_sess,
+                 void (*setup)(cli_t *cli, int shard));
+uint16_t net_port(const net_t *net);
+void net_stats(const net_t *net, int shard, net_stats_t *st);
+
+#if __ENABLE_LOGIN__
+/*
+ * report the result of the cli_t.knock_async started for session 's', from
+ * any thread, once. The shard serving 's' finishes the login in its own
+ * thread, with the output going to the connection of 's'; a result for a
+ * connection closed meanwhile is dropped. Until then 's' is kept for it,
+ * with the 'id' and 'pass' given to knock_async.
+ */
+void net_knock_done(net_t *net, cli_sess_t *s, uint8_t ok);
+#endif
+void net_stop(net_t *net);
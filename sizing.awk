@@ -0,0 +1,97 @@
+#
+# Footprint of one build profile of cli.o, see 'make sizing'.
+#
+# Input, in order: the budget file, then 'nm -S --size-sort' of the object
+# followed by the -fstack-usage report of its compilation.
+#
+#     awk -v profile=<name> [-v update=1] -f sizing.awk sizing.budget -
+#
+# Prints the .text and stack frame of every function, the static RAM of
+# every variable and the totals. Exits 1 if a total is over the budget of
+# the profile. With 'update' only the budget line of the current sizes is
+# printed.
+#
+
+function hex(s,    i, n)
+{
+    n = 0
+    for (i = 1; i <= length(s); i++)
+        n = n * 16 + index("0123456789abcdef", tolower(substr(s, i, 1))) - 1
+    return n
+}
+
+# budget: <profile> <text> <ram> <stack>
+FNR == NR {
+    if ($1 == profile) {
+        budget_text  = $2
+        budget_ram   = $3
+        budget_stack = $4
+        budgeted     = 1
+    }
+    next
+}
+
+# stack usage: cli.c:<line>:<col>:<function> <bytes> <qualifiers>
+/^[^ \t]+:[0-9]+:[0-9]+:/ {
+    split($1, loc, ":")
+    stack[loc[4]] = $2
+    if ($2 > max_stack) {
+        max_stack = $2
+        max_func  = loc[4]
+    }
+    next
+}
+
+# nm: <address> <size> <type> <name>
+NF == 4 {
+    size = hex($2)
+    if ($3 ~ /^[tT]$/ && $4 ~ /cli_/) {
+        text[$4] = size
+        total_text += size
+    } else if ($3 ~ /^[bBdDC]$/) {
+        ram[$4] = size
+        total_ram += size
+    }
+}
+
+END {
+    if (update) {
+        printf("%-14s %7d %7d %7d\n", profile, total_text, total_ram, max_stack)
+        exit 0
+    }
+
+    printf("== %s ==\n", profile)
+    printf("%7s %7s  %s\n", "text", "stack", "function")
+    for (f in text)
+        printf("%7d %7d  %s\n", text[f], stack[f], f) | "sort -k1,1nr -k3"
+    close("sort -k1,1nr -k3")
+    printf("%7s %7s  %s\n", "ram", "", "variable")
+    for (v in ram)
+        printf("%7d %7s  %s\n", ram[v], "", v) | "sort -k1,1nr -k2"
+    close("sort -k1,1nr -k2")
+
+    printf("total: text %d, static RAM %d, deepest frame %d (%s)\n",
+           total_text, total_ram, max_stack, max_func)
+
+    if (!budgeted) {
+        printf("no budget for profile '%s' in the budget file\n", profile)
+        exit 1
+    }
+
+    over = 0
+    if (total_text > budget_text) {
+        printf("text %d is over the budget of %d\n", total_text, budget_text)
+        over = 1
+    }
+    if (total_ram > budget_ram) {
+        printf("static RAM %d is over the budget of %d\n", total_ram, budget_ram)
+        over = 1
+    }
+    if (max_stack > budget_stack) {
+        printf("stack frame %d is over the budget of %d\n", max_stack, budget_stack)
+        over = 1
+    }
+    printf("budget: text %d, static RAM %d, deepest frame %d%s\n\n",
+           budget_text, budget_ram, budget_stack, over ? " - EXCEEDED" : "")
+    exit over
+}
@@ -7,7 +7,18 @@
 void cursor_move(uint32_t cursor_seq)
 {
     for (int i = 24; i >= 0; i -= 8)
-        cli_putc((cursor_seq >> i) & 0xFF);
+        if ((cursor_seq >> i) & 0xFF)
+            cli_putc((cursor_seq >> i) & 0xFF);
+}
+
+void cursor_goto(uint16_t row, uint16_t col)
+{
+    cli_putc(KEY_ESC);
+    cli_putc('[');
+    cli_putd(row);
+    cli_putc(';');
+    cli_putd(col);
+    cli_putc('H');
 }
 
 void term_clear(void)
@@ -35,6 +35,7 @@ enum key_seq {
 #define CURSOR_RIGHT    TUPLE(KEY_ESC, '[', '1', 'C')
 #define SCREEN_CLEAR    TUPLE(KEY_ESC, '[', '2', 'J')
 #define CURSOR_1_1      TUPLE(KEY_ESC, '[', ';', 'H')
+#define ERASE_EOL       TUPLE(   0   , KEY_ESC, '[', 'K')
 
 #define cursor_move_left() cursor_move(CURSOR_LEFT)
 #define cursor_move_right() cursor_move(CURSOR_RIGHT)
@@ -43,3 +44,8 @@ void cursor_move(uint32_t cursor_seq);
 
 void term_clear(void);
 
+/* 1-based, as in the escape sequence */
+void cursor_goto(uint16_t row, uint16_t col);
+
+#define term_erase_eol() cursor_move(ERASE_EOL)
+
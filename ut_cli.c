@@ -2,73 +2,8 @@
 
 #include <string.h>
 
-#include "cli.c"
-
-/****************************************************************************
- *
- * Configurations.
- *
- ****************************************************************************/
-
-
-#if __ENABLE_LOGIN__
-/* enable hardcode login credentials by default */
-#define __ENABLE_HARDCODE_LOGIN__
-#endif
-
-
-#ifdef __ENABLE_REAL_KNOCK__
-#ifdef __ENABLE_HARDCODE_LOGIN__
-/* disable hardcode login if a real authentication exists */
-#undef __ENABLE_HARDCODE_LOGIN__
-#endif
-#endif
-
-
-/****************************************************************************
- *
- * Constants.
- *
- ****************************************************************************/
-
-
-#if __ENABLE_LOGIN__
-#define MAX_ID          (16)
-#endif
-
-
-#ifdef __ENABLE_HARDCODE_LOGIN__
-#define LOGIN_ID        "a"
-#define LOGIN_PASSWD    "a"
-#endif
-
-
-/****************************************************************************
- *
- * Types.
- *
- ****************************************************************************/
-
-
-/****************************************************************************
- *
- * Static variables.
- *
- ****************************************************************************/
-
-
-/**
- * The only static variable in the mini-CLI.
- */
-static cli_t        *cb;
-
-
-/****************************************************************************
- *
- * Local functions.
- *
- ****************************************************************************/
-
+#include "cli.h"
+#include "term.h"
 
 /****************************************************************************
  *
@@ -76,15 +11,32 @@ static cli_t        *cb;
  *
  ****************************************************************************/
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "io.h"
+#if __ENABLE_RX_RING__
+#include "vuart.h"
+#endif
 #if __ENABLE_LOGIN__
+#include "cred.h"
 #include "knock.h"
 #endif
+#if __ENABLE_HISTORY__
+#include "hist.h"
+#endif
+#if __ENABLE_SHARDS__
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "net.h"
+#endif
 
 typedef uint8_t (*test_fptr)(cli_t *);
 
@@ -100,6 +52,17 @@ uint8_t ls_example(uint8_t len, char *param)
     return 0;
 }
 
+uint8_t uptime_example(uint8_t len, char *param)
+{
+    static int ticks;
+
+    cli_puts("ticks  ");
+    cli_putd(ticks++);
+    cli_putln();
+    cli_puts("static 42\n");
+    return 0;
+}
+
 uint8_t clear_example(uint8_t len, char *param)
 {
     term_clear();
@@ -136,8 +99,10 @@ static cli_t   cnf_1 =
 
 static uint8_t test_1(cli_t *cb)
 {
+    cli_sink_t  out = { .put = putch };
+
     cli_init(cb);
-    _cli_do_cmd("?");
+    cli_exec(cb, "?", 1, &out);
     return 0;
 }
 
@@ -150,6 +115,9 @@ static cmd_t   set_2[] =
     { "ls",           "list",     ls_example },
     { "lo",           "logout",   cli_logout },
     { "clear",        "clr scn",  clear_example },
+    { "uptime",       "ticks",    uptime_example },
+    { "watch",        "repeat",   cli_watch },
+    { "mem",          "memory",   cli_mem },
     { NULL }
 };
 
@@ -162,6 +130,7 @@ static cli_t   cnf_2 =
 #endif
     .get   = getch,
     .put   = putch,
+    .wait  = waitch,
     .cmd   = &set_2[0]
 };
 
@@ -221,19 +190,2681 @@ static uint8_t test_3(cli_t *cb)
 
 /****************************************************************************/
 
+/* case 4 */
+
+static uint8_t echo_example(uint8_t len, char *param)
+{
+    while (--len) {
+        cli_puts(param);
+        cli_putsp();
+        if (len == 1)
+            break;
+        param += strlen(param);
+        while (*param == '\0')
+            param++;
+    }
+    cli_putln();
+    return 0;
+}
+
+static cmd_t   set_4[] =
+{
+    { "echo",         "echo",     echo_example },
+    { NULL }
+};
+
+static uint32_t arena_4[(CLI_ARENA_SIZE + 3) / 4];
+
+static cli_t   cnf_4 =
+{
+    .state = 1,
+    .put   = putch,
+    .cmd   = &set_4[0],
+    .arena = arena_4
+};
+
+
+static uint8_t test_4(cli_t *cb)
+{
+    char        buf[32];
+    cli_sink_t  out = { .buf = buf, .size = sizeof(buf) };
+    size_t      n;
+
+    cli_init(cb);
+
+    n = cli_exec(cb, "echo a  b", 9, &out);
+    printf("%zu bytes: %s", n, buf);
+    if (n != 5 || strcmp(buf, "a b \n"))
+        return 1;
+
+    n = cli_exec(cb, "echo 0123456789abcdefghijklmnopqrstuvwxyz", 41, &out);
+    printf("%zu bytes, %u stored: %s\n", n, out.len, buf);
+    if (n != 38 || out.len != sizeof(buf) - 1)
+        return 1;
+
+    n = cli_exec(cb, "nope", 4, &out);
+    printf("%zu bytes: %s", n, buf);
+    if (strcmp(buf, "nope unknown command\n"))
+        return 1;
+
+    return 0;
+}
+
+
+/* case 5 */
+
+#if __ENABLE_LOG_QUEUE__
+static cli_logq_t       log_q;
+
+static cli_t   cnf_5 =
+{
+    .state = 1,
+#if __ENABLE_LOGIN__
+    .knock = knock,
+#endif
+    .get   = getch,
+    .put   = putch,
+    .wait  = waitch,
+    .cmd   = &set_2[0],
+    .logq  = &log_q
+};
+
+
+static void *log_producer(void *arg)
+{
+    char    msg[32];
+    int     i;
+
+    for (i = 0; i < 20; i++) {
+        usleep(700 * 1000);
+        snprintf(msg, sizeof(msg), "[%s] event %d", (char *)arg, i);
+        cli_log(&log_q, msg);
+    }
+    return NULL;
+}
+
+
+static uint8_t test_5(cli_t *cb)
+{
+    pthread_t   t[2];
+
+    /* carves the log slots out of the arena */
+    cli_init(cb);
+
+    pthread_create(&t[0], NULL, log_producer, "net");
+    pthread_create(&t[1], NULL, log_producer, "disk");
+
+    cli_task();
+    return 0;
+}
+#endif
 
 
 /****************************************************************************/
 
-struct case_t {
-    char        *name;
-    cli_t       *conf;
-    char        *desc;
-    test_fptr   fptr;
-} all[] = {
-    { "name_len", &cnf_1, "description indentation test", test_1 },
-    { "run",      &cnf_2, "logout command test",          test_2 },
-    { "tokens",   &cnf_3, "token handling",               test_3 },
+/* case 6 */
+
+#if __ENABLE_RX_RING__
+#define VUART_LINES     (20000)
+#define VUART_BAUD      (921600)
+
+static int      vuart_cmds;
+static long     vuart_out;
+
+static uint8_t count_example(uint8_t len, char *param)
+{
+    vuart_cmds++;
+    return 0;
+}
+
+static void null_putch(char c)
+{
+    vuart_out++;
+}
+
+static cmd_t   set_6[] =
+{
+    { "count",        "count",    count_example },
+    { "lo",           "logout",   cli_logout },
+    { NULL }
+};
+
+/* generous, a host thread may be descheduled for milliseconds */
+static char     vuart_buf[8192];
+static cli_rx_t vuart_ring;
+
+static cli_t   cnf_6 =
+{
+    .state = 1,
+    .get   = cli_rx_getch,
+    .put   = null_putch,
+    .wait  = cli_rx_wait,
+    .cmd   = &set_6[0],
+    .rx    = &vuart_ring
+};
+
+
+static uint8_t test_6(cli_t *cb)
+{
+    char            *script = malloc(VUART_LINES * 6 + 4);
+    struct timespec t0, t1;
+    int             i;
+
+    for (i = 0; i < VUART_LINES; i++)
+        memcpy(&script[i * 6], "count\n", 6);
+    strcpy(&script[i * 6], "lo\n");
+
+    vuart_init(&vuart_ring, vuart_buf, sizeof(vuart_buf));
+    cli_init(cb);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    vuart_start(script, VUART_BAUD);
+    cli_task();
+    vuart_join();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    printf("%d/%d commands, %u bytes dropped, %ld bytes out, %.3f s at %d baud\n",
+           vuart_cmds, VUART_LINES, vuart_ring.dropped, vuart_out,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+           VUART_BAUD);
+
+    free(script);
+    return vuart_cmds != VUART_LINES || vuart_ring.dropped;
+}
+#endif
+
+
+/****************************************************************************/
+
+/* case 7 */
+
+#define SLAB_SESSIONS   (10000)
+
+static int      slab_cmds;
+static long     slab_out;
+
+static uint8_t slab_count(uint8_t len, char *param)
+{
+    slab_cmds++;
+    return 0;
+}
+
+static void slab_putch(char c)
+{
+    slab_out++;
+}
+
+static cmd_t   set_7[] =
+{
+    { "count",        "count",    slab_count },
+    { "lo",           "logout",   cli_logout },
+    { NULL }
+};
+
+static cli_t   cnf_7 =
+{
+    .state = 0,
+#if __ENABLE_LOGIN__
+    .knock = knock,
+#endif
+    .put   = slab_putch,
+    .cmd   = &set_7[0]
+};
+
+
+static uint8_t test_7(cli_t *cb)
+{
+    static const char   in[] = "1\n1\ncount\ncount\n";
+    char                *mem = malloc(SLAB_SESSIONS * CLI_SESS_BYTES);
+    cli_slab_t          slab;
+    cli_sess_t          **s  = malloc(SLAB_SESSIONS * sizeof(*s));
+    struct timespec     t0, t1;
+    uint8_t             ret  = 0;
+    int                 i;
+
+    cli_init(cb);
+    cli_slab_init(&slab, mem, SLAB_SESSIONS * CLI_SESS_BYTES);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (i = 0; i < SLAB_SESSIONS; i++) {
+        s[i] = cli_sess_alloc(&slab);
+        cli_sess_start(cb, s[i]);
+    }
+
+    if (cli_sess_alloc(&slab))
+        ret = 1;
+
+    /* interleave the sessions, as a server would */
+    for (i = 0; i < SLAB_SESSIONS; i++)
+        cli_input(cb, s[i], in, sizeof(in) - 1);
+    for (i = 0; i < SLAB_SESSIONS; i++)
+        if (cli_input(cb, s[i], "lo\n", 3))
+            ret = 1;
+        else
+            cli_sess_free(&slab, s[i]);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    printf("%d sessions of %zu bytes, %d/%d commands, %ld bytes out, %.3f s\n",
+           SLAB_SESSIONS, CLI_SESS_BYTES, slab_cmds, SLAB_SESSIONS * 2,
+           slab_out,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+    if (slab_cmds != SLAB_SESSIONS * 2 || slab.used)
+        ret = 1;
+
+    free(s);
+    free(mem);
+    return ret;
+}
+
+
+/****************************************************************************/
+
+/* case 8 */
+
+#if __ENABLE_MODULES__
+#define MOD_ROUNDS      (200)
+
+static uint8_t hello_example(uint8_t len, char *param)
+{
+    cli_puts("hello\n");
+    return 0;
+}
+
+static cmd_t   set_8_1[] =
+{
+    { "-v",           "verbose",  hello_example },
+    { NULL }
+};
+
+static cmd_t   set_8[] =
+{
+    { "echo",         "echo",     echo_example },
+    { "ls",           "list",     NULL,          set_8_1 },
+#if __ENABLE_WATCH__
+    { "watch",        "repeat",   cli_watch },
+#endif
+    { NULL }
+};
+
+static cmd_t   mod_8_cmd[] =
+{
+    { "hello",        "greeting", hello_example },
+    { NULL }
+};
+
+static cmd_t   mod_8_1_cmd[] =
+{
+    { "-h",           "human",    hello_example },
+    { NULL }
+};
+
+/* attached to a module */
+static cmd_t   mod_8_2_cmd[] =
+{
+    { "-x",           "extended", hello_example },
+    { NULL }
+};
+
+static cli_mod_t   mod_8   = { .level = set_8,   .cmd = mod_8_cmd };
+static cli_mod_t   mod_8_1 = { .level = set_8_1, .cmd = mod_8_1_cmd };
+static cli_mod_t   mod_8_2 = { .level = mod_8_1_cmd, .cmd = mod_8_2_cmd };
+
+static cli_t   cnf_8 =
+{
+    .state = 1,
+    .put   = putch,
+    .cmd   = &set_8[0]
+};
+
+static volatile int mod_done;
+
+#if __ENABLE_WATCH__
+static uint8_t      mod_detached;
+static uint8_t      mod_detached_in_wait;
+
+static void *mod_detacher(void *arg)
+{
+    cli_detach(&mod_8);
+    __atomic_store_n(&mod_detached, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* detaches while watch waits for a key, then presses 'q' */
+static uint8_t mod_wait(uint16_t ms)
+{
+    pthread_t   t;
+    int         i;
+
+    pthread_create(&t, NULL, mod_detacher, NULL);
+    for (i = 0; i < 2000 && !__atomic_load_n(&mod_detached, __ATOMIC_ACQUIRE);
+         i++)
+        usleep(1000);
+    mod_detached_in_wait = __atomic_load_n(&mod_detached, __ATOMIC_ACQUIRE);
+    pthread_detach(t);
+
+    return 1;
+}
+
+static char mod_getch(void)
+{
+    return 'q';
+}
+#endif
+
+/* attaches and detaches while the main thread dispatches */
+static void *mod_writer(void *arg)
+{
+    int     i;
+
+    for (i = 0; i < MOD_ROUNDS; i++) {
+        mod_8_cmd[0].fptr = hello_example;
+        cli_attach(&mod_8);
+        usleep(10);
+        cli_detach(&mod_8);
+        /* a dispatch still using it would crash now */
+        mod_8_cmd[0].fptr = NULL;
+        mod_8_cmd[0].cmd  = NULL;
+        usleep(10);
+        mod_8_cmd[0].cmd  = "hello";
+    }
+    mod_done = 1;
+    return NULL;
+}
+
+
+static uint8_t test_8(cli_t *cb)
+{
+    char        buf[64];
+    cli_sink_t  out = { .buf = buf, .size = sizeof(buf) };
+    pthread_t   t;
+    long        seen[2] = { 0, 0 };
+#if __ENABLE_WATCH__
+    cli_t       watch;
+#endif
+
+    cli_init(cb);
+
+    cli_exec(cb, "hello", 5, &out);
+    printf("before: %s", buf);
+    if (strcmp(buf, "hello unknown command\n"))
+        return 1;
+
+    cli_attach(&mod_8);
+    cli_attach(&mod_8_1);
+
+    cli_exec(cb, "hello", 5, &out);
+    printf("attached: %s", buf);
+    if (strcmp(buf, "hello\n"))
+        return 1;
+
+    cli_exec(cb, "ls -h", 5, &out);
+    printf("attached: %s", buf);
+    if (strcmp(buf, "hello\n"))
+        return 1;
+
+    /* help lists what lookup finds, down to modules attached to modules */
+    cli_attach(&mod_8_2);
+    cli_exec(cb, "ls -x", 5, &out);
+    if (strcmp(buf, "hello\n"))
+        return 1;
+    cli_exec(cb, "ls ?", 4, &out);
+    printf("help:\n%s", buf);
+    if (!strstr(buf, "-v") || !strstr(buf, "-h") || !strstr(buf, "-x"))
+        return 1;
+
+    cli_detach(&mod_8_2);
+    cli_detach(&mod_8_1);
+
+#if __ENABLE_WATCH__
+    /* a session waiting in watch does not hold cli_detach() up */
+    watch      = *cb;
+    watch.wait = mod_wait;
+    watch.get  = mod_getch;
+    cli_exec(&watch, "watch hello", 11, &out);
+    printf("detached while watching: %s\n",
+           mod_detached_in_wait ? "yes" : "no");
+    while (!__atomic_load_n(&mod_detached, __ATOMIC_ACQUIRE))
+        usleep(1000);
+    if (!mod_detached_in_wait)
+        return 1;
+#else
+    cli_detach(&mod_8);
+#endif
+
+    cli_exec(cb, "hello", 5, &out);
+    printf("detached: %s", buf);
+    if (strcmp(buf, "hello unknown command\n"))
+        return 1;
+
+    pthread_create(&t, NULL, mod_writer, NULL);
+    while (!mod_done) {
+        cli_exec(cb, "hello", 5, &out);
+        seen[!strcmp(buf, "hello\n")]++;
+    }
+    pthread_join(t, NULL);
+
+    printf("%d attach/detach rounds: %ld hits, %ld misses\n",
+           MOD_ROUNDS, seen[1], seen[0]);
+
+    return 0;
+}
+#endif
+
+
+/****************************************************************************/
+
+/* case 9 */
+
+#if __ENABLE_LAZY_CMD__
+#define LAZY_IFS        (100000)
+
+static cmd_t    if_cmd;
+static char     if_name[16];
+static int      if_calls;
+
+static uint8_t if_show(uint8_t len, char *param)
+{
+    cli_puts(if_cmd.cmd);
+    cli_puts(" up\n");
+    return 0;
+}
+
+/* eth0 .. eth99999, none of them exists until asked for */
+static const cmd_t *if_lazy(const char *key, uint32_t *iter)
+{
+    char        *end;
+    uint32_t    i;
+
+    if_calls++;
+
+    if (!iter) {
+        if (strncmp(key, "eth", 3) || key[3] < '0' || key[3] > '9' ||
+            (key[3] == '0' && key[4]))
+            return NULL;
+        i = strtoul(key + 3, &end, 10);
+        if (*end || i >= LAZY_IFS)
+            return NULL;
+    } else {
+        for (i = *iter; i < LAZY_IFS; i++) {
+            snprintf(if_name, sizeof(if_name), "eth%u", i);
+            if (!strncmp(if_name, key, strlen(key)))
+                break;
+        }
+        if (i == LAZY_IFS)
+            return NULL;
+        *iter = i + 1;
+    }
+
+    snprintf(if_name, sizeof(if_name), "eth%u", i);
+    if_cmd.cmd  = if_name;
+    if_cmd.help = "interface";
+    if_cmd.fptr = if_show;
+
+    return &if_cmd;
+}
+
+static cmd_t   set_9_1[] =
+{
+    { "interface",    "interfaces", NULL, NULL, if_lazy },
+    { "internal",     "hidden",     NULL },
+    { NULL }
+};
+
+static cmd_t   set_9[] =
+{
+    { "show",         "show",     NULL,   set_9_1 },
+    { "lo",           "logout",   cli_logout },
+    { NULL }
+};
+
+static char     term_9[4096];
+static int      term_9_len;
+
+static void term_9_putch(char c)
+{
+    if (term_9_len < sizeof(term_9) - 1)
+        term_9[term_9_len++] = c;
+}
+
+static cli_t   cnf_9 =
+{
+    .state = 1,
+    .put   = term_9_putch,
+    .cmd   = &set_9[0]
+};
+
+
+static uint8_t test_9(cli_t *cb)
+{
+    static uint64_t sess[(CLI_SESS_BYTES + 7) / 8];
+    cli_sess_t      *s  = (cli_sess_t *)sess;
+    char            buf[64];
+    cli_sink_t      out = { .buf = buf, .size = sizeof(buf) };
+    size_t          n;
+
+    cli_init(cb);
+    printf("%d interfaces, %d callbacks so far\n", LAZY_IFS, if_calls);
+
+    cli_exec(cb, "show interface eth4242", 22, &out);
+    printf("%s", buf);
+    if (strcmp(buf, "eth4242 up\n"))
+        return 1;
+
+    cli_exec(cb, "show interface eth100000", 24, &out);
+    printf("%s", buf);
+    if (strcmp(buf, "eth100000 unknown command\n"))
+        return 1;
+
+    n = cli_exec(cb, "show interface ?", 16, &out);
+    printf("help: %zu bytes\n", n);
+
+    cli_sess_start(cb, s);
+    cli_input(cb, s, "s\tin\t", 5);
+    printf("completed: '%s'\n", s->line);
+    if (strcmp(s->line, "show inter"))
+        return 1;
+
+    cli_input(cb, s, "f\teth9999\t", 10);
+    printf("completed: '%s'\n", s->line);
+    if (strcmp(s->line, "show interface eth9999"))
+        return 1;
+
+    term_9_len = 0;
+    cli_input(cb, s, "8\t\n", 3);
+    term_9[term_9_len] = '\0';
+    printf("%s", term_9);
+    if (strcmp(term_9, "8 \neth99998 up\n$ "))
+        return 1;
+
+    return 0;
+}
+#endif
+
+
+/* case 10 */
+
+#define BATCH_LINES     (200000)
+
+static uint32_t batch_args;
+
+static uint8_t set_example(uint8_t len, char *param)
+{
+    batch_args += len;
+    return 0;
+}
+
+static cmd_t   set_10[] =
+{
+    { "set",          "set values", set_example },
+    { NULL }
+};
+
+static uint32_t arena_10[(CLI_ARENA_SIZE + 3) / 4];
+
+static cli_t   cnf_10 =
+{
+    .state = 1,
+    .put   = putch,
+    .cmd   = &set_10[0],
+    .arena = arena_10
+};
+
+
+/* in ut_cli_lib.o, cli.c built with __UT_CLI__ */
+int ut_cli_tokens(char *line, bool simd);
+size_t ut_cli_lines(const char *buf, size_t len);
+
+static double elapsed(struct timespec *t0, struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* the lines of 'batch' tokenized by _cli_line_to_tokens(), in MB/s */
+static double batch_tokens(const char *batch, size_t len, bool simd,
+                           uint32_t *toks)
+{
+    char                line[MAX_LINE + 1];
+    struct timespec     t0, t1;
+    size_t              n;
+    int                 i;
+
+    *toks = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (n = 0; n < len; n += i + 1) {
+        i = (char *)memchr(batch + n, '\n', len - n) - (batch + n);
+        memcpy(line, batch + n, i);
+        line[i] = '\0';
+        *toks += ut_cli_tokens(line, simd);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    return len / elapsed(&t0, &t1) / 1e6;
+}
+
+/* the lines of 'batch' split byte by byte, as before memchr() */
+static size_t byte_lines(const char *buf, size_t len)
+{
+    size_t      lines = 0;
+    size_t      n     = 0;
+    size_t      i;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] == '\n') {
+            lines += n - (n && buf[i - 1] == '\r') != 0;
+            n      = 0;
+        } else {
+            n++;
+        }
+    }
+
+    return lines + (n != 0);
+}
+
+static uint8_t test_10(cli_t *cb)
+{
+    char                *batch = malloc(BATCH_LINES * (MAX_LINE + 1));
+    cli_sink_t          out    = { 0 };
+    struct timespec     t0, t1;
+    uint32_t            toks[2];
+    double              mbs[2];
+    size_t              lines[2];
+    size_t              len    = 0;
+    size_t              n;
+    uint8_t             ret    = 0;
+    int                 i;
+
+    /* long lines of short arguments with one or two spaces between */
+    srand(10);
+    for (i = 0; i < BATCH_LINES; i++) {
+        n = sprintf(batch + len, "set");
+        while (n < MAX_LINE - 8)
+            n += sprintf(batch + len + n, rand() & 1 ? " k%d" : "  v%d",
+                         rand() % 1000);
+        batch[len + n] = '\n';
+        len += n + 1;
+    }
+
+    /* the tokenizer alone, both ways over the same lines */
+    mbs[0] = batch_tokens(batch, len, false, &toks[0]);
+    mbs[1] = batch_tokens(batch, len, true, &toks[1]);
+    printf("tokenizer: byte loop %.0f MB/s, SIMD %.0f MB/s (%u/%u tokens)\n",
+           mbs[0], mbs[1], toks[0], toks[1]);
+    if (toks[0] != toks[1])
+        ret = 1;
+
+    /* the line splitter alone */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    lines[0] = byte_lines(batch, len);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    mbs[0] = len / elapsed(&t0, &t1) / 1e6;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    lines[1] = ut_cli_lines(batch, len);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    mbs[1] = len / elapsed(&t0, &t1) / 1e6;
+
+    printf("line splitter: byte loop %.0f MB/s, memchr %.0f MB/s\n",
+           mbs[0], mbs[1]);
+    if (lines[0] != BATCH_LINES || lines[1] != BATCH_LINES)
+        ret = 1;
+
+    /* and everything through the dispatch */
+    cli_init(cb);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    n = cli_exec_lines(cb, batch, len, &out);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("cli_exec_lines: %zu lines, %u/%u args, %.1f ns/line, %.0f MB/s\n",
+           n, batch_args, toks[1], elapsed(&t0, &t1) * 1e9 / BATCH_LINES,
+           len / elapsed(&t0, &t1) / 1e6);
+
+    free(batch);
+    return ret || n != BATCH_LINES || batch_args != toks[1];
+}
+
+
+/* case 11 */
+
+#if __ENABLE_CACHE__
+static uint32_t cache_ms;
+static int      cache_renders;
+
+static uint32_t cache_now(void)
+{
+    return cache_ms;
+}
+
+/* an expensive show command */
+static uint8_t stats_example(uint8_t len, char *param)
+{
+    cache_renders++;
+    cli_puts("rx ");
+    cli_putd(cache_renders);
+    cli_puts(len > 1 ? " for " : "");
+    cli_puts(len > 1 ? param : "");
+    cli_putln();
+    return 0;
+}
+
+static cmd_t   set_11_1[] =
+{
+    { "stats",        "statistics", stats_example, .ttl = 1000 },
+    { "uncached",     "statistics", stats_example },
+    { NULL }
+};
+
+static cmd_t   set_11[] =
+{
+    { "show",         "show",     NULL,   set_11_1 },
+    { NULL }
+};
+
+static cli_cache_ent_t  cache_ent[2];
+static cli_cache_t      cache_11;
+static uint32_t         arena_11[(CLI_ARENA_SIZE + 3) / 4];
+
+static cli_t   cnf_11 =
+{
+    .state = 1,
+    .put   = putch,
+    .cmd   = &set_11[0],
+    .cache = &cache_11,
+    .arena = arena_11
+};
+
+static uint8_t cache_expect(cli_t *cb, const char *line, const char *out)
+{
+    char        buf[32];
+    cli_sink_t  sink = { .buf = buf, .size = sizeof(buf) };
+
+    cli_exec(cb, line, strlen(line), &sink);
+    printf("%-24s %s", line, buf);
+
+    return strcmp(buf, out) != 0;
+}
+
+static uint8_t test_11(cli_t *cb)
+{
+    uint8_t     ret = 0;
+
+    cli_cache_init(&cache_11, cache_ent, 2, cache_now);
+    cli_init(cb);
+
+    /* many pollers within the ttl share one rendering */
+    ret |= cache_expect(cb, "show stats", "rx 1\n");
+    cache_ms = 500;
+    ret |= cache_expect(cb, "show  stats", "rx 1\n");
+    ret |= cache_expect(cb, "show stats eth0", "rx 2 for eth0\n");
+    ret |= cache_expect(cb, "show stats eth0", "rx 2 for eth0\n");
+    ret |= cache_expect(cb, "show uncached", "rx 3\n");
+
+    /* expired */
+    cache_ms = 1000;
+    ret |= cache_expect(cb, "show stats", "rx 4\n");
+
+    /* the oldest entry makes room */
+    ret |= cache_expect(cb, "show stats eth1", "rx 5 for eth1\n");
+    ret |= cache_expect(cb, "show stats", "rx 4\n");
+    ret |= cache_expect(cb, "show stats eth0", "rx 6 for eth0\n");
+
+    cli_cache_invalidate(&cache_11, &set_11_1[0]);
+    ret |= cache_expect(cb, "show stats eth0", "rx 7 for eth0\n");
+
+    printf("%u hits, %u misses\n", cache_11.hits, cache_11.misses);
+
+    return ret || cache_11.hits != 3 || cache_11.misses != 6;
+}
+#endif
+
+
+/* case 12 */
+
+#if __ENABLE_JOBS__
+#define JOB_WORKERS     (2)
+
+static cli_job_t        job_12[4];
+static cli_jobs_t       jobs_12;
+static volatile int     jobs_stop;
+
+/* a long diagnostic, 'ms' milliseconds */
+static uint8_t diag_example(uint8_t len, char *param)
+{
+    int     ms = len > 1 ? atoi(param) : 10;
+
+    while (ms-- > 0 && !cli_job_killed())
+        usleep(1000);
+
+    cli_puts(ms < 0 ? "diag passed\n" : "diag stopped\n");
+    return 0;
+}
+
+static cmd_t   set_12[] =
+{
+    { "diag",         "diagnose", diag_example },
+    { "jobs",         "jobs",     cli_jobs },
+    { "fg",           "wait",     cli_fg },
+    { "kill",         "kill",     cli_kill },
+    { "lo",           "logout",   cli_logout },
+    { NULL }
+};
+
+static uint32_t arena_12[(CLI_ARENA_SIZE + 3) / 4];
+
+static cli_t   cnf_12 =
+{
+    .state = 1,
+    .put   = putch,
+    .cmd   = &set_12[0],
+    .jobs  = &jobs_12,
+    .arena = arena_12
+};
+
+static void jobs_sleep(uint16_t ms)
+{
+    usleep(ms * 1000);
+}
+
+static void *job_worker(void *arg)
+{
+    while (!jobs_stop)
+        if (!cli_job_run(&jobs_12))
+            jobs_sleep(1);
+    return NULL;
+}
+
+/* the output of the event loop, and how many jobs are done */
+static char             loop_out[128];
+static size_t           loop_len;
+static volatile int     jobs_done_n;
+
+static void loop_put(char c)
+{
+    if (loop_len + 1 < sizeof(loop_out)) {
+        loop_out[loop_len++] = c;
+        loop_out[loop_len]   = '\0';
+    }
+}
+
+static void jobs_done(cli_jobs_t *jobs, cli_sess_t *s)
+{
+    __atomic_add_fetch(&jobs_done_n, 1, __ATOMIC_RELEASE);
+}
+
+static uint8_t jobs_expect(cli_t *cb, const char *line, const char *out)
+{
+    char        buf[128];
+    cli_sink_t  sink = { .buf = buf, .size = sizeof(buf) };
+
+    cli_exec(cb, line, strlen(line), &sink);
+    printf("%-16s %s", line, buf);
+
+    return strcmp(buf, out) != 0;
+}
+
+static uint8_t test_12(cli_t *cb)
+{
+    pthread_t           tid[JOB_WORKERS];
+    struct timespec     t0, t1;
+    uint8_t             ret = 0;
+    double              secs;
+    int                 done;
+    int                 i;
+
+    cli_jobs_init(&jobs_12, job_12, 4);
+    jobs_12.sleep = jobs_sleep;
+    jobs_12.wait  = jobs_sleep;
+    jobs_12.done  = jobs_done;
+    cli_init(cb);
+
+    for (i = 0; i < JOB_WORKERS; i++)
+        pthread_create(&tid[i], NULL, job_worker, NULL);
+
+    /* two diagnostics in parallel, the prompt returns at once */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ret |= jobs_expect(cb, "diag 200 &", "[1] diag 200\n");
+    ret |= jobs_expect(cb, "diag  200  &", "[2] diag 200\n");
+    ret |= jobs_expect(cb, "fg 1", "diag passed\n");
+    ret |= jobs_expect(cb, "jobs", "[2] done\tdiag 200\n");
+    ret |= jobs_expect(cb, "fg", "diag passed\n");
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("2 jobs of 0.2 s on %d workers in %.3f s\n", JOB_WORKERS, secs);
+    if (secs > 0.39)
+        ret = 1;
+
+    ret |= jobs_expect(cb, "diag 100000 &", "[3] diag 100000\n");
+    usleep(20000);
+    ret |= jobs_expect(cb, "jobs", "[3] running\tdiag 100000\n");
+    ret |= jobs_expect(cb, "kill 3", "[3] killed\n");
+    ret |= jobs_expect(cb, "fg 3", "no such job\n");
+    ret |= jobs_expect(cb, "jobs", "");
+
+    /* the ids wrap around 0, which stands for the last job */
+    jobs_12.last_id = 0xffff;
+    ret |= jobs_expect(cb, "diag &", "[1] diag\n");
+    ret |= jobs_expect(cb, "fg", "diag passed\n");
+
+    /* a job changes its copy of the session, not the session */
+    ret |= jobs_expect(cb, "lo &", "[2] lo\n");
+    ret |= jobs_expect(cb, "fg", "logout\n");
+    ret |= jobs_expect(cb, "jobs", "");
+    if (!cb->sess->state)
+        ret = 1;
+
+    /* an event loop goes on after 'fg', the output follows when done */
+    cb->put = loop_put;
+    cli_sess_start(cb, cb->sess);
+    loop_len = 0;
+    done     = __atomic_load_n(&jobs_done_n, __ATOMIC_ACQUIRE);
+    cli_input(cb, cb->sess, "diag 50 &\nfg\n", 13);
+    printf("%s\n", loop_out);
+    ret |= strcmp(loop_out, "diag 50 &\n[3] diag 50\n$ fg\n[3] diag 50\n$ ")
+           != 0;
+
+    while (__atomic_load_n(&jobs_done_n, __ATOMIC_ACQUIRE) == done)
+        usleep(1000);
+    loop_len = 0;
+    cli_jobs_poll(cb, cb->sess);
+    printf("%s\n", loop_out);
+    ret |= strcmp(loop_out, "\r\x1b[Kdiag passed\n$ ") != 0;
+    cb->put = putch;
+
+    jobs_stop = 1;
+    for (i = 0; i < JOB_WORKERS; i++)
+        pthread_join(tid[i], NULL);
+
+    return ret;
+}
+#endif
+
+
+/* case 13 */
+
+#if __ENABLE_LOGIN__
+#define CRED_USERS      (5000)
+#define CRED_FILE       "/tmp/ut_cli_cred"
+
+static volatile int     cred_stop;
+static long             cred_logins;
+
+static void cred_write(const char *pass_fmt)
+{
+    FILE        *f = fopen(CRED_FILE, "w");
+    char        id[MAX_ID + 1];
+    char        pass[32];
+    char        line[128];
+    uint8_t     salt[CRED_SALT];
+    int         i;
+    int         j;
+
+    /* one round keeps the test fast, the cost of the rounds is timed apart */
+    fprintf(f, "# id:rounds:salt:pbkdf2_sha256(password, salt, rounds)\n");
+    for (i = 0; i < CRED_USERS; i++) {
+        for (j = 0; j < CRED_SALT; j++)
+            salt[j] = rand();
+        snprintf(id, sizeof(id), "user%d", i);
+        snprintf(pass, sizeof(pass), pass_fmt, i);
+        cred_line(line, sizeof(line), id, pass, salt, 1);
+        fputs(line, f);
+    }
+    fclose(f);
+}
+
+/* logins going on while the store is reloaded */
+static void *cred_client(void *arg)
+{
+    while (!cred_stop) {
+        if (!cred_knock("user7", "pass7") && !cred_knock("user7", "new7"))
+            return &cred_logins;
+        cred_logins++;
+    }
+    return NULL;
+}
+
+static cmd_t   set_13[] =
+{
+    { "lo",           "logout",   cli_logout },
+    { NULL }
+};
+
+static uint32_t arena_13[(CLI_ARENA_SIZE + 3) / 4];
+
+static cli_t   cnf_13 =
+{
+    .state = 0,
+    .knock = cred_knock,
+    .put   = slab_putch,
+    .cmd   = &set_13[0],
+    .arena = arena_13
+};
+
+static uint8_t test_13(cli_t *cb)
+{
+    static const char   in[] = "user4999\npass4999\nlo\n";
+    pthread_t           tid;
+    struct timespec     t0, t1;
+    cred_t              *c;
+    void                *err;
+    char                line[128];
+    FILE                *f;
+    uint8_t             ret = 0;
+    int                 i;
+
+    srand(13);
+    cred_write("pass%d");
+    c = cred_load(CRED_FILE);
+    if (!c || cred_count(c) != CRED_USERS)
+        return 1;
+    cred_use(c);
+
+    ret |= !cred_knock("user0", "pass0");
+    ret |= cred_knock("user0", "pass1");
+    ret |= cred_knock("nobody", "pass0");
+    ret |= cred_knock("user0", "");
+
+    /* through the login of a session */
+    cli_init(cb);
+    cli_sess_start(cb, cb->sess);
+    ret |= cli_input(cb, cb->sess, in, sizeof(in) - 1) != 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < CRED_USERS; i++) {
+        char    id[MAX_ID + 1];
+        char    pass[32];
+
+        snprintf(id, sizeof(id), "user%d", i);
+        snprintf(pass, sizeof(pass), "pass%d", i);
+        ret |= !cred_knock(id, pass);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%d accounts, %.2f us/login\n", CRED_USERS,
+           ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / 1e3 /
+           CRED_USERS);
+
+    /* reload under load */
+    pthread_create(&tid, NULL, cred_client, NULL);
+    cred_write("new%d");
+    for (i = 0; i < 10; i++)
+        cred_use(cred_load(CRED_FILE));
+    cred_stop = 1;
+    pthread_join(tid, &err);
+    if (err || !cred_logins)
+        ret = 1;
+    printf("%ld logins during 10 reloads\n", cred_logins);
+
+    ret |= !cred_knock("user7", "new7");
+    ret |= cred_knock("user7", "pass7");
+
+    /* an account of CRED_ROUNDS, and a comment longer than any account */
+    cred_write("y%d");
+    cred_line(line, sizeof(line), "slow", "pass", (uint8_t *)"0123456789abcdef",
+              CRED_ROUNDS);
+    f = fopen(CRED_FILE, "a");
+    fputs(line, f);
+    fputc('#', f);
+    for (i = 0; i < 1000; i++)
+        fputc('-', f);
+    fputc('\n', f);
+    fclose(f);
+    c = cred_load(CRED_FILE);
+    if (!c || cred_count(c) != CRED_USERS + 1)
+        return 1;
+    cred_use(c);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ret |= !cred_knock("slow", "pass");
+    ret |= cred_knock("slow", "pas");
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%d rounds, %.2f ms/login\n", CRED_ROUNDS,
+           ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / 2e6);
+
+    /* a bad line, an overlong account or a duplicate id refuses the file */
+    f = fopen(CRED_FILE, "a");
+    fputs("user1:00:00\n", f);
+    fclose(f);
+    ret |= cred_load(CRED_FILE) != NULL;
+
+    cred_write("x%d");
+    f = fopen(CRED_FILE, "a");
+    fputs("user99999:1:", f);
+    for (i = 0; i < 1000; i++)
+        fputc('0', f);
+    fputc('\n', f);
+    fclose(f);
+    ret |= cred_load(CRED_FILE) != NULL;
+
+    cred_write("x%d");
+    cred_line(line, sizeof(line), "user1", "x", (uint8_t *)"0123456789abcdef",
+              1);
+    f = fopen(CRED_FILE, "a");
+    fputs(line, f);
+    fclose(f);
+    ret |= cred_load(CRED_FILE) != NULL;
+
+    /* no line of rounds cred_load() would refuse */
+    ret |= cred_line(line, sizeof(line), "user1", "x",
+                     (uint8_t *)"0123456789abcdef", 0) != -1;
+
+    cred_use(NULL);
+    unlink(CRED_FILE);
+
+    return ret;
+}
+#endif
+
+
+/* case 14 */
+
+#if __ENABLE_LOGIN__ && __ENABLE_BACKOFF__
+static char             term_14[256];
+static int              term_14_len;
+static uint32_t         auth_ms;
+static int              auth_calls;
+static cli_sess_t       *auth_pending;
+static cli_backoff_ent_t backoff_ent[8];
+static cli_backoff_t    backoff_14;
+
+static void term_14_putch(char c)
+{
+    if (term_14_len < sizeof(term_14) - 1)
+        term_14[term_14_len++] = c;
+}
+
+static uint32_t auth_now(void)
+{
+    return auth_ms;
+}
+
+/* the address of a session's client */
+static uint32_t auth_peer(void)
+{
+    return *(uint32_t *)cli_user();
+}
+
+/* a slow backend: the answer comes later from auth_answer() */
+static void auth_knock(char *id, char *pass)
+{
+    auth_calls++;
+    auth_pending = cli_sess();
+}
+
+/* any value but 0 lets in */
+static uint8_t auth_knock_ff(char *id, char *pass)
+{
+    return 0xFF;
+}
+
+static void auth_answer(cli_t *cb)
+{
+    cli_sess_t  *s = auth_pending;
+
+    auth_pending = NULL;
+    cli_knock_done(cb, s, !strcmp(s->line, "1"));
+}
+
+static cmd_t   set_14[] =
+{
+    { "count",        "count",    slab_count },
+    { "lo",           "logout",   cli_logout },
+    { NULL }
+};
+
+static uint32_t arena_14[(CLI_ARENA_SIZE + 3) / 4];
+
+static cli_t   cnf_14 =
+{
+    .state   = 0,
+    .knock_async = auth_knock,
+    .backoff = &backoff_14,
+    .put     = term_14_putch,
+    .cmd     = &set_14[0],
+    .arena   = arena_14
+};
+
+static uint8_t auth_expect(cli_t *cb, cli_sess_t *s, const char *in,
+                           const char *out)
+{
+    term_14_len = 0;
+    cli_input(cb, s, in, strlen(in));
+    term_14[term_14_len] = '\0';
+    printf("%s", term_14);
+    if (strcmp(term_14, out)) {
+        printf(" <- expected: %s\n", out);
+        return 1;
+    }
+    return 0;
+}
+
+static uint8_t test_14(cli_t *cb)
+{
+    static uint32_t     peer[2] = { 0x0a000001, 0x0a000002 };
+    char                mem[2 * CLI_SESS_BYTES];
+    cli_slab_t          slab;
+    cli_sess_t          *a;
+    cli_sess_t          *b;
+    uint8_t             ret = 0;
+    int                 i;
+
+    cli_backoff_init(&backoff_14, backoff_ent, 8, auth_now, auth_peer);
+    cli_slab_init(&slab, mem, sizeof(mem));
+    cli_init(cb);
+
+    a = cli_sess_alloc(&slab);
+    b = cli_sess_alloc(&slab);
+    cli_sess_start(cb, a);
+    a->user = &peer[0];
+    cli_sess_start(cb, b);
+    b->user = &peer[1];
+
+    /* 'a' waits for the backend while 'b' logs in and works */
+    ret |= auth_expect(cb, a, "1\n1\n", "1\npassword: *\n");
+    ret |= auth_expect(cb, a, "count\n", "");
+    ret |= auth_expect(cb, b, "1\n", "1\npassword: ");
+    auth_pending = NULL;
+    ret |= auth_expect(cb, b, "1\n", "*\n");
+    cli_knock_done(cb, b, 1);
+    ret |= auth_expect(cb, b, "count\n", "count\n$ ");
+    cli_knock_done(cb, a, 1);
+
+    /* failures of 'b's peer back off exponentially */
+    cli_input(cb, b, "lo\n", 3);
+    cli_sess_start(cb, b);
+    b->user = &peer[1];
+    for (i = 0; i < 3; i++) {
+        auth_ms += cli_backoff_left(&backoff_14, peer[1]);
+        cli_input(cb, b, "1\n2\n", 4);
+        auth_answer(cb);
+        printf("failure %d: back off %u ms\n", i + 1,
+               cli_backoff_left(&backoff_14, peer[1]));
+        if (cli_backoff_left(&backoff_14, peer[1]) != BACKOFF_MS << i)
+            ret = 1;
+    }
+
+    /* refused without asking the backend */
+    auth_calls = 0;
+    for (i = 0; i < 1000; i++)
+        cli_input(cb, b, "1\n1\n", 4);
+    printf("1000 attempts while backing off, %d reached the backend\n",
+           auth_calls);
+    if (auth_calls || cli_backoff_left(&backoff_14, peer[0]))
+        ret = 1;
+
+    /* and let in again after the wait */
+    auth_ms += BACKOFF_MS << 2;
+    cli_input(cb, b, "1\n1\n", 4);
+    auth_answer(cb);
+    ret |= auth_expect(cb, b, "lo\n", "lo\nlogout\n");
+    if (cli_backoff_left(&backoff_14, peer[1]) || b->state)
+        ret = 1;
+
+    /* a blocking knock returning 0xFF succeeded, it is not pending */
+    cb->knock       = auth_knock_ff;
+    cb->knock_async = NULL;
+    cli_sess_start(cb, b);
+    b->user = &peer[1];
+    ret |= auth_expect(cb, b, "someone\nsecret\n",
+                       "someone\npassword: ******\n$ ");
+    cb->knock_async = auth_knock;
+
+    /* the session keeps neither of them */
+    for (i = 0; i < CLI_LINE_BYTES; i++)
+        if (b->line[i])
+            ret = 1;
+
+    return ret;
+}
+#endif
+
+
+/* case 15 */
+
+#if __ENABLE_HISTORY__
+#define HIST_FILE       "/tmp/ut_cli_hist"
+#define HIST_THREADS    (4)
+#define HIST_LINES      (500)
+
+/* in ut_cli_lib.o, cli.c built with __UT_CLI__ */
+uint32_t ut_cli_hist_claim(cli_hist_t *h, const char *line);
+void ut_cli_hist_seal(cli_hist_t *h, uint32_t ofs);
+
+static cli_hist_t       hist_mem;
+static char             term_15[512];
+static int              term_15_len;
+static char             ran_15[MAX_LINE + 1];
+
+static void term_15_putch(char c)
+{
+    if (term_15_len < sizeof(term_15) - 1)
+        term_15[term_15_len++] = c;
+}
+
+/* note the command line run, but for the command */
+static uint8_t ran_example(uint8_t len, char *param)
+{
+    ran_15[0] = '\0';
+    while (--len) {
+        strcat(ran_15, param);
+        if (len == 1)
+            break;
+        strcat(ran_15, " ");
+        param += strlen(param);
+        while (*param == '\0')
+            param++;
+    }
+    return 0;
+}
+
+static void *hist_writer(void *arg)
+{
+    char        line[16];
+    int         i;
+
+    for (i = 0; i < HIST_LINES; i++) {
+        snprintf(line, sizeof(line), "t%ld-%d", (long)arg, i);
+        cli_hist_add(&hist_mem, line);
+    }
+
+    return NULL;
+}
+
+static cmd_t   set_15[] =
+{
+    { "show",         "show",     ran_example },
+    { "set",          "set",      ran_example },
+    { "lo",           "logout",   cli_logout },
+    { NULL }
+};
+
+static uint32_t arena_15[(CLI_ARENA_SIZE + 3) / 4];
+
+static cli_t   cnf_15 =
+{
+    .state   = 1,
+    .put     = term_15_putch,
+    .cmd     = &set_15[0],
+    .arena   = arena_15
+};
+
+/* feed keys to the session, and check the command they ran, "" for none */
+static uint8_t hist_expect(cli_t *cb, cli_sess_t *s, const char *in,
+                           const char *ran)
+{
+    ran_15[0]   = '\0';
+    term_15_len = 0;
+    cli_input(cb, s, in, strlen(in));
+    term_15[term_15_len] = '\0';
+    if (getenv("UT_TERM"))
+        printf("%s\n", term_15);
+    printf("%s -> '%s'\n", in[0] == 0x12 ? "^R" : in[0] == 0x1b ? "^[" : in,
+           ran_15);
+    if (strcmp(ran_15, ran)) {
+        printf(" <- expected: %s\n", ran);
+        return 1;
+    }
+    return 0;
+}
+
+static uint8_t test_15(cli_t *cb)
+{
+    static uint32_t     idx[4096 / 8];
+    static uint32_t     mem[HIST_THREADS * HIST_LINES * 16 / 4];
+    pthread_t           tid[HIST_THREADS];
+    char                sess[CLI_SESS_BYTES];
+    cli_slab_t          slab;
+    cli_sess_t          *s;
+    cli_hist_t          *h;
+    uint32_t            *big;
+    int                 next[HIST_THREADS] = { 0 };
+    uint8_t             ret = 0;
+    long                t;
+    int                 i;
+    int                 k;
+    int                 n;
+
+    /* appends from several threads, each thread's in its order */
+    big = malloc(HIST_THREADS * HIST_LINES * sizeof(uint32_t));
+    cli_hist_init(&hist_mem, mem, sizeof(mem), big, HIST_THREADS * HIST_LINES);
+    for (t = 0; t < HIST_THREADS; t++)
+        pthread_create(&tid[t], NULL, hist_writer, (void *)t);
+    for (t = 0; t < HIST_THREADS; t++)
+        pthread_join(tid[t], NULL);
+
+    n = cli_hist_count(&hist_mem);
+    for (i = 0; i < n; i++) {
+        if (sscanf(cli_hist_get(&hist_mem, i), "t%ld-%d", &t, &k) != 2 ||
+            k != next[t]++) {
+            printf("entry %d out of order: %s\n", i, cli_hist_get(&hist_mem, i));
+            break;
+        }
+    }
+    printf("%d entries from %d threads, %u dropped\n", n, HIST_THREADS,
+           hist_mem.dropped);
+    if (n != HIST_THREADS * HIST_LINES || hist_mem.dropped || i != n)
+        ret = 1;
+    free(big);
+
+    /* an entry still being written is stepped over, not waited for */
+    memset(mem, 0, 256);
+    cli_hist_init(&hist_mem, mem, 256, idx, 256 / 8);
+    cli_hist_add(&hist_mem, "before");
+    k = ut_cli_hist_claim(&hist_mem, "late");
+    cli_hist_add(&hist_mem, "after");
+    n = cli_hist_count(&hist_mem);
+    printf("%d entries around one not sealed yet\n", n);
+    if (n != 2 || strcmp(cli_hist_get(&hist_mem, 1), "after"))
+        ret = 1;
+
+    /* and indexed at its place once sealed */
+    ut_cli_hist_seal(&hist_mem, k);
+    if (cli_hist_count(&hist_mem) != 3 ||
+        strcmp(cli_hist_get(&hist_mem, 1), "late") ||
+        strcmp(cli_hist_get(&hist_mem, 2), "after"))
+        ret = 1;
+
+    /* more writers dying than are watched do not stop the index */
+    for (i = 0; i <= HIST_HOLES; i++)
+        ut_cli_hist_claim(&hist_mem, "dead");
+    cli_hist_add(&hist_mem, "alive");
+    n = cli_hist_count(&hist_mem);
+    printf("%d entries around %d never sealed\n", n, HIST_HOLES + 1);
+    if (n != 4 || strcmp(cli_hist_get(&hist_mem, 3), "alive"))
+        ret = 1;
+
+    /* a full region counts what it drops, until rotated */
+    while (!(k = cli_hist_add(&hist_mem, "filler")))
+        ;
+    ret |= k != 1 || cli_hist_add(&hist_mem, "filler") != 2;
+    cli_hist_rotate(&hist_mem, 256);
+    ret |= hist_mem.dropped != 0;
+    while (!(k = cli_hist_add(&hist_mem, "filler")))
+        ;
+    ret |= k != 1;
+
+    /* a history file survives its process */
+    unlink(HIST_FILE);
+    h = hist_open(HIST_FILE, sizeof(idx) * 8);
+    cli_hist_add(h, "show version");
+    cli_hist_add(h, "set speed 9600");
+    hist_close(h);
+
+    h = hist_open(HIST_FILE, sizeof(idx) * 8);
+    printf("%u entries after reopening\n", cli_hist_count(h));
+    if (cli_hist_count(h) != 2)
+        ret = 1;
+
+    /* the sessions go through it with up, down and ctrl-r */
+    cb->hist = h;
+    cli_init(cb);
+    cli_slab_init(&slab, sess, sizeof(sess));
+    s = cli_sess_alloc(&slab);
+    cli_sess_start(cb, s);
+
+    ret |= hist_expect(cb, s, "show interfaces\n", "interfaces");
+    ret |= hist_expect(cb, s, "\x1b[A\x1b[A\n", "speed 9600");
+    ret |= hist_expect(cb, s, "\x1b[A\x1b[A\x1b[A\x1b[B\n", "interfaces");
+    ret |= hist_expect(cb, s, "\x12ver\n", "version");
+    ret |= hist_expect(cb, s, "\x12s\x12\x12\n", "speed 9600");
+    ret |= hist_expect(cb, s, "\x12spx\x07", "");
+    ret |= hist_expect(cb, s, "\x12ver\x1b[C 2\n", "version 2");
+    printf("%u entries\n", cli_hist_count(h));
+    if (cli_hist_count(h) != 8)
+        ret = 1;
+
+    /* the repeated line is noted once */
+    ret |= hist_expect(cb, s, "\x1b[A\n", "version 2");
+    if (cli_hist_count(h) != 8)
+        ret = 1;
+
+    /* rotation keeps the newest entries */
+    cli_hist_rotate(h, 64);
+    n = cli_hist_count(h);
+    printf("%d entries after rotation: %s .. %s\n", n, cli_hist_get(h, 0),
+           cli_hist_get(h, n - 1));
+    if (n < 1 || n > 4 || strcmp(cli_hist_get(h, n - 1), "show version 2"))
+        ret = 1;
+
+    /* the session which drops the first line is told */
+    cb->hist         = &hist_mem;
+    hist_mem.dropped = 0;
+    ret |= hist_expect(cb, s, "show full\n", "full");
+    ret |= !strstr(term_15, "history full, new lines are not kept\n");
+    ret |= hist_expect(cb, s, "show fuller\n", "fuller");
+    ret |= strstr(term_15, "history full") != NULL;
+    cb->hist = h;
+
+    cli_input(cb, s, "lo\n", 3);
+    cb->hist = NULL;
+    hist_close(h);
+    unlink(HIST_FILE);
+
+    return ret;
+}
+#endif
+
+
+/* case 16 */
+
+#if __ENABLE_SHARDS__
+#define SHARD_CONNS     (4)         // connections of a client
+#define SHARD_DEPTH     (16)        // lines sent before reading the output
+#define SHARD_MS        (300)       // how long each step of the benchmark runs
+
+static uint16_t         shard_port;
+static uint8_t          shard_stop;
+
+static uint8_t ping_example(uint8_t len, char *param)
+{
+    cli_puts("pong");
+    cli_putln();
+    return 0;
+}
+
+static cmd_t   set_16[] =
+{
+#if __ENABLE_CACHE__
+    { "ping",         "pong",     ping_example, .ttl = 1000 },
+#else
+    { "ping",         "pong",     ping_example },
+#endif
+    { "lo",           "logout",   cli_logout },
+    { NULL }
+};
+
+#if __ENABLE_CACHE__
+/* only sizes the cache of each shard, the shards do not share it */
+static cli_cache_ent_t  cache_ent_16[1];
+static cli_cache_t      cache_16 = { cache_now, 1, 0, 0, cache_ent_16 };
+#endif
+
+static cli_t   cnf_16 =
+{
+    .state   = 1,
+    .cmd     = &set_16[0],
+#if __ENABLE_CACHE__
+    .cache   = &cache_16,
+#endif
+};
+
+/* read until 'n' prompts came, -1 if the connection failed */
+static int shard_prompts(int fd, int n)
+{
+    char        buf[512];
+    ssize_t     len;
+    ssize_t     i;
+
+    while (n > 0) {
+        len = read(fd, buf, sizeof(buf));
+        if (len <= 0)
+            return -1;
+        for (i = 0; i < len; i++)
+            n -= buf[i] == '$';
+    }
+
+    return 0;
+}
+
+/* a connection to the shards, -1 if it failed */
+static int shard_connect(void)
+{
+    struct sockaddr_in  addr = { 0 };
+    struct timeval      tv   = { 2, 0 };
+    int                 fd   = socket(AF_INET, SOCK_STREAM, 0);
+
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(shard_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* a client of SHARD_CONNS connections, returns the number of commands run */
+static void *shard_client(void *arg)
+{
+    char                lines[SHARD_DEPTH * 5];
+    int                 fd[SHARD_CONNS];
+    long                done = 0;
+    int                 i;
+
+    for (i = 0; i < SHARD_DEPTH; i++)
+        memcpy(lines + i * 5, "ping\n", 5);
+
+    for (i = 0; i < SHARD_CONNS; i++) {
+        fd[i] = shard_connect();
+        if (fd[i] < 0 || shard_prompts(fd[i], 1))
+            return (void *)-1L;
+    }
+
+    while (!__atomic_load_n(&shard_stop, __ATOMIC_RELAXED)) {
+        for (i = 0; i < SHARD_CONNS; i++)
+            if (write(fd[i], lines, sizeof(lines)) != sizeof(lines))
+                return (void *)-1L;
+        for (i = 0; i < SHARD_CONNS; i++)
+            if (shard_prompts(fd[i], SHARD_DEPTH))
+                return (void *)-1L;
+        done += SHARD_CONNS * SHARD_DEPTH;
+    }
+
+    for (i = 0; i < SHARD_CONNS; i++)
+        close(fd[i]);
+
+    return (void *)done;
+}
+
+#if __ENABLE_LOGIN__
+static cli_sess_t       *shard_pending;
+
+/* a slow backend, net_knock_done() answers from the test's thread */
+static void shard_knock(char *id, char *pass)
+{
+    __atomic_store_n(&shard_pending, cli_sess(), __ATOMIC_RELEASE);
+}
+
+static cli_t   cnf_16_login =
+{
+    .state       = 0,
+    .cmd         = &set_16[0],
+    .knock_async = shard_knock,
+};
+
+/* read from 'fd' until 'want' came, -1 if it did not in time */
+static int shard_expect(int fd, const char *want)
+{
+    char        buf[256];
+    size_t      len = 0;
+    ssize_t     n;
+
+    while (len < sizeof(buf) - 1) {
+        n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n <= 0)
+            return -1;
+        len     += n;
+        buf[len] = '\0';
+        if (strstr(buf, want))
+            return 0;
+    }
+
+    return -1;
+}
+
+/* wait until the shard has closed 'n' connections */
+static void shard_closed(net_t *net, uint64_t n)
+{
+    net_stats_t st;
+
+    do {
+        usleep(1000);
+        net_stats(net, 0, &st);
+    } while (st.closed < n);
+}
+
+/* the session of the next knock */
+static cli_sess_t *shard_knocked(void)
+{
+    cli_sess_t  *s;
+
+    while (!(s = __atomic_exchange_n(&shard_pending, NULL, __ATOMIC_ACQ_REL)))
+        usleep(1000);
+
+    return s;
+}
+
+/* a login finished from another thread reaches its own connection */
+static uint8_t shard_login(void)
+{
+    net_t       *net = net_start(&cnf_16_login, 0, 1, 3, NULL);
+    cli_sess_t  *s;
+    int         a;
+    int         b;
+    int         c;
+    uint8_t     ret;
+
+    if (!net)
+        return 1;
+    shard_port = net_port(net);
+
+    a = shard_connect();
+    b = shard_connect();
+    ret = a < 0 || b < 0 || shard_expect(a, "login: ") ||
+          shard_expect(b, "login: ");
+
+    /* 'a' waits for the backend while 'b' is served last */
+    ret |= write(a, "u\np\n", 4) != 4 || shard_expect(a, "*\n");
+    s = shard_knocked();
+    ret |= write(b, "v\n", 2) != 2 || shard_expect(b, "password: ");
+
+    net_knock_done(net, s, 1);
+    ret |= shard_expect(a, "$ ");
+    ret |= write(a, "ping\n", 5) != 5 || shard_expect(a, "pong\n$ ");
+    printf("login finished by another thread: %s\n", ret ? "failed" : "ok");
+
+    /* a result coming after its peer left lets no one else in */
+    close(a);
+    shard_closed(net, 1);
+    a = shard_connect();
+    ret |= a < 0 || shard_expect(a, "login: ");
+    ret |= write(a, "u\np\n", 4) != 4 || shard_expect(a, "*\n");
+    s = shard_knocked();
+    close(a);
+    shard_closed(net, 2);
+
+    c = shard_connect();
+    ret |= c < 0 || shard_expect(c, "login: ");
+    ret |= write(c, "w\n", 2) != 2 || shard_expect(c, "password: ");
+    net_knock_done(net, s, 1);
+    ret |= write(c, "q\n", 2) != 2 || shard_expect(c, "*\n");
+    net_knock_done(net, shard_knocked(), 0);
+    ret |= shard_expect(c, "login failed\n");
+
+    /* and frees the session kept for it */
+    close(c);
+    shard_closed(net, 3);
+    a = shard_connect();
+    c = shard_connect();
+    ret |= a < 0 || shard_expect(a, "login: ");
+    ret |= c < 0 || shard_expect(c, "login: ");
+    close(c);
+    printf("login finished after its peer left: %s\n", ret ? "failed" : "ok");
+
+    close(a);
+    close(b);
+    net_stop(net);
+
+    return ret;
+}
+#endif
+
+#if __ENABLE_JOBS__
+static cli_job_t        job_16[2];
+static cli_jobs_t       jobs_16;
+static uint8_t          jobs_16_stop;
+static uint8_t          shard_hold;
+
+/* a job which ends when the test lets it, killed or not */
+static uint8_t hold_example(uint8_t len, char *param)
+{
+    __atomic_store_n(&shard_hold, 2, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&shard_hold, __ATOMIC_ACQUIRE))
+        usleep(1000);
+
+    cli_puts("held\n");
+    return 0;
+}
+
+static cmd_t   set_16_jobs[] =
+{
+    { "diag",         "diagnose", diag_example },
+    { "hold",         "hold",     hold_example },
+    { "fg",           "wait",     cli_fg },
+    { NULL }
+};
+
+static cli_t   cnf_16_jobs =
+{
+    .state = 1,
+    .cmd   = &set_16_jobs[0],
+    .jobs  = &jobs_16,
+};
+
+static void *shard_worker(void *arg)
+{
+    while (!__atomic_load_n(&jobs_16_stop, __ATOMIC_RELAXED))
+        if (!cli_job_run(&jobs_16))
+            usleep(1000);
+    return NULL;
+}
+
+/* the jobs of a connection end in its shard */
+static uint8_t shard_jobs(void)
+{
+    net_t       *net;
+    pthread_t   tid;
+    int         tries = 0;
+    int         a;
+    int         b;
+    uint8_t     ret;
+
+    cli_jobs_init(&jobs_16, job_16, 2);
+    net = net_start(&cnf_16_jobs, 0, 1, 1, NULL);
+    if (!net)
+        return 1;
+    shard_port   = net_port(net);
+    jobs_16_stop = 0;
+    pthread_create(&tid, NULL, shard_worker, NULL);
+
+    /* 'fg' returns at once, the output follows when the job is done */
+    a = shard_connect();
+    ret = a < 0 || shard_expect(a, "$ ");
+    ret |= write(a, "diag 50 &\nfg\n", 13) != 13 ||
+           shard_expect(a, "diag passed\n$ ");
+    printf("job shown by its shard: %s\n", ret ? "failed" : "ok");
+
+    /* the only session is kept while the job of its closed connection runs */
+    __atomic_store_n(&shard_hold, 1, __ATOMIC_RELEASE);
+    ret |= write(a, "hold &\n", 7) != 7 || shard_expect(a, "[2] hold\n");
+    while (__atomic_load_n(&shard_hold, __ATOMIC_ACQUIRE) != 2)
+        usleep(1000);
+    close(a);
+    shard_closed(net, 1);
+    b = shard_connect();
+    ret |= b >= 0 && !shard_expect(b, "$ ");
+    close(b);
+
+    /* and freed once it is done */
+    __atomic_store_n(&shard_hold, 0, __ATOMIC_RELEASE);
+    do {
+        b = shard_connect();
+        if (b >= 0 && !shard_expect(b, "$ "))
+            break;
+        close(b);
+        b = -1;
+        usleep(1000);
+    } while (++tries < 1000);
+    ret |= b < 0;
+    close(b);
+    printf("session kept until its job ended: %s\n", ret ? "failed" : "ok");
+
+    __atomic_store_n(&jobs_16_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(tid, NULL);
+    net_stop(net);
+
+    return ret;
+}
+#endif
+
+static uint8_t test_16(cli_t *cb)
+{
+    struct timespec     t0, t1;
+    pthread_t           tid[8];
+    net_stats_t         st;
+    net_t               *net;
+    void                *ret;
+    double              sec;
+    long                done;
+    uint64_t            lines;
+    uint64_t            lost;
+    uint8_t             fail = 0;
+    int                 max = sysconf(_SC_NPROCESSORS_ONLN);
+    int                 n;
+    int                 i;
+    cli_t               shared = *cb;
+#if __ENABLE_BACKOFF__
+    cli_backoff_t       backoff;
+#endif
+#if __ENABLE_LOG_QUEUE__
+    cli_logq_t          logq;
+#endif
+
+    /* what a single thread may use is not shared by the shards */
+#if __ENABLE_BACKOFF__
+    shared.backoff = &backoff;
+    fail |= net_start(&shared, 0, 1, 1, NULL) != NULL;
+    shared.backoff = NULL;
+#endif
+#if __ENABLE_LOG_QUEUE__
+    shared.logq = &logq;
+    fail |= net_start(&shared, 0, 1, 1, NULL) != NULL;
+#endif
+    if (fail)
+        return 1;
+
+    /* at least two shards even on one core, to run them side by side */
+    max = max < 2 ? 2 : max > 8 ? 8 : max;
+
+    for (n = 1; n <= max; n++) {
+        net = net_start(cb, 0, n, SHARD_CONNS * n, NULL);
+        if (!net)
+            return 1;
+        shard_port = net_port(net);
+        shard_stop = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < n; i++)
+            pthread_create(&tid[i], NULL, shard_client, NULL);
+        usleep(SHARD_MS * 1000);
+        __atomic_store_n(&shard_stop, 1, __ATOMIC_RELAXED);
+
+        done = 0;
+        for (i = 0; i < n; i++) {
+            pthread_join(tid[i], &ret);
+            if ((long)ret < 0)
+                done = -1;
+            else if (done >= 0)
+                done += (long)ret;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+        /* the clients are gone once every shard closed their connections */
+        lines = 0;
+        lost  = 0;
+        for (i = 0; i < n; i++) {
+            do {
+                usleep(1000);
+                net_stats(net, i, &st);
+            } while (st.closed < st.accepted);
+            lines += st.lines;
+            lost  += st.refused + st.dropped;
+            printf("  shard %d: %lu connections, %lu commands\n", i,
+                   (unsigned long)st.accepted, (unsigned long)st.lines);
+        }
+        net_stop(net);
+
+        printf("%d shard%s: %.0f commands/s\n", n, n > 1 ? "s" : "",
+               done / sec);
+        if (done <= 0 || lines != done || lost)
+            return 1;
+    }
+
+#if __ENABLE_LOGIN__
+    fail |= shard_login();
+#endif
+#if __ENABLE_JOBS__
+    fail |= shard_jobs();
+#endif
+
+    return fail;
+}
+#endif
+
+
+/* case 17 */
+
+#if __ENABLE_MIRROR__
+#define MIRROR_DEPTH    (8)
+#define MIRROR_READERS  (3)
+#define MIRROR_FILE     "/tmp/ut_cli_mirror"
+#define MIRROR_LINES    (3000)
+
+static char             term_17[64 * 1024];
+static int              term_17_len;
+static cli_mirror_t     mirror_17;
+static uint8_t          mirror_stop;
+static uint32_t         clock_17;
+
+static uint32_t mirror_now(void)
+{
+    return clock_17;
+}
+
+static void term_17_putch(char c)
+{
+    if (term_17_len < sizeof(term_17))
+        term_17[term_17_len++] = c;
+}
+
+static cmd_t   set_17[] =
+{
+    { "echo",         "echo",     echo_example },
+    { "lo",           "logout",   cli_logout },
+    { NULL }
+};
+
+static uint32_t arena_17[(CLI_ARENA_SIZE + 3) / 4];
+
+static cli_t   cnf_17 =
+{
+    .state   = 1,
+    .put     = term_17_putch,
+    .cmd     = &set_17[0],
+    .arena   = arena_17
+};
+
+typedef struct {
+    cli_mirror_reader_t r;
+    char                buf[sizeof(term_17)];
+    int                 len;
+    uint32_t            segs;
+} mirror_copy_t;
+
+/* append what the reader has to its copy */
+static void mirror_drain(mirror_copy_t *w)
+{
+    const char  *p;
+    uint16_t    len;
+
+    while ((p = cli_mirror_read(&w->r, &len)) != NULL) {
+        if (w->len + len <= sizeof(w->buf))
+            memcpy(w->buf + w->len, p, len);
+        w->len += len;
+        w->segs++;
+    }
+}
+
+/* a watcher on another thread */
+static void *mirror_watcher(void *arg)
+{
+    mirror_copy_t   *w = arg;
+
+    while (!__atomic_load_n(&mirror_stop, __ATOMIC_ACQUIRE))
+        mirror_drain(w);
+    mirror_drain(w);
+
+    return NULL;
+}
+
+static uint8_t mirror_same(const char *name, mirror_copy_t *w)
+{
+    int pend = mirror_17.fill ? mirror_17.fill->len : 0;
+
+    printf("%s: %d bytes in %u segments, %u skipped\n", name, w->len,
+           w->segs, w->r.skipped);
+
+    /* a reader which was never behind has all of it but the partial line */
+    if (!w->r.skipped)
+        return w->len + pend != term_17_len || memcmp(w->buf, term_17, w->len);
+
+    return w->segs + w->r.skipped != mirror_17.head;
+}
+
+static uint8_t test_17(cli_t *cb)
+{
+    static cli_mirror_seg_t seg[MIRROR_DEPTH + 1 + MIRROR_READERS];
+    static cli_mirror_seg_t *ring[MIRROR_DEPTH];
+    static mirror_copy_t    w[MIRROR_READERS];
+    cli_mirror_reader_t     log;
+    cli_mirror_reader_t     extra;
+    char                    sess[CLI_SESS_BYTES];
+    char                    line[16];
+    cli_slab_t              slab;
+    cli_sess_t              *s;
+    pthread_t               tid[2];
+    const char              *p;
+    uint16_t                len;
+    uint32_t                head;
+    FILE                    *f;
+    uint8_t                 ret = 0;
+    int                     i;
+
+    cli_mirror_init(&mirror_17, seg, sizeof(seg) / sizeof(seg[0]), ring,
+                    MIRROR_DEPTH, mirror_now);
+    cli_init(cb);
+    cli_slab_init(&slab, sess, sizeof(sess));
+    s = cli_sess_alloc(&slab);
+    cli_mirror_attach(s, &mirror_17);
+
+    /* a watcher kept up to date, a log file, and a watcher which naps */
+    ret |= !cli_mirror_open(&mirror_17, &w[0].r);
+    ret |= !cli_mirror_open(&mirror_17, &log);
+    ret |= !cli_mirror_open(&mirror_17, &w[2].r);
+    ret |= cli_mirror_open(&mirror_17, &extra);
+    f = fopen(MIRROR_FILE, "w");
+
+    cli_sess_start(cb, s);
+    for (i = 0; i < 200; i++) {
+        snprintf(line, sizeof(line), "echo %d\n", i);
+        cli_input(cb, s, line, strlen(line));
+
+        mirror_drain(&w[0]);
+        while ((p = cli_mirror_read(&log, &len)) != NULL)
+            fwrite(p, 1, len, f);
+    }
+    /* one segment per line, the prompt after it waits */
+    if (mirror_17.head != 200 || !mirror_17.fill)
+        ret = 1;
+
+    /* keys one at a time go out with their line, the prompt after MIRROR_MS */
+    head = mirror_17.head;
+    for (p = "echo x\n"; *p; p++)
+        cli_input(cb, s, p, 1);
+    if (mirror_17.head != head + 1)
+        ret = 1;
+    clock_17 += MIRROR_MS - 1;
+    cli_input(cb, s, "", 0);
+    if (mirror_17.head != head + 1)
+        ret = 1;
+    clock_17++;
+    cli_input(cb, s, "", 0);
+    if (mirror_17.head != head + 2 || mirror_17.fill)
+        ret = 1;
+
+    mirror_drain(&w[0]);
+    while ((p = cli_mirror_read(&log, &len)) != NULL)
+        fwrite(p, 1, len, f);
+    fclose(f);
+    mirror_drain(&w[2]);
+
+    ret |= mirror_same("watcher", &w[0]);
+    ret |= mirror_same("slow watcher", &w[2]);
+    if (!w[2].r.skipped)
+        ret = 1;
+
+    f = fopen(MIRROR_FILE, "r");
+    len = fread(w[1].buf, 1, sizeof(w[1].buf), f);
+    fclose(f);
+    unlink(MIRROR_FILE);
+    printf("log: %u bytes\n", len);
+    if (len != term_17_len || memcmp(w[1].buf, term_17, len))
+        ret = 1;
+
+    cli_mirror_close(&log);
+    for (i = 0; i < MIRROR_READERS; i += 2)
+        cli_mirror_close(&w[i].r);
+
+    /* watchers on other threads while the session goes on */
+    cli_mirror_init(&mirror_17, seg, sizeof(seg) / sizeof(seg[0]), ring,
+                    MIRROR_DEPTH, NULL);
+    term_17_len = 0;
+    mirror_stop = 0;
+    for (i = 0; i < 2; i++) {
+        memset(&w[i], 0, sizeof(w[i]));
+        cli_mirror_open(&mirror_17, &w[i].r);
+        pthread_create(&tid[i], NULL, mirror_watcher, &w[i]);
+    }
+
+    for (i = 0; i < MIRROR_LINES; i++) {
+        snprintf(line, sizeof(line), "echo %d\n", i);
+        cli_input(cb, s, line, strlen(line));
+        if (i % 16 == 0)
+            sched_yield();
+    }
+    __atomic_store_n(&mirror_stop, 1, __ATOMIC_RELEASE);
+
+    for (i = 0; i < 2; i++) {
+        pthread_join(tid[i], NULL);
+        ret |= mirror_same("watcher thread", &w[i]);
+        cli_mirror_close(&w[i].r);
+    }
+
+    cli_input(cb, s, "lo\n", 3);
+
+    return ret;
+}
+#endif
+
+
+/* case 18 */
+
+#if __ENABLE_ALIAS__
+#define ALIAS_ROUNDS    (200000)
+
+static cmd_t   set_18_4[] =
+{
+    { "main",         "table",    echo_example },
+    { NULL }
+};
+
+static cmd_t   set_18_3[] =
+{
+    { "table",        "tables",   NULL,          set_18_4 },
+    { NULL }
+};
+
+static cmd_t   set_18_2[] =
+{
+    { "route",        "routes",   NULL,          set_18_3 },
+    { NULL }
+};
+
+static cmd_t   set_18_1[] =
+{
+    { "ip",           "ip",       NULL,          set_18_2 },
+    { NULL }
+};
+
+static cli_t   cnf_18;
+
+/* in ut_cli_lib.o, cli.c built with __UT_CLI__ */
+char *ut_cli_tok(int i);
+
+/* echo, after resolving the aliases again */
+static uint8_t refresh_18(uint8_t len, char *param)
+{
+    cli_alias_refresh(&cnf_18);
+    if (ut_cli_tok(1) != param)
+        cli_puts("tokens lost\n");
+
+    return echo_example(len, param);
+}
+
+static cmd_t   set_18[] =
+{
+    { "show",         "show",     NULL,          set_18_1 },
+    { "echo",         "echo",     echo_example },
+    { "refresh",      "refresh",  refresh_18 },
+    { "alias",        "aliases",  cli_alias },
+#if !__ENABLE_JOBS__ && !__ENABLE_SHARDS__
+    { "unalias",      "unalias",  cli_unalias },
+#endif
+    { NULL }
+};
+
+static cli_alias_ent_t  ent_18[8];
+static cli_alias_t      alias_18;
+static uint32_t         arena_18[(CLI_ARENA_SIZE + 3) / 4];
+
+static cli_t   cnf_18 =
+{
+    .state = 1,
+    .cmd   = &set_18[0],
+    .arena = arena_18,
+    .alias = &alias_18,
+};
+
+#if __ENABLE_MODULES__
+static uint8_t hello_again(uint8_t len, char *param)
+{
+    cli_puts("hello again\n");
+    return 0;
+}
+
+static cmd_t   mod_18b_cmd[] =
+{
+    { "hello",        "greeting", hello_again },
+    { NULL }
+};
+
+static cli_mod_t   mod_18b = { .level = set_18, .cmd = mod_18b_cmd };
+
+/* a module of its own 'hello' goes first */
+static uint8_t swap_18(uint8_t len, char *param)
+{
+    cli_attach(&mod_18b);
+    return 0;
+}
+
+static cmd_t   mod_18_cmd[] =
+{
+    { "hello",        "greeting", hello_example },
+    { "swap",         "swap",     swap_18 },
+    { NULL }
+};
+
+static cli_mod_t   mod_18 = { .level = set_18, .cmd = mod_18_cmd };
+#endif
+
+static uint8_t alias_expect(cli_t *cb, const char *line, const char *want)
+{
+    char        buf[256];
+    cli_sink_t  out = { .buf = buf, .size = sizeof(buf) };
+
+    cli_exec(cb, line, strlen(line), &out);
+    if (strcmp(buf, want)) {
+        printf("'%s': '%s' instead of '%s'\n", line, buf, want);
+        return 1;
+    }
+
+    return 0;
+}
+
+static double alias_rate(cli_t *cb, const char *line)
+{
+    char            buf[64];
+    cli_sink_t      out = { .buf = buf, .size = sizeof(buf) };
+    struct timespec t0, t1;
+    size_t          len = strlen(line);
+    int             i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < ALIAS_ROUNDS; i++)
+        cli_exec(cb, line, len, &out);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    return ALIAS_ROUNDS / ((t1.tv_sec - t0.tv_sec) +
+                           (t1.tv_nsec - t0.tv_nsec) / 1e9);
+}
+
+static uint8_t test_18(cli_t *cb)
+{
+    char        buf[256];
+    char        help[256];
+    cli_sink_t  out = { .buf = buf, .size = sizeof(buf) };
+    uint8_t     ret = 0;
+    double      full;
+    double      short_;
+
+    cli_alias_init(&alias_18, ent_18, sizeof(ent_18) / sizeof(ent_18[0]));
+    cli_init(cb);
+
+    /* the arguments go after the resolved path */
+    ret |= !cli_alias_define(cb, "rt", "show ip route table main");
+    ret |= alias_expect(cb, "rt 10.0.0.0 dev eth0", "10.0.0.0 dev eth0 \n");
+    ret |= alias_expect(cb, "rt", "\n");
+
+    /* help is left to the dispatch */
+    cli_exec(cb, "show ip route table ?", 21, &out);
+    strcpy(help, buf);
+    ret |= !cli_alias_define(cb, "tables", "show ip route table ?");
+    ret |= alias_expect(cb, "tables", help);
+
+    /* a macro, the arguments go to its last line */
+    ret |= !cli_alias_define(cb, "both", " echo one ;show ip route table main");
+    ret |= alias_expect(cb, "both two", "one \ntwo \n");
+
+    /* what cannot be defined */
+    ret |= cli_alias_define(cb, "echo", "echo x");
+    ret |= cli_alias_define(cb, "a b", "echo x");
+    ret |= cli_alias_define(cb, "0123456789abcdefg", "echo x");
+    ret |= cli_alias_define(cb, "bad", "echo x; nope");
+    ret |= cli_alias_define(cb, "many", "echo 1; echo 2; echo 3; echo 4; echo 5");
+    ret |= alias_expect(cb, "bad", "bad unknown command\n");
+
+    /* at most half of the table */
+    ret |= !cli_alias_define(cb, "x1", "echo x1");
+    ret |= cli_alias_define(cb, "x2", "echo x2");
+    cli_alias_undef(cb, "x1");
+    ret |= !cli_alias_define(cb, "x2", "echo x2");
+    ret |= alias_expect(cb, "x1", "x1 unknown command\n");
+    ret |= alias_expect(cb, "x2", "x2 \n");
+    cli_alias_undef(cb, "x2");
+
+#if __ENABLE_MODULES__
+    /* a changed tree is dispatched as text until refreshed */
+    cli_attach(&mod_18);
+    ret |= !cli_alias_define(cb, "hi", "hello");
+    ret |= alias_expect(cb, "hi", "hello\n");
+    cli_detach(&mod_18);
+    ret |= alias_expect(cb, "hi", "hello unknown command\n");
+    ret |= alias_expect(cb, "rt 1", "1 \n");
+    cli_alias_refresh(cb);
+    ret |= alias_expect(cb, "hi", "hi unknown command\n");
+    ret |= alias_expect(cb, "rt 1", "1 \n");
+
+    /* the steps after one which changed the tree go to the dispatch */
+    cli_attach(&mod_18);
+    ret |= !cli_alias_define(cb, "hi2", "swap; hello");
+    ret |= alias_expect(cb, "hi2", "hello again\n");
+    cli_detach(&mod_18b);
+    cli_detach(&mod_18);
+    cli_alias_undef(cb, "hi2");
+#endif
+
+    /* a refresh leaves the tokens of the line it runs in */
+    ret |= alias_expect(cb, "refresh a b", "a b \n");
+
+    /* the built-in commands, which only list with other threads around */
+#if __ENABLE_JOBS__ || __ENABLE_SHARDS__
+    ret |= alias_expect(cb, "alias up echo a; echo b", "aliases are fixed\n");
+    ret |= !cli_alias_define(cb, "up", "echo a; echo b");
+#else
+    ret |= alias_expect(cb, "alias up echo a; echo b", "");
+    ret |= alias_expect(cb, "alias echo x", "alias not defined\n");
+#endif
+    ret |= alias_expect(cb, "up", "a \nb \n");
+    cli_exec(cb, "alias", 5, &out);
+    printf("aliases:\n%s", buf);
+    if (!strstr(buf, "up echo a; echo b\n") ||
+        !strstr(buf, "rt show ip route table main\n"))
+        ret = 1;
+#if __ENABLE_JOBS__ || __ENABLE_SHARDS__
+    cli_alias_undef(cb, "up");
+#else
+    ret |= alias_expect(cb, "unalias up", "");
+#endif
+    ret |= alias_expect(cb, "up", "up unknown command\n");
+
+    full   = alias_rate(cb, "show ip route table main 10.0.0.0");
+    short_ = alias_rate(cb, "rt 10.0.0.0");
+    printf("full path: %.0f lines/s, alias: %.0f lines/s\n", full, short_);
+
+    return ret;
+}
+#endif
+
+/* case 19 */
+
+#if __ENABLE_WATCH__
+static char     term_19[4096];
+static int      term_19_len;
+static int      term_19_mark;
+static int      frames_19;
+
+static void term_19_putch(char c)
+{
+    if (term_19_len < sizeof(term_19) - 1)
+        term_19[term_19_len++] = c;
+}
+
+/* a key once the second frame is drawn */
+static uint8_t term_19_wait(uint16_t ms)
+{
+    return frames_19 == 2;
+}
+
+static char term_19_getch(void)
+{
+    return 'q';
+}
+
+/* five lines, then one */
+static uint8_t shrink_example(uint8_t len, char *param)
+{
+    if (frames_19++) {
+        term_19_mark = term_19_len;
+        cli_puts("one\n");
+    } else {
+        cli_puts("one\ntwo\nthree\nfour\nfive\n");
+    }
+    return 0;
+}
+
+static cmd_t   set_19[] =
+{
+    { "shrink",       "shrink",   shrink_example },
+    { "watch",        "repeat",   cli_watch },
+    { NULL }
+};
+
+static cli_t   cnf_19 =
+{
+    .state = 1,
+    .get   = term_19_getch,
+    .put   = term_19_putch,
+    .wait  = term_19_wait,
+    .cmd   = &set_19[0]
+};
+
+static uint8_t test_19(cli_t *cb)
+{
+    /* the rows of the lines gone are erased, the cursor goes below "one" */
+    const char  *want = "\x1b[4;1H\x1b[K\x1b[5;1H\x1b[K\x1b[6;1H\x1b[K"
+                        "\x1b[7;1H\x1b[K\x1b[4;1H";
+    cli_sink_t  out   = { .put = term_19_putch };
+    int         i;
+
+    cli_init(cb);
+    cli_exec(cb, "watch shrink", 12, &out);
+    term_19[term_19_len] = '\0';
+
+    printf("second frame:");
+    for (i = term_19_mark; i < term_19_len; i++)
+        printf(term_19[i] == 0x1b ? " ESC" : "%c", term_19[i]);
+    printf("\n");
+
+    return frames_19 != 2 || strcmp(term_19 + term_19_mark, want);
+}
+#endif
+
+/* case 20 */
+
+#if __ENABLE_LOG_QUEUE__
+#define LOGQ_PRODUCERS  (4)
+#define LOGQ_MSGS       (5000)
+
+static cli_logq_t       log_q20;
+static cli_log_slot_t   log_slot20[8];
+static char             term_20[128];
+static int              term_20_len;
+static int              log_next20[LOGQ_PRODUCERS];
+static char             raw_20[64];
+static int              raw_20_len = -1;    // -1 if not captured
+static uint8_t          log_live20;
+static uint32_t         log_got20;
+static uint32_t         log_lost20;
+static uint8_t          log_bad20;
+
+/* checks each message as its line ends */
+static void term_20_putch(char c)
+{
+    int         id;
+    int         n;
+    unsigned    lost;
+
+    if (raw_20_len >= 0 && raw_20_len < sizeof(raw_20) - 1)
+        raw_20[raw_20_len++] = c;
+
+    if (c == '\r' || term_20_len == sizeof(term_20) - 1) {
+        term_20_len = 0;
+        return;
+    }
+    term_20[term_20_len++] = c;
+    term_20[term_20_len]   = '\0';
+
+    if (!strcmp(term_20, "\x1b[K"))
+        term_20_len = 0;
+    if (c != '\n')
+        return;
+
+    if (sscanf(term_20, "p%d %d", &id, &n) == 2) {
+        if (id >= LOGQ_PRODUCERS || n < log_next20[id])
+            log_bad20 = 1;
+        log_next20[id] = n + 1;
+        log_got20++;
+    } else if (sscanf(term_20, "%u log messages dropped", &lost) == 1) {
+        log_lost20 += lost;
+    }
+    term_20_len = 0;
+}
+
+static cli_t   cnf_20 =
+{
+    .state = 1,
+    .put   = term_20_putch,
+    .cmd   = &set_4[0],
+    .logq  = &log_q20
+};
+
+static void *logq_producer(void *arg)
+{
+    char        msg[32];
+    long        dropped = 0;
+    int         i;
+
+    for (i = 0; i < LOGQ_MSGS; i++) {
+        snprintf(msg, sizeof(msg), "p%ld %d", (long)arg, i);
+        dropped += !cli_log(&log_q20, msg);
+        /* let the reader in now and then, not only once the queue is full */
+        if (i % 8 == 7)
+            sched_yield();
+    }
+    __atomic_fetch_add(&log_live20, 1, __ATOMIC_RELEASE);
+    return (void *)dropped;
+}
+
+static uint8_t test_20(cli_t *cb)
+{
+    char        sess[CLI_SESS_BYTES];
+    pthread_t   t[LOGQ_PRODUCERS];
+    cli_slab_t  slab;
+    cli_sess_t  *s;
+    void        *dropped;
+    uint32_t    lost = 0;
+    uint8_t     ret  = 0;
+    long        i;
+
+    cli_logq_init(&log_q20, log_slot20, 8);
+    cli_init(cb);
+    cli_slab_init(&slab, sess, sizeof(sess));
+    s = cli_sess_alloc(&slab);
+    cli_sess_start(cb, s);
+
+    /* a message goes above the line being edited, which is drawn again */
+    cli_input(cb, s, "ec", 2);
+    cli_log(&log_q20, "disk full");
+    raw_20_len = 0;
+    cli_input(cb, s, "", 0);
+    raw_20[raw_20_len] = '\0';
+    raw_20_len         = -1;
+    printf("redraw: %s\n", raw_20 + 4);
+    if (strcmp(raw_20, "\r\x1b[Kdisk full\n$ ec"))
+        ret = 1;
+
+    /* several producers against one reader */
+    for (i = 0; i < LOGQ_PRODUCERS; i++)
+        pthread_create(&t[i], NULL, logq_producer, (void *)i);
+    while (__atomic_load_n(&log_live20, __ATOMIC_ACQUIRE) < LOGQ_PRODUCERS) {
+        cli_input(cb, s, "", 0);
+        sched_yield();
+    }
+    for (i = 0; i < LOGQ_PRODUCERS; i++) {
+        pthread_join(t[i], &dropped);
+        lost += (long)dropped;
+    }
+    cli_input(cb, s, "", 0);
+
+    printf("%u delivered, %u reported dropped, %u dropped\n", log_got20,
+           log_lost20, lost);
+    if (log_bad20 || log_lost20 != lost ||
+        log_got20 + lost != LOGQ_PRODUCERS * LOGQ_MSGS)
+        ret = 1;
+
+    return ret;
+}
+#endif
+
+/****************************************************************************/
+
+struct case_t {
+    char        *name;
+    cli_t       *conf;
+    char        *desc;
+    test_fptr   fptr;
+} all[] = {
+    { "name_len", &cnf_1, "description indentation test", test_1 },
+    { "run",      &cnf_2, "logout command test",          test_2 },
+    { "tokens",   &cnf_3, "token handling",               test_3 },
+    { "exec",     &cnf_4, "programmatic execution",       test_4 },
+#if __ENABLE_LOG_QUEUE__
+    { "log",      &cnf_5, "asynchronous log messages",    test_5 },
+#endif
+#if __ENABLE_RX_RING__
+    { "vuart",    &cnf_6, "rx ring under load",           test_6 },
+#endif
+    { "slab",     &cnf_7, "many sessions from a slab",    test_7 },
+#if __ENABLE_MODULES__
+    { "modules",  &cnf_8, "commands attached at runtime", test_8 },
+#endif
+#if __ENABLE_LAZY_CMD__
+    { "lazy",     &cnf_9, "lazy sub commands",            test_9 },
+#endif
+    { "batch",    &cnf_10, "batch of long lines",         test_10 },
+#if __ENABLE_CACHE__
+    { "cache",    &cnf_11, "cached command output",       test_11 },
+#endif
+#if __ENABLE_JOBS__
+    { "jobs",     &cnf_12, "background jobs",             test_12 },
+#endif
+#if __ENABLE_LOGIN__
+    { "cred",     &cnf_13, "credential store",            test_13 },
+#endif
+#if __ENABLE_LOGIN__ && __ENABLE_BACKOFF__
+    { "auth",     &cnf_14, "pending logins and backoff",  test_14 },
+#endif
+#if __ENABLE_HISTORY__
+    { "history",  &cnf_15, "shared command history",      test_15 },
+#endif
+#if __ENABLE_SHARDS__
+    { "shards",   &cnf_16, "sharded network front end",   test_16 },
+#endif
+#if __ENABLE_MIRROR__
+    { "mirror",   &cnf_17, "session output to watchers",  test_17 },
+#endif
+#if __ENABLE_ALIAS__
+    { "alias",    &cnf_18, "pre-resolved aliases",        test_18 },
+#endif
+#if __ENABLE_WATCH__
+    { "watch",    &cnf_19, "watch frame shrinking",       test_19 },
+#endif
+#if __ENABLE_LOG_QUEUE__
+    { "logq",     &cnf_20, "log queue under producers",   test_20 },
+#endif
 };
 
 /****************************************************************************/
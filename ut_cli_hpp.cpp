@@ -0,0 +1,120 @@
+#include <cstdio>
+#include <cstring>
+
+#include "cli.hpp"
+
+/****************************************************************************
+ *
+ * The C++ command table layer. Everything checked by static_assert is
+ * resolved by the compiler, the rest runs the tables through mini-CLI.
+ *
+ * Build with -DUT_DUPLICATE to see a duplicate name rejected.
+ *
+ ****************************************************************************/
+
+static uint8_t ls_example(uint8_t len, char *param)
+{
+    cli_puts("ls ");
+    cli_putd(len);
+    cli_putln();
+    return 0;
+}
+
+static uint8_t ls_all(uint8_t len, char *param)
+{
+    cli_puts("all");
+    cli_putln();
+    return 0;
+}
+
+static constexpr auto ls_opts = cli::make_table(
+    cli::cmd("-l",          "long",             ls_example),
+    cli::cmd("-a",          "all",              ls_all),
+    cli::cmd("--recursive", "subdirectories",   ls_all));
+
+static constexpr auto root = cli::make_table(
+    cli::cmd("ls",          "list",             ls_example, ls_opts),
+    cli::cmd("lo",          "logout",           cli_logout),
+    cli::cmd("debug",       "\x01 hidden",      ls_example),
+#if __ENABLE_CACHE__
+    cli::cached(cli::cmd("mem", "memory dump",  cli_mem), 1000));
+#else
+    cli::cmd("mem",         "memory dump",      cli_mem));
+#endif
+
+#ifdef UT_DUPLICATE
+static constexpr auto dup = cli::make_table(
+    cli::cmd("ok",          "first",            ls_example),
+    cli::cmd("ok",          "second",           ls_example));
+#endif
+
+static_assert(root.cmd[4].cmd == nullptr, "terminated like a C table");
+static_assert(root.width == 3, "hidden commands are not in help");
+static_assert(root.find("mem") == &root.cmd[3], "sorted lookup");
+static_assert(root.find("m") == nullptr, "no prefix match");
+static_assert(cli::find(root, "ls", "-a") == &ls_opts.cmd[1], "nested");
+#if __ENABLE_CMD_INDEX__
+static_assert(root.cmd[0].count == 4 && root.cmd[0].width == 3, "in cmd_t");
+static_assert(root.cmd[root.cmd[1].order].cmd[0] == 'l' &&
+              root.cmd[root.cmd[2].order].cmd[1] == 's', "order in cmd_t");
+#endif
+static_assert(cli::find(root, "ls", "-x") == nullptr, "nested miss");
+
+
+/****************************************************************************/
+
+static uint32_t arena[(CLI_ARENA_SIZE + 3) / 4];
+
+int main(int argc, char *argv[])
+{
+    cli_t       cb{};
+    char        buf[64];
+    char        help[256];
+    cli_sink_t  out{};
+    size_t      n;
+
+    cb.state = 1;
+    cb.cmd   = root;
+    cb.arena = arena;
+    cli_init(&cb);
+
+    out.buf  = buf;
+    out.size = sizeof(buf);
+
+    n = cli_exec(&cb, "ls -a", 5, &out);
+    printf("%zu bytes: %s", n, buf);
+    if (strcmp(buf, "all\n"))
+        return 1;
+
+    n = cli_exec(&cb, "ls", 2, &out);
+    printf("%zu bytes: %s", n, buf);
+    if (strcmp(buf, "ls 1\n"))
+        return 1;
+
+    /* every command of the table is found, whatever its place by name */
+    n = cli_exec(&cb, "ls --recursive", 14, &out);
+    printf("%zu bytes: %s", n, buf);
+    if (strcmp(buf, "all\n"))
+        return 1;
+
+    n = cli_exec(&cb, "mem x", 5, &out);
+    if (strstr(buf, "unknown"))
+        return 1;
+
+    n = cli_exec(&cb, "ls -b", 5, &out);
+    printf("%zu bytes: %s", n, buf);
+    if (!strstr(buf, "unknown"))
+        return 1;
+
+#if __ENABLE_CMD_INDEX__
+    /* help is aligned to the longest name from the first line on */
+    out.size = sizeof(help);
+    out.buf  = help;
+    cli_exec(&cb, "ls ?", 4, &out);
+    printf("%s", help);
+    if (strncmp(help, "-l          - long\n", 19))
+        return 1;
+#endif
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "vuart.h"
+
+/*
+ * A virtual UART to exercise cli_rx_t on POSIX.
+ *
+ * A thread plays the receive interrupt: it pushes the script into the ring
+ * one FIFO at a time, paced at the baud rate. Bytes which do not fit into
+ * the ring are lost, as with a real overrun.
+ */
+
+#define VUART_FIFO      (16)
+
+static cli_rx_t         *vuart_rx;
+static const char       *vuart_script;
+static uint32_t         vuart_baud;
+static pthread_t        vuart_thread;
+static pthread_mutex_t  vuart_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   vuart_cond = PTHREAD_COND_INITIALIZER;
+static int              vuart_woken;
+
+static void vuart_sleep(uint16_t ms)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec  += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&vuart_lock);
+    while (!vuart_woken)
+        if (pthread_cond_timedwait(&vuart_cond, &vuart_lock, &ts) == ETIMEDOUT)
+            break;
+    vuart_woken = 0;
+    pthread_mutex_unlock(&vuart_lock);
+}
+
+static void vuart_wake(void)
+{
+    pthread_mutex_lock(&vuart_lock);
+    vuart_woken = 1;
+    pthread_cond_signal(&vuart_cond);
+    pthread_mutex_unlock(&vuart_lock);
+}
+
+static void *vuart_isr(void *arg)
+{
+    const char      *p    = vuart_script;
+    size_t          left  = strlen(p);
+    long            burst = 10L * VUART_FIFO * 1000000000L / vuart_baud;
+    struct timespec ts;
+    uint16_t        n;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    while (left) {
+        ts.tv_nsec += burst;
+        while (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+        n = left < VUART_FIFO ? left : VUART_FIFO;
+        cli_rx_push(vuart_rx, p, n);
+        p    += n;
+        left -= n;
+    }
+
+    return NULL;
+}
+
+void vuart_init(cli_rx_t *rx, char *buf, uint16_t n)
+{
+    cli_rx_init(rx, buf, n);
+    rx->sleep = vuart_sleep;
+    rx->wake  = vuart_wake;
+    vuart_rx  = rx;
+}
+
+void vuart_start(const char *script, uint32_t baud)
+{
+    vuart_script = script;
+    vuart_baud   = baud;
+    pthread_create(&vuart_thread, NULL, vuart_isr, NULL);
+}
+
+void vuart_join(void)
+{
+    pthread_join(vuart_thread, NULL);
+}
+
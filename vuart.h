@@ -0,0 +1,10 @@
+
+
+#include <stdint.h>
+
+#include "cli.h"
+
+void vuart_init(cli_rx_t *rx, char *buf, uint16_t n);
+void vuart_start(const char *script, uint32_t baud);
+void vuart_join(void);
+